@@ -0,0 +1,77 @@
+#!/usr/bin/env python
+#
+# EZ-USB C2 EEPROM image (fw.inc) -> pre-parsed firmware segments
+#
+# Adjacent records are coalesced into one segment, the trailing CPUCS
+# write is dropped (cusbfx2 starts the 8051 itself) and the offset of the
+# device descriptor's bcdDevice is located so that it can be patched
+# without scanning the image at run time.
+
+import re
+import sys
+
+CPUCS = 0xE600
+DESCRIPTOR_PATTERN = [0xB4, 0x04, 0x04, 0x10, 0x00, 0x00] # VID=04B4 PID=1004 BCD=0000
+BCD_OFFSET = 4
+
+def read_image(path):
+    text = open(path).read()
+    return [int(x, 16) for x in re.findall(r'0x([0-9a-fA-F]{2})', text)]
+
+def parse_records(image):
+    if image[0] != 0xC2:
+        raise ValueError('not a C2 EEPROM image')
+    records = []
+    p = 8
+    while True:
+        length = (image[p] << 8) | image[p + 1]
+        address = (image[p + 2] << 8) | image[p + 3]
+        p += 4
+        records.append((address, image[p:p + (length & 0x7FFF)]))
+        if length & 0x8000:
+            break
+        p += length
+    return records
+
+def coalesce(records):
+    segments = []
+    for address, data in records:
+        if address == CPUCS:
+            continue
+        if segments and segments[-1][0] + len(segments[-1][1]) == address:
+            segments[-1][1].extend(data)
+        else:
+            segments.append((address, list(data)))
+    return segments
+
+def find_patch(data):
+    n = len(DESCRIPTOR_PATTERN)
+    for i in range(len(data) - n + 1):
+        if data[i:i + n] == DESCRIPTOR_PATTERN:
+            return i + BCD_OFFSET
+    return -1
+
+def main():
+    segments = coalesce(parse_records(read_image(sys.argv[1])))
+    data = []
+    for address, bytes in segments:
+        data.extend(bytes)
+
+    out = sys.stdout
+    out.write('/* generated by firmware/fw2segments.py from fw.inc -- DO NOT EDIT */\n')
+    out.write('static const guint8 st_firmware_image[] = {\n')
+    for i in range(0, len(data), 16):
+        out.write(''.join(['0x%02x,' % b for b in data[i:i + 16]]) + '\n')
+    out.write('};\n\n')
+
+    out.write('static const cusbfx2_firmware_segment st_firmware_segments[] = {\n')
+    offset = 0
+    for address, bytes in segments:
+        out.write('\t{ 0x%04x, %5d, %5d },\n' % (address, len(bytes), offset))
+        offset += len(bytes)
+    out.write('};\n\n')
+
+    out.write('#define FIRMWARE_PATCH_OFFSET %d\n' % find_patch(data))
+
+if __name__ == '__main__':
+    main()
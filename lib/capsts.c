@@ -6,51 +6,247 @@
 #include "cusbfx2.h"
 #include "capsts.h"
 
-/* CUSBFX2のCAPSTSファームウェア */
-static guint8 st_firmware[] =
-#include "fw.inc"
+/* CUSBFX2のCAPSTSファームウェア (fw.inc から生成した区間) */
+#include "fw_segments.inc"
 #define FIRMWARE_ID "FX2_FIFO_ATTY20080414"
 
-static GByteArray *st_cmd_queue = NULL; /* CAPSTSファームウェアコマンドの送信キュー */
+static const cusbfx2_firmware st_firmware = {
+	FIRMWARE_ID,
+	st_firmware_image, sizeof(st_firmware_image),
+	st_firmware_segments, G_N_ELEMENTS(st_firmware_segments),
+	FIRMWARE_PATCH_OFFSET
+};
 
-static GArray *st_ir_cmd_queue = NULL; /* IRコマンドの送信キュー */
-static gint st_ir_base = 0;		/** IRのベースチャンネル */
+/* CAPSTSファームウェアを載せた CUSBFX2 ごとの状態 */
+struct CapSts {
+	gint fx2id;
+	cusbfx2_handle *device;
+
+	GByteArray *cmd_queue;		/* CAPSTSファームウェアコマンドの送信キュー */
+	gint cmd_reply_length;		/* cmd_queue のコマンドが返す応答のバイト数 */
+
+	/* 非同期コマンドチャネル */
+	GMutex *request_mutex;
+	GQueue *requests;			/* 送信を待つ CapStsRequest (先頭が転送中) */
+
+	GThread *tuner_thread;		/* capsts_adjust_tuner_channel_async() のスレッド */
+
+	GArray *ir_cmd_queue;		/* IRコマンドの送信キュー */
+	gint ir_base;				/* IRのベースチャンネル */
+	gboolean is_ir_macro;		/* IRコマンドを波形にまとめて送る */
+	guint ir_wave_delay;		/* 次の波形を出力し始めるまでの最大の遅れ (20us 単位) */
+};
+
+/* IRマクロ (ファームウェアの ir_wbuf による波形出力)
+ *
+ * ir_wbuf の各バイトは bit0 が出力レベル、残りがその長さ (20us 単位, 偶数) で、
+ * ファームウェアは CMD_IR_CODE 0xffff の間、ir_wbuf を繰り返し出力する。
+ * 時間はファームウェアがコマンドから生成する信号 (timer.c) に合わせている。
+ * ファームウェアはキーを押している間フレームを繰り返すので、キーごとに同じフレームを
+ * IR_WAVE_KEY_REPEAT 回、ファームウェアと同じ間隔で繰り返して押し続けた状態を再現する。
+ * 出力は止めた時に出力中だった長さの残りを数え終えてから始まる (最初は 256)。
+ */
+#define IR_TICK_USEC 20
+#define IR_WAVE_MAX_TICKS 254		/* 1 バイトで表せる最大の長さ */
+#define IR_WAVE_MAX_LEN 250			/* ir_wbuf (256) に収める波形の長さ */
+#define IR_WAVE_FIRST_DELAY 256		/* 一度も出力していない時の出力開始の遅れ */
+#define IR_WAVE_KEY_GAP (60000 / IR_TICK_USEC)	/* キーの間の無信号時間 */
+#define IR_WAVE_KEY_REPEAT 3		/* キー 1 つで送るフレーム数 */
+#define IR_WAVE_REPEAT_GAP (24000 / IR_TICK_USEC)	/* 繰り返すフレームの間の無信号時間 */
+#define IR_WAVE_HEADER_LOW (2300 / IR_TICK_USEC)
+#define IR_WAVE_HEADER_HIGH (1100 / IR_TICK_USEC)
+#define IR_WAVE_MARK (600 / IR_TICK_USEC)
+#define IR_WAVE_BIT1 (1600 / IR_TICK_USEC)
+#define IR_WAVE_BIT0 (500 / IR_TICK_USEC)
+#define IR_WBUF_CHUNK (64 - 3)		/* EP1 の 1 パケットに収まる CMD_IR_WBUF のデータ長 */
+#define IR_WBUF_LAST_CHUNK (64 - 3 - 3)	/* 最後の CMD_IR_CODE と同じパケットに収まる長さ */
+
+#define CMD_PACKET_SIZE 64			/* EP1 の最大パケット長 */
+#define CAPSTS_WAIT_INTERVAL (10 * 1000)	/* 完了を待つ間に USB のイベントを処理する間隔 */
+
+/**
+ * capsts_cmd_commit_async() で送るコマンドの一まとまり。
+ *
+ * ファームウェアの応答には対応する要求の印が無いので、デバイスごとに
+ * 一つずつ送って応答を読み切ってから次を送ることで、応答と要求を対応させる。
+ */
+typedef struct {
+	CapSts *device;
+	GByteArray *commands;
+	gint reply_length;			/* 期待する応答のバイト数 */
+	GByteArray *reply;			/* 受信した応答 */
+	CapStsCmdCallback callback;
+	gpointer user_data;
+} CapStsRequest;
+
+/* capsts_cmd_commit_read() で完了を待つための状態 */
+typedef struct {
+	GMutex *mutex;
+	GCond *cond;
+	gboolean is_done;
+	gboolean is_success;
+	guint8 *reply;
+	gint reply_length;			/* reply のサイズ、完了後は受け取った長さ */
+} CapStsCmdWait;
+
+/* capsts_adjust_tuner_channel_async() のスレッドに渡す引数 */
+typedef struct {
+	CapSts *device;
+	CapStsTunerSource source;
+	gchar *channel;
+	CapStsCmdCallback callback;
+	gpointer user_data;
+} CapStsTunerJob;
+
+static void
+capsts_request_submit(CapStsRequest *request);
+
+static CapSts *
+capsts_new(gint fx2id, cusbfx2_handle *device)
+{
+	CapSts *self;
+
+	self = g_new0(CapSts, 1);
+	self->fx2id = fx2id;
+	self->device = device;
+	self->ir_base = 0;
+	self->ir_wave_delay = IR_WAVE_FIRST_DELAY;
+	self->request_mutex = g_mutex_new();
+	self->requests = g_queue_new();
+
+	return self;
+}
 
 /**
- * CUSBFX2を開いてハンドルを返す。
+ * CUSBFX2を開いて CAPSTS デバイスを返す。
  *
  * 必要なファームウェアがCUSBFX2にロードされていなければ、
- * ファームウェアをアップロードした後、再検出した CUSBFX2 のハンドルを返す。
+ * ファームウェアをアップロードした後、再検出した CUSBFX2 を開く。
+ * 複数の CUSBFX2 を開く場合は capsts_open_all() を使う。
  *
  * @param[in]	fx2id	開くCUSBFX2のID
  * @param[in]	is_force_load	TRUEなら強制的にファームウェアをロードする
  */
-cusbfx2_handle *
+CapSts *
 capsts_open(gint fx2id, gboolean is_force_load)
 {
-	cusbfx2_handle *device;
-	device = cusbfx2_open(fx2id, st_firmware, FIRMWARE_ID, is_force_load);
-	if (!device) {
-		g_critical("[capsts_open] Couldn't open CUSBFX2 device");
+	CapSts *self = NULL;
+
+	capsts_open_all(&fx2id, 1, is_force_load, &self);
+
+	return self;
+}
+
+/**
+ * 複数の CUSBFX2 をまとめて開く。
+ *
+ * ファームウェアのロードと再検出は全台について並行して行われる。
+ *
+ * @param[in]	fx2ids	開くCUSBFX2のID
+ * @param[in]	n	@a fx2ids の数
+ * @param[in]	is_force_load	TRUEなら強制的にファームウェアをロードする
+ * @param[out]	devices	@a n 個の CAPSTS デバイスを受け取る。開けなかったものは NULL
+ * @return 全て開けた場合は TRUE
+ */
+gboolean
+capsts_open_all(const gint *fx2ids, gint n, gboolean is_force_load, CapSts **devices)
+{
+	guint8 *ids;
+	cusbfx2_handle **handles;
+	gboolean result;
+	gint i;
+
+	ids = g_new(guint8, n);
+	handles = g_new0(cusbfx2_handle *, n);
+	for (i = 0; i < n; ++i) {
+		ids[i] = fx2ids[i];
 	}
-	return device;
+
+	result = cusbfx2_open_all(ids, n, &st_firmware, is_force_load, handles);
+
+	for (i = 0; i < n; ++i) {
+		if (handles[i]) {
+			devices[i] = capsts_new(fx2ids[i], handles[i]);
+		} else {
+			g_critical("[capsts_open] Couldn't open CUSBFX2 device (id=%d)", fx2ids[i]);
+			devices[i] = NULL;
+		}
+	}
+
+	g_free(handles);
+	g_free(ids);
+
+	return result;
+}
+
+/**
+ * CAPSTS デバイスを閉じる。
+ */
+void
+capsts_close(CapSts *self)
+{
+	if (!self)
+		return;
+
+	capsts_wait_tuner_channel(self);
+
+	/* 送信中のコマンドの完了を待つ (転送はタイムアウトで必ず完了する) */
+	for (;;) {
+		gboolean is_empty;
+
+		g_mutex_lock(self->request_mutex);
+		is_empty = g_queue_is_empty(self->requests);
+		g_mutex_unlock(self->request_mutex);
+		if (is_empty)
+			break;
+		cusbfx2_wait_events(CAPSTS_WAIT_INTERVAL);
+	}
+	g_queue_free(self->requests);
+	g_mutex_free(self->request_mutex);
+
+	if (self->cmd_queue) g_byte_array_free(self->cmd_queue, TRUE);
+	if (self->ir_cmd_queue) g_array_free(self->ir_cmd_queue, TRUE);
+	cusbfx2_close(self->device);
+	g_free(self);
+}
+
+/**
+ * CAPSTS デバイスの CUSBFX2 ハンドルを返す。
+ */
+cusbfx2_handle *
+capsts_get_device(CapSts *self)
+{
+	return self->device;
+}
+
+/**
+ * CAPSTS デバイスの CUSBFX2 ID を返す。
+ */
+gint
+capsts_get_id(CapSts *self)
+{
+	return self->fx2id;
 }
 
 /**
  * CAPSTSファームウェアへのコマンドをキューに追加する。
+ *
+ * キューはロックしないので、capsts_adjust_tuner_channel_async() の変更中には呼ばないこと。
  */
 void
-capsts_cmd_push(guint8 cmd, ...)
+capsts_cmd_push(CapSts *self, guint8 cmd, ...)
 {
     va_list ap;
+	GByteArray *queue;
 	GString *debug_message = g_string_new("[capsts_cmd_push] command:");
 
-    if (!st_cmd_queue) {
+    if (!self->cmd_queue) {
 		g_debug("[capsts_cmd_push] creating a new queue");
-		st_cmd_queue = g_byte_array_sized_new(128);
+		self->cmd_queue = g_byte_array_sized_new(128);
     }
+	queue = self->cmd_queue;
 
-	g_byte_array_append(st_cmd_queue, &cmd, 1);
+	g_byte_array_append(queue, &cmd, 1);
 	g_string_append_printf(debug_message,  " %02x", cmd);
 
     va_start(ap, cmd);
@@ -63,13 +259,13 @@ capsts_cmd_push(guint8 cmd, ...)
 
     case CMD_IR_WBUF:			/* special */
 		arg = va_arg(ap, gint);
-		g_byte_array_append(st_cmd_queue, &arg, 1);
+		g_byte_array_append(queue, &arg, 1);
 		g_string_append_printf(debug_message,  " %02x", arg);
 		len = va_arg(ap, gint);
-		g_byte_array_append(st_cmd_queue, &len, 1);
+		g_byte_array_append(queue, &len, 1);
 		g_string_append_printf(debug_message,  " %02x", len);
 		data = va_arg(ap, guint8 *);
-		g_byte_array_append(st_cmd_queue, data, len);
+		g_byte_array_append(queue, data, len);
 		for (i = 0; i < len; ++i) {
 			g_string_append_printf(debug_message,  " %02x", data[i]);
 		}
@@ -78,7 +274,7 @@ capsts_cmd_push(guint8 cmd, ...)
     case CMD_REG_WRITE:			/* 2 arguments */
     case CMD_IR_CODE:
 		arg = va_arg(ap, gint);
-		g_byte_array_append(st_cmd_queue, &arg, 1);
+		g_byte_array_append(queue, &arg, 1);
 		g_string_append_printf(debug_message,  " %02x", arg);
 		/* FALLTHROUGH */
 
@@ -88,7 +284,7 @@ capsts_cmd_push(guint8 cmd, ...)
     case CMD_IFCONFIG:
     case CMD_IR_RBUF:
 		arg = va_arg(ap, gint);
-		g_byte_array_append(st_cmd_queue, &arg, 1);
+		g_byte_array_append(queue, &arg, 1);
 		g_string_append_printf(debug_message,  " %02x", arg);
 		/* FALLTHROUGH */
 
@@ -108,33 +304,222 @@ capsts_cmd_push(guint8 cmd, ...)
 
     va_end(ap);
 
+	/* 応答を返すコマンド */
+	if (cmd == CMD_REG_READ || cmd == CMD_PORT_READ) {
+		self->cmd_reply_length += 1;
+	} else if (cmd == CMD_IR_RBUF) {
+		self->cmd_reply_length += 64;
+	}
+
 	g_debug(debug_message->str);
 	g_string_free(debug_message, TRUE);
 }
 
+static void
+capsts_request_free(CapStsRequest *request)
+{
+	g_byte_array_free(request->commands, TRUE);
+	g_byte_array_free(request->reply, TRUE);
+	g_free(request);
+}
+
 /**
- * CAPSTSファームウェアへのコマンドキューを実際に送信する。
+ * 先頭の要求を完了させてコールバックを呼び、次の要求があれば送信する。
  */
-gboolean
-capsts_cmd_commit(cusbfx2_handle *device)
+static void
+capsts_request_complete(CapStsRequest *request, gboolean is_success)
 {
-	gboolean result = TRUE;
-	gint r;
+	CapSts *self = request->device;
+	CapStsRequest *next;
 
-	g_assert(st_cmd_queue);
+	g_mutex_lock(self->request_mutex);
+	g_assert(g_queue_peek_head(self->requests) == request);
+	g_queue_pop_head(self->requests);
+	next = g_queue_peek_head(self->requests);
+	g_mutex_unlock(self->request_mutex);
 
-	r = cusbfx2_bulk_transfer(device, ENDPOINT_CMD_OUT, st_cmd_queue->data, st_cmd_queue->len);
-	if (r < 0) {
-		g_warning("[capsts_cmd_commit] cusbfx2_bulk_transfer(%p, 0x%02x, %p, %d) failed [%d]",
-				  device, ENDPOINT_CMD_OUT, st_cmd_queue->data, st_cmd_queue->len, r);
-		result = FALSE;
+	if (request->callback) {
+		request->callback(self, is_success, request->reply->data, request->reply->len, request->user_data);
 	}
-	g_debug("[capsts_cmd_commit] commiting pending commands succeeded");
+	capsts_request_free(request);
+
+	if (next) {
+		capsts_request_submit(next);
+	}
+}
 
-	g_byte_array_free(st_cmd_queue, TRUE);
-	st_cmd_queue = NULL;
+static void
+capsts_request_received(gint status, guint8 *data, gint length, gpointer user_data)
+{
+	CapStsRequest *request = user_data;
+	gint remain;
 
-	return result;
+	if (status < 0) {
+		g_warning("[capsts_request_received] reading reply from 0x%02x failed [%d]", ENDPOINT_CMD_IN, status);
+		capsts_request_complete(request, FALSE);
+		return;
+	}
+
+	g_byte_array_append(request->reply, data, length);
+	remain = request->reply_length - (gint)request->reply->len;
+	if (remain <= 0) {
+		g_debug("[capsts_request_received] received %d bytes of reply", request->reply->len);
+		capsts_request_complete(request, TRUE);
+		return;
+	}
+
+	/* ファームウェアはコマンドのパケットごとに応答を返すので、読み切るまで続ける */
+	remain = (remain + CMD_PACKET_SIZE - 1) / CMD_PACKET_SIZE * CMD_PACKET_SIZE;
+	if (!cusbfx2_submit_bulk_transfer(request->device->device, ENDPOINT_CMD_IN, NULL, remain,
+									  capsts_request_received, request)) {
+		capsts_request_complete(request, FALSE);
+	}
+}
+
+static void
+capsts_request_sent(gint status, guint8 *data, gint length, gpointer user_data)
+{
+	CapStsRequest *request = user_data;
+
+	if (status < 0) {
+		g_warning("[capsts_request_sent] sending %d bytes to 0x%02x failed [%d]",
+				  request->commands->len, ENDPOINT_CMD_OUT, status);
+		capsts_request_complete(request, FALSE);
+		return;
+	}
+
+	if (request->reply_length > 0) {
+		capsts_request_received(0, NULL, 0, request);
+	} else {
+		capsts_request_complete(request, TRUE);
+	}
+}
+
+static void
+capsts_request_submit(CapStsRequest *request)
+{
+	if (!cusbfx2_submit_bulk_transfer(request->device->device, ENDPOINT_CMD_OUT,
+									  request->commands->data, request->commands->len,
+									  capsts_request_sent, request)) {
+		capsts_request_complete(request, FALSE);
+	}
+}
+
+/**
+ * CAPSTSファームウェアへのコマンドキューを非同期に送信する。
+ *
+ * 送信は待たずに返る。デバイスごとに送信順に一つずつ転送し、コマンドが応答を返す場合は
+ * ENDPOINT_CMD_IN から読み取った応答をコールバックに渡す。
+ * @a callback は USB のイベントを処理しているスレッドから呼ばれるので、
+ * その中で送信の完了を待つ関数 (capsts_cmd_commit() など) を呼んではならない。
+ *
+ * @param[in]	callback	完了時に呼ぶ関数 (NULL 可)
+ */
+void
+capsts_cmd_commit_async(CapSts *self, CapStsCmdCallback callback, gpointer user_data)
+{
+	CapStsRequest *request;
+	gboolean is_idle;
+
+	g_assert(self->cmd_queue);
+
+	request = g_new0(CapStsRequest, 1);
+	request->device = self;
+	request->commands = self->cmd_queue;
+	request->reply_length = self->cmd_reply_length;
+	request->reply = g_byte_array_sized_new(self->cmd_reply_length);
+	request->callback = callback;
+	request->user_data = user_data;
+	self->cmd_queue = NULL;
+	self->cmd_reply_length = 0;
+
+	g_mutex_lock(self->request_mutex);
+	is_idle = g_queue_is_empty(self->requests);
+	g_queue_push_tail(self->requests, request);
+	g_mutex_unlock(self->request_mutex);
+
+	g_debug("[capsts_cmd_commit_async] queued %d bytes of commands (reply %d bytes)",
+			request->commands->len, request->reply_length);
+	if (is_idle) {
+		capsts_request_submit(request);
+	}
+}
+
+static void
+capsts_cmd_wait_done(CapSts *self, gboolean is_success, const guint8 *reply, gint reply_length, gpointer user_data)
+{
+	CapStsCmdWait *wait = user_data;
+
+	g_mutex_lock(wait->mutex);
+	if (wait->reply) {
+		wait->reply_length = MIN(wait->reply_length, reply_length);
+		memcpy(wait->reply, reply, wait->reply_length);
+	}
+	wait->is_success = is_success;
+	wait->is_done = TRUE;
+	g_cond_signal(wait->cond);
+	g_mutex_unlock(wait->mutex);
+}
+
+/**
+ * CAPSTSファームウェアへのコマンドキューを送信し、応答を受け取るまで待つ。
+ *
+ * 先に capsts_cmd_commit_async() で送ったコマンドがあれば、その後に送信される。
+ *
+ * @param[out]	reply	応答を受け取るバッファ (NULL 可)
+ * @param[in]	length	@a reply のサイズ
+ * @return 受け取った応答のバイト数、失敗すれば -1
+ */
+gint
+capsts_cmd_commit_read(CapSts *self, guint8 *reply, gint length)
+{
+	CapStsCmdWait wait;
+
+	wait.mutex = g_mutex_new();
+	wait.cond = g_cond_new();
+	wait.is_done = FALSE;
+	wait.is_success = FALSE;
+	wait.reply = reply;
+	wait.reply_length = reply ? length : 0;
+
+	capsts_cmd_commit_async(self, capsts_cmd_wait_done, &wait);
+
+	g_mutex_lock(wait.mutex);
+	while (!wait.is_done) {
+		if (cusbfx2_is_event_thread_running()) {
+			g_cond_wait(wait.cond, wait.mutex);
+		} else {
+			/* イベントを処理するスレッドが無ければ自分で処理する */
+			g_mutex_unlock(wait.mutex);
+			cusbfx2_wait_events(CAPSTS_WAIT_INTERVAL);
+			g_mutex_lock(wait.mutex);
+		}
+	}
+	g_mutex_unlock(wait.mutex);
+
+	g_cond_free(wait.cond);
+	g_mutex_free(wait.mutex);
+
+	if (!wait.is_success)
+		return -1;
+	return wait.reply_length;
+}
+
+/**
+ * CAPSTSファームウェアへのコマンドキューを実際に送信する。
+ *
+ * 送信が完了するまで待つ。コマンドの応答は捨てる。
+ */
+gboolean
+capsts_cmd_commit(CapSts *self)
+{
+	if (capsts_cmd_commit_read(self, NULL, 0) < 0) {
+		g_warning("[capsts_cmd_commit] commiting pending commands failed");
+		return FALSE;
+	}
+	g_debug("[capsts_cmd_commit] commiting pending commands succeeded");
+
+	return TRUE;
 }
 
 /**
@@ -143,10 +528,10 @@ capsts_cmd_commit(cusbfx2_handle *device)
  * @param base	ベースチャンネル(1〜3)
  */
 void
-capsts_set_ir_base(gint base)
+capsts_set_ir_base(CapSts *self, gint base)
 {
-	st_ir_base = (CLAMP(base, 1, 3) - 1) * 0x80;
-	g_message("[capsts_set_ir_base] set IR base channel to %d", st_ir_base + 1);
+	self->ir_base = (CLAMP(base, 1, 3) - 1) * 0x80;
+	g_message("[capsts_set_ir_base] set IR base channel to %d", self->ir_base + 1);
 }
 
 /**
@@ -155,57 +540,214 @@ capsts_set_ir_base(gint base)
  * @param cmd	追加するコマンド
  */
 void
-capsts_ir_cmd_push(CapStsIrCommand cmd)
+capsts_ir_cmd_push(CapSts *self, CapStsIrCommand cmd)
 {
 	/* まだキューが無ければ作成 */
-    if (!st_ir_cmd_queue) {
+    if (!self->ir_cmd_queue) {
 		g_debug("[capsts_ir_cmd_push] creating a new queue");
-		st_ir_cmd_queue = g_array_new(TRUE, TRUE, sizeof(CapStsIrCommand));
+		self->ir_cmd_queue = g_array_new(TRUE, TRUE, sizeof(CapStsIrCommand));
     }
 
-	g_array_append_val(st_ir_cmd_queue, cmd);
+	g_array_append_val(self->ir_cmd_queue, cmd);
 	g_debug("[capsts_ir_cmd_push] IR command: %04x", cmd);
 }
 
 /**
- * IRコマンド送信キューを実際に送信する。
+ * IRコマンドを波形ではなくマクロとしてまとめて送るかどうかを設定する。
+ */
+void
+capsts_set_ir_macro(CapSts *self, gboolean is_macro)
+{
+	self->is_ir_macro = is_macro;
+}
+
+/**
+ * レベル @a level を @a ticks だけ出力する波形を追加する。
+ *
+ * @return 追加後の波形の長さ
+ */
+static guint
+capsts_ir_wave_put(guint8 *wave, guint len, gint level, guint ticks)
+{
+	ticks = (ticks + 1) & ~1;	/* 長さは偶数でしか表せない */
+	while (ticks > 0) {
+		guint n = MIN(ticks, IR_WAVE_MAX_TICKS);
+		wave[len++] = n | (level & 1);
+		ticks -= n;
+	}
+	return len;
+}
+
+/**
+ * フレーム 1 つ分の波形を追加する。
+ *
+ * @return 追加後の波形の長さ
+ */
+static guint
+capsts_ir_wave_put_frame(guint8 *wave, guint len, guint16 code)
+{
+	gint i;
+
+	len = capsts_ir_wave_put(wave, len, 0, IR_WAVE_HEADER_LOW);
+	len = capsts_ir_wave_put(wave, len, 1, IR_WAVE_HEADER_HIGH);
+	for (i = 0; i < 16; ++i, code >>= 1) {
+		len = capsts_ir_wave_put(wave, len, 0, IR_WAVE_MARK);
+		len = capsts_ir_wave_put(wave, len, 1, (code & 1) ? IR_WAVE_BIT1 : IR_WAVE_BIT0);
+	}
+	return capsts_ir_wave_put(wave, len, 0, IR_WAVE_MARK);
+}
+
+/**
+ * キー 1 つ分の波形 (先頭の無信号時間と繰り返しを含む) を追加する。
+ *
+ * @return 追加後の波形の長さ
+ */
+static guint
+capsts_ir_wave_put_key(guint8 *wave, guint len, guint16 code)
+{
+	gint i;
+
+	len = capsts_ir_wave_put(wave, len, 1, IR_WAVE_KEY_GAP);
+	len = capsts_ir_wave_put_frame(wave, len, code);
+	for (i = 1; i < IR_WAVE_KEY_REPEAT; ++i) {
+		len = capsts_ir_wave_put(wave, len, 1, IR_WAVE_REPEAT_GAP);
+		len = capsts_ir_wave_put_frame(wave, len, code);
+	}
+	return len;
+}
+
+/**
+ * 波形を出力し終えるまでの時間と、出力中の長さの最大値 (20us 単位) を求める。
+ */
+static guint
+capsts_ir_wave_get_ticks(const guint8 *wave, guint len, guint *max_ticks)
+{
+	guint i, ticks = 0;
+
+	*max_ticks = 0;
+	for (i = 0; i < len; ++i) {
+		ticks += wave[i] & 0xFE;
+		*max_ticks = MAX(*max_ticks, wave[i] & 0xFE);
+	}
+	return ticks;
+}
+
+/**
+ * 波形を一度のバルク転送でアップロードして出力し、出力し終えたら止める。
+ *
+ * EP1 のパケット (64 バイト) をコマンドがまたがないよう、
+ * 最後以外の CMD_IR_WBUF はちょうど 1 パケットの長さにする。
+ */
+static gboolean
+capsts_ir_wave_commit(CapSts *self, guint8 *wave, guint len)
+{
+	guint ofs, usec, ticks, max_ticks;
+
+	/* 最後の CMD_IR_WBUF と CMD_IR_CODE が同じパケットに収まるよう、無信号で埋める */
+	while (len % IR_WBUF_CHUNK > IR_WBUF_LAST_CHUNK) {
+		wave[len++] = 2 | 1;
+	}
+	ticks = capsts_ir_wave_get_ticks(wave, len, &max_ticks);
+	usec = (self->ir_wave_delay + ticks) * IR_TICK_USEC;
+
+	for (ofs = 0; ofs < len; ofs += IR_WBUF_CHUNK) {
+		capsts_cmd_push(self, CMD_IR_WBUF, ofs, MIN(len - ofs, IR_WBUF_CHUNK), wave + ofs);
+	}
+	capsts_cmd_push(self, CMD_IR_CODE, 0xFF, 0xFF);
+
+	g_debug("[capsts_ir_wave_commit] playing %u bytes of IR wave (%.1f ms)", len, usec / 1000.);
+	if (!capsts_cmd_commit(self))
+		return FALSE;
+
+	/* 波形は繰り返されるので、出力を始めるまでの遅れと送った波形の長さだけ待ち、
+	 * 先頭の無信号時間のうちに止める */
+	g_usleep(usec);
+	capsts_cmd_push(self, CMD_IR_CODE, 0x00, 0x00);
+	if (!capsts_cmd_commit(self)) {
+		self->ir_wave_delay = IR_WAVE_FIRST_DELAY;
+		return FALSE;
+	}
+
+	/* 止めた時に出力中だった長さの残りが、次の出力を始めるまでの遅れになる */
+	self->ir_wave_delay = max_ticks;
+	return TRUE;
+}
+
+/**
+ * IRコマンド送信キューを波形に変換して送信する。
  *
- * @param device
+ * ir_wbuf に収まる限りのキーを一つの波形にまとめ、デバイス側で出力させる。
+ */
+static gboolean
+capsts_ir_macro_commit(CapSts *self)
+{
+	guint8 wave[256];
+	guint8 key[IR_WAVE_MAX_LEN];
+	guint len = 0;
+	guint i;
+
+	g_debug("[capsts_ir_macro_commit] about to commit IR macro");
+
+	for (i = 0; i < self->ir_cmd_queue->len; ++i) {
+		guint16 cmd = g_array_index(self->ir_cmd_queue, CapStsIrCommand, i);
+		guint key_len;
+
+		key_len = capsts_ir_wave_put_key(key, 0, cmd + self->ir_base);
+		if (len + key_len > IR_WAVE_MAX_LEN) {
+			if (!capsts_ir_wave_commit(self, wave, len))
+				return FALSE;
+			len = 0;
+		}
+		memcpy(wave + len, key, key_len);
+		len += key_len;
+	}
+
+	if (len > 0) {
+		return capsts_ir_wave_commit(self, wave, len);
+	}
+	return TRUE;
+}
+
+/**
+ * IRコマンド送信キューを実際に送信する。
  */
 gboolean
-capsts_ir_cmd_commit(cusbfx2_handle *device)
+capsts_ir_cmd_commit(CapSts *self)
 {
 	guint i;
-	guint8 cmds[3] = { CMD_IR_CODE, 0, 0 };
+
+	if (self->is_ir_macro && self->ir_cmd_queue) {
+		gboolean result = capsts_ir_macro_commit(self);
+
+		g_array_free(self->ir_cmd_queue, TRUE);
+		self->ir_cmd_queue = NULL;
+		return result;
+	}
 
 	g_debug("[capsts_ir_cmd_commit] about to commit IR commands");
 
-	for (i = 0; i < (st_ir_cmd_queue ? st_ir_cmd_queue->len : 0); ++i) {
-		guint16 cmd = g_array_index(st_ir_cmd_queue, CapStsIrCommand, i);
-		gint r;
+	for (i = 0; i < (self->ir_cmd_queue ? self->ir_cmd_queue->len : 0); ++i) {
+		guint16 cmd = g_array_index(self->ir_cmd_queue, CapStsIrCommand, i) + self->ir_base;
 
 		if (cmd == IR_CMD_3DIGIT_INPUT) {
 			// wait == 300msec needed ?
 		}
 
 		/* コマンドの信号を立ち上げる */
-		cmds[1] = (cmd + st_ir_base) & 0xFF;
-		cmds[2] = ((cmd + st_ir_base) >> 8) & 0xFF;
-		g_debug("[capsts_ir_cmd_commit] rising edge of IR (%02x %02x %02x)", cmds[0], cmds[1], cmds[2]);
-		r = cusbfx2_bulk_transfer(device, ENDPOINT_CMD_OUT, cmds, sizeof(cmds));
-		if (r < 0) {
-			g_warning("[capsts_ir_cmd_commit] cusbfx2_bulk_transfer failed [%d]", r);
+		g_debug("[capsts_ir_cmd_commit] rising edge of IR (%04x)", cmd);
+		capsts_cmd_push(self, CMD_IR_CODE, cmd & 0xFF, (cmd >> 8) & 0xFF);
+		if (!capsts_cmd_commit(self)) {
+			g_warning("[capsts_ir_cmd_commit] capsts_cmd_commit failed");
 			return FALSE;
 		}
 
 		g_usleep(600 * 1000);
 
 		/* コマンドの信号を立ち下げる */
-		g_debug("[capsts_ir_cmd_commit] falling edge of IR (%02x %02x %02x)", cmds[0], cmds[1], cmds[2]);
-		cmds[1] = cmds[2] = 0;
-		r = cusbfx2_bulk_transfer(device, ENDPOINT_CMD_OUT, cmds, sizeof(cmds));
-		if (r < 0) {
-			g_warning("[capsts_ir_cmd_commit] cusbfx2_bulk_transfer failed [%d]", r);
+		g_debug("[capsts_ir_cmd_commit] falling edge of IR (%04x)", cmd);
+		capsts_cmd_push(self, CMD_IR_CODE, 0x00, 0x00);
+		if (!capsts_cmd_commit(self)) {
+			g_warning("[capsts_ir_cmd_commit] capsts_cmd_commit failed");
 			return FALSE;
 		}
 
@@ -215,8 +757,8 @@ capsts_ir_cmd_commit(cusbfx2_handle *device)
 	g_debug("[capsts_ir_cmd_commit] commiting pending IR commands succeeded");
 
 	/* 送信したキューを削除 */
-	if (st_ir_cmd_queue) g_array_free(st_ir_cmd_queue, TRUE);
-	st_ir_cmd_queue = NULL;
+	if (self->ir_cmd_queue) g_array_free(self->ir_cmd_queue, TRUE);
+	self->ir_cmd_queue = NULL;
 
 	return TRUE;
 }
@@ -227,26 +769,29 @@ capsts_ir_cmd_commit(cusbfx2_handle *device)
  * \a channel が 3 文字の場合は 3 桁チャンネルによりチャンネル変更を行う。
  * そうでなければ、1 〜 12 の範囲にクランプし、チャンネル変更を行う。
  *
- * @param device
+ * \a is_wait が FALSE なら、チューナー側での切り替えを待たずに返る。
+ * 切り替えの完了は呼び出し側で TS を見て判断すること。
+ *
  * @param source	入力ソース -- TUNER_SOURCE_MAX の場合は変更しない
  * @param channel	チャンネル
+ * @param is_wait	TRUEなら切り替えを一定時間待つ
  */
 gboolean
-capsts_adjust_tuner_channel(cusbfx2_handle *device, CapStsTunerSource source, const gchar *channel)
+capsts_adjust_tuner_channel(CapSts *self, CapStsTunerSource source, const gchar *channel, gboolean is_wait)
 {
 	/* まず入力ソースを切り替える */
 	switch (source) {
 	case TUNER_SOURCE_TERESTRIAL:
 		g_message("[capsts_adjust_tuner_channel] source: TERESTRIAL");
-		capsts_ir_cmd_push(IR_CMD_DIGITAL_TERESTRIAL1);
+		capsts_ir_cmd_push(self, IR_CMD_DIGITAL_TERESTRIAL1);
 		break;
 	case TUNER_SOURCE_BS:
 		g_message("[capsts_adjust_tuner_channel] source: BS");
-		capsts_ir_cmd_push(IR_CMD_FORMAT_BS);
+		capsts_ir_cmd_push(self, IR_CMD_FORMAT_BS);
 		break;
 	case TUNER_SOURCE_CS:
 		g_message("[capsts_adjust_tuner_channel] source: CS");
-		capsts_ir_cmd_push(IR_CMD_FORMAT_CS);
+		capsts_ir_cmd_push(self, IR_CMD_FORMAT_CS);
 		break;
 	default:
 		/* 現在の入力ソースのまま切り替えない */
@@ -259,10 +804,10 @@ capsts_adjust_tuner_channel(cusbfx2_handle *device, CapStsTunerSource source, co
 		const gchar *p;
 
 		g_message("[capsts_adjust_tuner_channel] channel: %s (3digit)", channel);
-		capsts_ir_cmd_push(IR_CMD_3DIGIT_INPUT);
+		capsts_ir_cmd_push(self, IR_CMD_3DIGIT_INPUT);
 
 		for (p = channel; *p; ++p) {
-			capsts_ir_cmd_push(IR_CMD_0 + CLAMP(g_ascii_digit_value(*p), 0, 9));
+			capsts_ir_cmd_push(self, IR_CMD_0 + CLAMP(g_ascii_digit_value(*p), 0, 9));
 		}
 	} else if (channel) {
 		/* 通常のチャンネルが指定されていれば、変更 */
@@ -271,18 +816,22 @@ capsts_adjust_tuner_channel(cusbfx2_handle *device, CapStsTunerSource source, co
 		gint ch;
 		ch = CLAMP((gint)g_ascii_strtoll(channel, NULL, 10), 1, 12);
 		g_message("[capsts_adjust_tuner_channel] channel: %d", ch);
-		capsts_ir_cmd_push(cmd[ch - 1]);
+		capsts_ir_cmd_push(self, cmd[ch - 1]);
 	} else {
 		g_message("[capsts_adjust_tuner_channel] channel: keep current");
 	}
 
-	if (st_ir_cmd_queue && st_ir_cmd_queue->len > 0) {
-		if (!capsts_ir_cmd_commit(device)) {
+	if (self->ir_cmd_queue && self->ir_cmd_queue->len > 0) {
+		if (!capsts_ir_cmd_commit(self)) {
 			g_warning("[capsts_adjust_tuner_channel] capsts_adjust_tuner_channel failed");
-			if (st_ir_cmd_queue) g_array_free(st_ir_cmd_queue, TRUE);
+			if (self->ir_cmd_queue) g_array_free(self->ir_cmd_queue, TRUE);
+			self->ir_cmd_queue = NULL;
 			return FALSE;
 		}
 
+		if (!is_wait)
+			return TRUE;
+
 		/* チューナー側での切り替えを待つ */
 		g_debug("[capsts_adjust_tuner_channel] now waiting tuner for adjust");
 		g_usleep(2500 * 1000);
@@ -291,3 +840,73 @@ capsts_adjust_tuner_channel(cusbfx2_handle *device, CapStsTunerSource source, co
 
 	return TRUE;
 }
+
+static gpointer
+capsts_tuner_thread(gpointer data)
+{
+	CapStsTunerJob *job = data;
+	gboolean result;
+
+	result = capsts_adjust_tuner_channel(job->device, job->source, job->channel, FALSE);
+	if (job->callback) {
+		job->callback(job->device, result, NULL, 0, job->user_data);
+	}
+
+	g_free(job->channel);
+	g_free(job);
+	return NULL;
+}
+
+/**
+ * チューナーの入力ソースとチャンネルの変更を別スレッドで行い、すぐに返る。
+ *
+ * IR の送信に掛かる時間 (マクロなら波形を出力し終えるまで、そうでなければキーごとに約 0.7 秒) の間、
+ * 呼び出し元は TS の受信を続けられる。
+ * 切り替えは待たないので、完了は呼び出し側で TS を見て判断すること。
+ * コマンドキューはロックせずにこのスレッドと共有するので、変更の途中でこのデバイスに
+ * コマンドを積む場合は、先に capsts_wait_tuner_channel() で IR を送り終えるのを待つこと。
+ *
+ * @param[in]	callback	IR を送り終えたときに変更を行ったスレッドから呼ぶ関数 (NULL 可)
+ * @return スレッドを開始できれば TRUE
+ */
+gboolean
+capsts_adjust_tuner_channel_async(CapSts *self, CapStsTunerSource source, const gchar *channel,
+								  CapStsCmdCallback callback, gpointer user_data)
+{
+	CapStsTunerJob *job;
+	GError *error = NULL;
+
+	/* 前の変更が残っていれば、終わるのを待つ */
+	capsts_wait_tuner_channel(self);
+
+	job = g_new0(CapStsTunerJob, 1);
+	job->device = self;
+	job->source = source;
+	job->channel = g_strdup(channel);
+	job->callback = callback;
+	job->user_data = user_data;
+
+	self->tuner_thread = g_thread_create(capsts_tuner_thread, job, TRUE, &error);
+	if (error) {
+		g_warning("[capsts_adjust_tuner_channel_async] %s", error->message);
+		g_clear_error(&error);
+		self->tuner_thread = NULL;
+		g_free(job->channel);
+		g_free(job);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * capsts_adjust_tuner_channel_async() で始めた変更が IR を送り終えるまで待つ。
+ */
+void
+capsts_wait_tuner_channel(CapSts *self)
+{
+	if (self->tuner_thread) {
+		g_thread_join(self->tuner_thread);
+		self->tuner_thread = NULL;
+	}
+}
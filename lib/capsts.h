@@ -3,6 +3,7 @@
 
 enum {
 	ENDPOINT_CMD_OUT	= 0x01,	/* Endpoint 1: Command from usb to firmware */
+	ENDPOINT_CMD_IN		= 0x81,	/* Endpoint 1: Reply from firmware to usb */
 	ENDPOINT_TS_IN		= 0x86,	/* Endpoint 6: MPEG-TS from tuner to usb */
 	ENDPOINT_BCAS_IN	= 0x84,	/* Endpoint 4: B-CAS from tuner to usb */
 };
@@ -136,30 +137,71 @@ typedef enum CapStsTunerSource {
 	TUNER_SOURCE_MAX
 } CapStsTunerSource;
 
+struct CapSts;
+typedef struct CapSts CapSts;
+
+/**
+ * 非同期に送信したコマンドの完了時に呼ばれる関数。
+ *
+ * @param is_success	送信 (と応答の受信) に成功したら TRUE
+ * @param reply	コマンドの応答 (呼び出しの間だけ参照できる)
+ * @param reply_length	応答のバイト数
+ */
+typedef void (*CapStsCmdCallback)(CapSts *self, gboolean is_success,
+								  const guint8 *reply, gint reply_length, gpointer user_data);
+
 /* Global functions
    ========================================================================== */
 
-cusbfx2_handle *
+CapSts *
 capsts_open(gint fx2id, gboolean is_force_load);
 
+gboolean
+capsts_open_all(const gint *fx2ids, gint n, gboolean is_force_load, CapSts **devices);
+
+void
+capsts_close(CapSts *self);
+
+cusbfx2_handle *
+capsts_get_device(CapSts *self);
+
+gint
+capsts_get_id(CapSts *self);
+
 void
-capsts_cmd_push(guint8 cmd, ...);
+capsts_cmd_push(CapSts *self, guint8 cmd, ...);
 
 gboolean
-capsts_cmd_commit(cusbfx2_handle *device);
+capsts_cmd_commit(CapSts *self);
+
+gint
+capsts_cmd_commit_read(CapSts *self, guint8 *reply, gint length);
+
+void
+capsts_cmd_commit_async(CapSts *self, CapStsCmdCallback callback, gpointer user_data);
 
 /* IR Interfaces
    -------------------------------------------------------------------------- */
 void
-capsts_set_ir_base(gint base);
+capsts_set_ir_base(CapSts *self, gint base);
 
 void
-capsts_ir_cmd_push(CapStsIrCommand cmd);
+capsts_ir_cmd_push(CapSts *self, CapStsIrCommand cmd);
 
 gboolean
-capsts_ir_cmd_commit(cusbfx2_handle *device);
+capsts_ir_cmd_commit(CapSts *self);
+
+void
+capsts_set_ir_macro(CapSts *self, gboolean is_macro);
 
 gboolean
-capsts_adjust_tuner_channel(cusbfx2_handle *device, CapStsTunerSource source, const gchar *channel);
+capsts_adjust_tuner_channel(CapSts *self, CapStsTunerSource source, const gchar *channel, gboolean is_wait);
+
+gboolean
+capsts_adjust_tuner_channel_async(CapSts *self, CapStsTunerSource source, const gchar *channel,
+								  CapStsCmdCallback callback, gpointer user_data);
+
+void
+capsts_wait_tuner_channel(CapSts *self);
 
 #endif	/* CAPSTS_H_INCLUDED */
@@ -1,31 +1,196 @@
+#define _GNU_SOURCE
 #include "config.h"
 
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
 #define G_LOG_DOMAIN "cusbfx2"
 #include <glib.h>
 #include <libusb.h>
 
 #include "cusbfx2.h"
 
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+#define CUSBFX2_HAVE_HOTPLUG
+#endif
 
-#define CUSBFX2_REENUM_RETRY_MAX 10
-#define CUSBFX2_REENUM_RETRY_WAIT (500 * 1000)
+#define CUSBFX2_REENUM_TIMEOUT (5000 * 1000)	/* ファームウェアロード後の再検出を待つ最大時間 */
+#define CUSBFX2_REENUM_POLL_WAIT (100 * 1000)	/* 再検出待ちでイベントを待つ間隔 */
+#define CUSBFX2_REENUM_RESCAN_WAIT (500 * 1000)	/* ホットプラグ通知が無くても探し直す間隔 */
 #define CUSBFX2_TRANSFER_TIMEOUT 1000
+#define CUSBFX2_FIRMWARE_CHUNK 4096	/* ファームウェアを書き込むコントロール転送の最大長 (usbfs の上限) */
+#define CUSBFX2_CPUCS 0xE600
+#define CUSBFX2_CANCEL_WAIT (100 * 1000)
+#define CUSBFX2_CANCEL_WAIT_MAX 20
+#define CUSBFX2_EVENT_THREAD_TIMEOUT (100 * 1000)
+
+/* ストールの監視 */
+#define CUSBFX2_WATCHDOG_INTERVAL (10 * 1000)	/* 監視している転送を調べる間隔 */
+#define CUSBFX2_WATCHDOG_FACTOR 4	/* 受信レートから期待される間隔のこの倍を待つ */
+#define CUSBFX2_WATCHDOG_WEIGHT 0.125	/* 受信レートの移動平均の重み */
+
+/* 転送の自動調整 */
+#define CUSBFX2_TUNE_WINDOW (1000 * 1000)	/* 計測期間 */
+#define CUSBFX2_TUNE_MAX_INTERVAL (50 * 1000)	/* 転送サイズを小さくしてでも守る完了間隔 */
+#define CUSBFX2_TUNE_BUFFERED (100 * 1000)	/* 投入中の転送で吸収する時間 */
+#define CUSBFX2_TUNE_ALIGN 512				/* 転送サイズの単位 (バルク転送の最大パケット長) */
+#define CUSBFX2_TUNE_MIN_LENGTH 4096
+#define CUSBFX2_TUNE_MIN_QUEUES 2
 
 
 /* private */
 struct cusbfx2_handle {
 	libusb_device_handle *usb_handle;
+	volatile gint ref_count;	/* 呼び出し元と、生きている転送のリングが保持する */
+};
+
+struct cusbfx2_buffer {
+	cusbfx2_transfer *transfer;	/* 所属する転送 */
+	guint8 *data;
+	gint length;				/* 受信したバイト数 */
+	volatile gint ref_count;
+	gboolean is_dev_mem;		/* usbfs の DMA 領域にある */
 };
 
+/* libusb_transfer ごとの状態 */
+typedef struct {
+	cusbfx2_transfer *transfer;
+	struct libusb_transfer *usb_transfer;
+	cusbfx2_buffer *buffer;		/* 投入中のバッファ (投入中でなければ NULL) */
+	gint64 completed_time;		/* 直前の転送が完了した時刻 */
+} cusbfx2_slot;
+
+/* cusbfx2_check_watchdogs() がロックを放してから知らせるストール */
+typedef struct {
+	cusbfx2_transfer *transfer;
+	cusbfx2_stall_cb_fn callback;
+	gpointer user_data;
+	cusbfx2_stall_info info;
+} cusbfx2_stall_report;
+
+/* cusbfx2_open_all() で開いている途中のデバイス */
+typedef struct {
+	guint8 id;
+	libusb_device_handle *usb_handle;	/* 再検出待ちの間は NULL */
+	const cusbfx2_firmware *firmware;
+	GThread *loader;
+	gboolean is_reenumerating;
+	gboolean is_load_failed;	/* ロードに失敗した (再検出されないので待たない) */
+} cusbfx2_opening;
+
 struct cusbfx2_transfer {
 	const gchar *name;
-	GSList *usb_transfers;
+	guint8 endpoint;
+	gboolean is_interrupt;
+	cusbfx2_slot *slots;
+	gint nslots;
 	cusbfx2_transfer_cb_fn callback;
+	cusbfx2_transfer_buffer_cb_fn buffer_callback;
 	gpointer user_data;
+
+	/* 転送バッファのリング */
+	cusbfx2_handle *device;
+	guint8 *dev_ring;			/* usbfs の DMA 領域 (確保できなければ NULL) */
+	gsize dev_ring_size;
+	cusbfx2_buffer *buffers;
+	gint nbuffers;
+	GMutex *mutex;
+	GQueue *free_dev_buffers;	/* どこからも参照されていない DMA 領域のバッファ */
+	GQueue *free_buffers;		/* どこからも参照されていないヒープのバッファ (末尾ほど長く使われていない) */
+	gint n_free_allocated;		/* free_buffers のうちメモリを確保してあるバッファ数 */
+	GQueue *idle_slots;			/* 空きバッファを待っている slot */
+	gint n_held;				/* 参照されているバッファ数 */
+	volatile gint n_inflight;	/* 投入中の libusb_transfer 数 */
+	gboolean is_running;
+	gboolean is_freed;
+	volatile gint is_abandoned;	/* キャンセルが戻らないので、解放せずに手放した */
+
+	/* 転送サイズと同時リクエスト数 */
+	gint max_length;			/* バッファのサイズ */
+	volatile gint cur_length;	/* 投入する転送のサイズ (ロックを取らずにも読む) */
+	gint max_queues;			/* slot の数 */
+	gint cur_queues;			/* 同時に投入する slot の数 */
+	gint n_active;				/* 投入中または空きバッファ待ちの slot 数 */
+	GQueue *spare_slots;		/* 同時リクエスト数を減らして休ませている slot */
+
+	/* 自動調整 */
+	gboolean is_auto_tune;
+	gint min_length;
+	gint min_queues;
+	gint64 tune_window_start;
+	gint64 tune_last_completed;
+	gint64 tune_bytes;
+	gint64 tune_max_gap;
+	gint tune_min_free_allocated;	/* 計測期間中の n_free_allocated の最小値 */
+
+	/* 統計 (ロックを取らずに更新する) */
+	gint64 stats_start;
+	gint64 stats_last_completed;
+	gint64 stats_bytes;			/* 32 ビット環境でも裂けないよう mutex を取って読み書きする */
+	volatile gint stats_completed;
+	volatile gint stats_short;
+	volatile gint stats_timeouts;
+	volatile gint stats_errors;
+	volatile gint stats_overflows;
+	volatile gint stats_starved;
+	volatile gint stats_max_gap;	/* usec */
+	volatile gint stats_max_resubmit_latency; /* usec */
+	volatile gint stats_interval_histogram[CUSBFX2_STATS_HISTOGRAM_SIZE];
+	volatile gint stats_resubmit_histogram[CUSBFX2_STATS_HISTOGRAM_SIZE];
+
+	/* ストールの監視 (イベントスレッドで更新する) */
+	cusbfx2_stall_cb_fn stall_callback;
+	gpointer stall_user_data;
+	gint64 watchdog_timeout;	/* これより短い無受信はストールとみなさない (usec) */
+	gint64 watchdog_last_data;	/* 最後にデータを受信した時刻 */
+	gdouble watchdog_rate;		/* 受信レートの移動平均 (bytes/usec) */
+	volatile gint is_stalled;	/* 通知済みで、再開を待っている */
 };
 
+/* cusbfx2_submit_bulk_transfer() で投入した 1 回限りの転送 */
+typedef struct {
+	cusbfx2_handle *device;
+	cusbfx2_bulk_cb_fn callback;
+	gpointer user_data;
+} cusbfx2_oneshot;
+
+static void
+cusbfx2_submit_buffer(cusbfx2_slot *slot, cusbfx2_buffer *buffer);
+
+/* イベントスレッド */
+static GThread *st_event_thread = NULL;
+static volatile gint st_is_event_thread_running = FALSE;
+static gint st_event_thread_priority = 0;
+static gint st_event_thread_cpu = -1;
+
+/* ホットプラグで最新に保つデバイスの一覧 */
+#define CUSBFX2_MAX_ID 256
+static GMutex *st_registry_mutex = NULL;
+static libusb_device *st_registry[CUSBFX2_MAX_ID];	/* bcdDevice=FFxx のデバイス (xx が ID) */
+static GList *st_registry_unloaded = NULL;	/* ファームウェアがロードされていないデバイス */
+static volatile gint st_registry_generation = 0;	/* デバイスが到着するたびに増える */
+static gboolean st_is_registry_active = FALSE;
+#ifdef CUSBFX2_HAVE_HOTPLUG
+static libusb_hotplug_callback_handle st_registry_hotplug;
+#endif
+
+static gboolean st_is_verify_firmware = FALSE;	/* ロードしたファームウェアを読み戻して確かめる */
+
+/* ストールを監視している転送 */
+static GMutex *st_watchdog_mutex = NULL;
+static GList *st_watchdogs = NULL;
+static gint64 st_watchdog_last_check = 0;
+
+static gint64
+cusbfx2_get_current_usec(void)
+{
+	GTimeVal now;
+	g_get_current_time(&now);
+	return (gint64)now.tv_sec * G_USEC_PER_SEC + now.tv_usec;
+}
+
 typedef struct {
 	guint8 bLength;
 	guint8 bDescriptorType;
@@ -55,16 +220,43 @@ cusbfx2_get_manufacturer(libusb_device_handle *handle)
 }
 
 /**
- * @param id
- * @return デバイスが見付かった場合はデバイスへのハンドル. それ以外では NULL.
+ * CUSBFX2 であれば TRUE を返す。
  */
-static libusb_device_handle *
-cusbfx2_find_open(guint8 id)
+static gboolean
+cusbfx2_is_cusbfx2(const struct libusb_device_descriptor *desc)
+{
+	return (desc->idVendor == 0x04B4) &&
+		((desc->idProduct == 0x8613) || (desc->idProduct == 0x1004));
+}
+
+/**
+ * ファームウェアでパッチされた bcdDevice から ID を返す。
+ *
+ * bcdDevice = FX2LP:0xA0nn FX2:0x00nn はファームウェアがロードされていない。
+ *
+ * @return ID. ファームウェアがロードされていなければ -1. どちらでもなければ -2.
+ */
+static gint
+cusbfx2_get_id(const struct libusb_device_descriptor *desc)
+{
+	if ((desc->bcdDevice & 0xFF00) == 0xFF00)
+		return desc->bcdDevice & 0xFF;
+	if ((desc->bcdDevice & 0x0F00) == 0x0000)
+		return -1;
+	return -2;
+}
+
+/**
+ * 接続されている全てのUSBデバイスから ID が @a id のデバイスを探す。
+ *
+ * @return 見付かったデバイス (参照を保持している). それ以外では NULL.
+ */
+static libusb_device *
+cusbfx2_scan(guint8 id)
 {
 	libusb_device *found = NULL;
 	libusb_device **devices;
 	libusb_device *device;
-	libusb_device_handle *handle = NULL;
 	gint ndevices;
 	gint i = 0;
 
@@ -85,84 +277,342 @@ cusbfx2_find_open(guint8 id)
 		/* bcdDevice = FX2LP:0xA0nn FX2:0x00nn */
 		if (((id == 0) && ((desc.bcdDevice & 0x0F00) == 0x0000)) ||
 			(desc.bcdDevice == 0xFF00 + id)) {
-			if ((desc.idVendor == 0x04B4) &&
-				((desc.idProduct == 0x8613) || (desc.idProduct == 0x1004))) {
+			if (cusbfx2_is_cusbfx2(&desc)) {
 				g_message("[cusbfx2_find_open] cusbfx2 found (idVendor=%04x, idProduct=%04x, bcdDevice=%04x)",
 						  desc.idVendor, desc.idProduct, desc.bcdDevice);
-				found = device;
+				found = libusb_ref_device(device);
 				break;
 			}
 		}
 	}
 
+	/* デバイスリストの参照を解放する */
+	libusb_free_device_list(devices, 1);
+
+	return found;
+}
+
+/**
+ * デバイスの一覧から ID が @a id のデバイスを探す。
+ *
+ * ID が 0 であれば、ファームウェアがロードされていないデバイスも対象とする。
+ *
+ * @return 見付かったデバイス (参照を保持している). それ以外では NULL.
+ */
+static libusb_device *
+cusbfx2_registry_lookup(guint8 id)
+{
+	libusb_device *found;
+
+	g_mutex_lock(st_registry_mutex);
+	found = st_registry[id];
+	if (!found && id == 0 && st_registry_unloaded) {
+		found = st_registry_unloaded->data;
+	}
+	if (found) {
+		libusb_ref_device(found);
+	}
+	g_mutex_unlock(st_registry_mutex);
+
+	if (found) {
+		g_debug("[cusbfx2_find_open] cusbfx2 found in registry (id=%d, bus=%d, address=%d)",
+				id, libusb_get_bus_number(found), libusb_get_device_address(found));
+	}
+
+	return found;
+}
+
+#ifdef CUSBFX2_HAVE_HOTPLUG
+/**
+ * CUSBFX2 の到着・取り外しに合わせてデバイスの一覧を更新する。
+ *
+ * リセットや再検出で接続し直したデバイスも、ここで一覧に戻る。
+ */
+static int LIBUSB_CALL
+cusbfx2_registry_hotplug(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data)
+{
+	struct libusb_device_descriptor desc;
+	gint id;
+
+	if (libusb_get_device_descriptor(device, &desc) || !cusbfx2_is_cusbfx2(&desc))
+		return 0;
+
+	id = cusbfx2_get_id(&desc);
+
+	g_mutex_lock(st_registry_mutex);
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+		if (id >= 0) {
+			if (st_registry[id]) libusb_unref_device(st_registry[id]);
+			st_registry[id] = libusb_ref_device(device);
+		} else if (id == -1) {
+			st_registry_unloaded = g_list_append(st_registry_unloaded, libusb_ref_device(device));
+		}
+		g_atomic_int_inc(&st_registry_generation);
+	} else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+		if (id >= 0 && st_registry[id] == device) {
+			libusb_unref_device(st_registry[id]);
+			st_registry[id] = NULL;
+		} else if (g_list_find(st_registry_unloaded, device)) {
+			st_registry_unloaded = g_list_remove(st_registry_unloaded, device);
+			libusb_unref_device(device);
+		}
+	}
+	g_mutex_unlock(st_registry_mutex);
+
+	g_debug("[cusbfx2_registry_hotplug] %s bcdDevice=%04x (bus=%d, address=%d)",
+			event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED ? "arrived" : "left",
+			desc.bcdDevice, libusb_get_bus_number(device), libusb_get_device_address(device));
+
+	return 0;
+}
+#endif
+
+/**
+ * ホットプラグで最新に保つデバイスの一覧を作る。
+ *
+ * ホットプラグが使えなければ何もせず、cusbfx2_find_open() は毎回全デバイスを調べる。
+ */
+static void
+cusbfx2_registry_init(void)
+{
+#ifdef CUSBFX2_HAVE_HOTPLUG
+	gint r;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		g_debug("[cusbfx2_registry_init] hotplug is not supported");
+		return;
+	}
+
+	if (!st_registry_mutex) st_registry_mutex = g_mutex_new();
+
+	/* 既に接続されているデバイスも登録時に通知される */
+	r = libusb_hotplug_register_callback(NULL, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+										 LIBUSB_HOTPLUG_ENUMERATE, 0x04B4, LIBUSB_HOTPLUG_MATCH_ANY,
+										 LIBUSB_HOTPLUG_MATCH_ANY, cusbfx2_registry_hotplug, NULL,
+										 &st_registry_hotplug);
+	if (r) {
+		g_warning("[cusbfx2_registry_init] libusb_hotplug_register_callback failed (%d)", r);
+		return;
+	}
+
+	st_is_registry_active = TRUE;
+	g_debug("[cusbfx2_registry_init] device registry is active");
+#endif
+}
+
+static void
+cusbfx2_registry_exit(void)
+{
+	gint i;
+	GList *p;
+
+	if (!st_is_registry_active)
+		return;
+
+#ifdef CUSBFX2_HAVE_HOTPLUG
+	libusb_hotplug_deregister_callback(NULL, st_registry_hotplug);
+#endif
+	st_is_registry_active = FALSE;
+
+	g_mutex_lock(st_registry_mutex);
+	for (i = 0; i < CUSBFX2_MAX_ID; ++i) {
+		if (st_registry[i]) libusb_unref_device(st_registry[i]);
+		st_registry[i] = NULL;
+	}
+	for (p = st_registry_unloaded; p; p = p->next) {
+		libusb_unref_device(p->data);
+	}
+	g_list_free(st_registry_unloaded);
+	st_registry_unloaded = NULL;
+	g_mutex_unlock(st_registry_mutex);
+}
+
+/**
+ * @param id
+ * @return デバイスが見付かった場合はデバイスへのハンドル. それ以外では NULL.
+ */
+static libusb_device_handle *
+cusbfx2_find_open(guint8 id)
+{
+	libusb_device *found;
+	libusb_device_handle *handle = NULL;
+
+	/* デバイスの一覧があれば、全てのデバイスを調べずに済む */
+	if (st_is_registry_active) {
+		found = cusbfx2_registry_lookup(id);
+	} else {
+		found = cusbfx2_scan(id);
+	}
+
 	/* デバイスをオープンする */
 	if (found) {
-		if (!libusb_open(found, &handle)) {
-			g_critical("[cusbfx2_find_open] libusb_open failed");
+		gint r = libusb_open(found, &handle);
+		if (r) {
+			/* 一覧に取り外し前のデバイスが残っていることもある */
+			g_critical("[cusbfx2_find_open] libusb_open failed (%d)", r);
+			handle = NULL;
 		} else {
-			gint r = libusb_claim_interface(handle, 0);
+			r = libusb_claim_interface(handle, 0);
 			if (r) {
 				g_critical("[cusbfx2_find_open] libusb_claim_interface failed (%d)", r);
 			}
 		}
-	}
 
-	/* デバイスリストと見つかったデバイス以外の参照を解放する */
-	libusb_free_device_list(devices, 1);
+		/* 見つかったデバイスの参照を解放する */
+		libusb_unref_device(found);
+	}
 
 	return handle;
 }
 
 
-static gint
-cusbfx2_load_firmware(libusb_device_handle *dev, guint8 id, guint8 *firmware, const gchar *firmware_id)
+/**
+ * ベンダリクエスト'A0'を使用して8051の RAM を読み書きする。
+ *
+ * usbfs の上限を超える区間は分割する。
+ */
+static gboolean
+cusbfx2_firmware_transfer(libusb_device_handle *dev, gboolean is_read, guint16 address, guint8 *data, gint length)
+{
+	gint done;
+
+	for (done = 0; done < length; done += CUSBFX2_FIRMWARE_CHUNK) {
+		gint len = MIN(length - done, CUSBFX2_FIRMWARE_CHUNK);
+		gint r;
+
+		r = libusb_control_transfer(dev, LIBUSB_RECIPIENT_DEVICE|LIBUSB_REQUEST_TYPE_VENDOR|
+									(is_read ? LIBUSB_ENDPOINT_IN : LIBUSB_ENDPOINT_OUT),
+									0xA0, address + done, 0x0000, data + done, len, 1000);
+		if (r != len) {
+			g_critical("[cusbfx2_load_firmware] %s %04x (%d bytes) failed (%d)",
+					   is_read ? "reading" : "writing", address + done, len, r);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static gboolean
+cusbfx2_load_firmware(libusb_device_handle *dev, guint8 id, const cusbfx2_firmware *firmware)
 {
-	static const guint8 descriptor_pattern[] = { 0xB4, 0x04, 0x04, 0x10, 0x00, 0x00 };
-	guint8 *patch_ptr = NULL;
-	guint16 len, ofs;
+	guint8 cpucs;
+	guint8 *image;
+	gboolean result = TRUE;
+	gint i;
+
+	/* ファームウェアの Device Descript VID=04B4 PID=1004 BCD=0000 の
+	   BCD を id に適合する FFxx に書き換える */
+	image = g_memdup(firmware->image, firmware->image_length);
+	if (firmware->patch_offset >= 0) {
+		image[firmware->patch_offset] = id;
+		image[firmware->patch_offset + 1] = 0xFF;
+	}
 
 	/* 8051 を停止 */
-	guint8 stop_buf[] = { 1 };
-	libusb_control_transfer(dev, LIBUSB_RECIPIENT_DEVICE|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_ENDPOINT_OUT,
-							0xA0, 0xE600, 0x0000, stop_buf, 1, 1000);
-
-	/* skip header ? */
-	firmware += 8;
-
-	for (;;) {
-		gint i;
-		len = (firmware[0] << 8) | firmware[1];
-		ofs = (firmware[2] << 8) | firmware[3];
-		firmware += 4;
-
-		/* ファームウェアの Device Descript VID=04B4 PID=1004 BCD=0000 を見付け出し、
-		   idに適合するBCD(FFxx)に書き換える */
-		for (i = 0; i < (len & 0x7FFF); ++i) {
-			guint8 *p = firmware + i;
-			if (!memcmp(p, descriptor_pattern, G_N_ELEMENTS(descriptor_pattern))) {
-				/* パターンが見付かったので、BCDを書き換える */
-				patch_ptr = p + 4;
-				patch_ptr[0] = id;
-				patch_ptr[1] = 0xFF;
+	cpucs = 1;
+	cusbfx2_firmware_transfer(dev, FALSE, CUSBFX2_CPUCS, &cpucs, 1);
+
+	/* 連続した区間ごとにまとめて書き込む */
+	for (i = 0; result && i < firmware->nsegments; ++i) {
+		const cusbfx2_firmware_segment *seg = &firmware->segments[i];
+		result = cusbfx2_firmware_transfer(dev, FALSE, seg->address, image + seg->offset, seg->length);
+	}
+
+	/* 停止している間に読み戻して確かめる */
+	if (result && st_is_verify_firmware) {
+		guint8 *readback = g_malloc(firmware->image_length);
+
+		for (i = 0; result && i < firmware->nsegments; ++i) {
+			const cusbfx2_firmware_segment *seg = &firmware->segments[i];
+			result = cusbfx2_firmware_transfer(dev, TRUE, seg->address, readback + seg->offset, seg->length);
+			if (result && memcmp(readback + seg->offset, image + seg->offset, seg->length)) {
+				g_critical("[cusbfx2_load_firmware] verify failed at %04x (id=%d)", seg->address, id);
+				result = FALSE;
 			}
 		}
+		if (result) g_message("[cusbfx2_load_firmware] firmware verified (id=%d)", id);
+
+		g_free(readback);
+	}
+
+	/* 8051 を開始 (最終(リセット)) */
+	if (result) {
+		cpucs = 0;
+		result = cusbfx2_firmware_transfer(dev, FALSE, CUSBFX2_CPUCS, &cpucs, 1);
+	}
+
+	g_free(image);
 
-		/* ベンダリクエスト'A0'を使用して8051に書き込む */
-		libusb_control_transfer(dev, LIBUSB_RECIPIENT_DEVICE|LIBUSB_REQUEST_TYPE_VENDOR|LIBUSB_ENDPOINT_OUT,
-								0xA0, ofs, 0x0000, firmware, len & 0x7FFF, 1000);
+	return result;
+}
+
+/**
+ * @a firmware_id のファームウェアをロードする必要があれば TRUE を返す。
+ */
+static gboolean
+cusbfx2_is_firmware_required(libusb_device_handle *usb_handle, const gchar *firmware_id, gboolean is_force_load)
+{
+	gchar *manufacturer;
+	gboolean result;
+
+	manufacturer = cusbfx2_get_manufacturer(usb_handle);
+	if (!is_force_load && !strcmp(manufacturer, firmware_id)) {
+		g_message("[cusbfx2_open] required firmware <%s> is already loaded", manufacturer);
+		result = FALSE;
+	} else {
+		g_message("[cusbfx2_open] loaded firmware is <%s>", manufacturer);
+		if (is_force_load) g_message("[cusbfx2_open] force reload firmware");
+		result = TRUE;
+	}
+	g_free(manufacturer);
+
+	return result;
+}
 
-		if (len & 0x8000)
-			break;				/* 最終(リセット) */
+/**
+ * ファームウェアをロードし、再検出に備えてデバイスを閉じる。
+ *
+ * 複数のデバイスへ並行してロードするため、それぞれのスレッドで実行される。
+ */
+static gpointer
+cusbfx2_firmware_loader(gpointer data)
+{
+	cusbfx2_opening *opening = data;
+	gint r;
 
-		firmware += len;
+	g_message("[cusbfx2_open] loading firmware <%s> (id=%d)", opening->firmware->id, opening->id);
+	if (!cusbfx2_load_firmware(opening->usb_handle, opening->id, opening->firmware)) {
+		g_critical("[cusbfx2_open] loading firmware failed (id=%d)", opening->id);
+		opening->is_load_failed = TRUE;
 	}
 
-	/* パッチを当てていた場合は元に戻す */
-	if (patch_ptr) {
-		patch_ptr[0] = patch_ptr[1] = 0x00;
+	r = libusb_release_interface(opening->usb_handle, 0);
+	if (r) {
+		g_critical("[cusbfx2_open] libusb_release_interface failed (%d)", r);
 	}
 
-	return TRUE;
+	libusb_close(opening->usb_handle);
+	opening->usb_handle = NULL;
+
+	return NULL;
+}
+
+/**
+ * USB のイベントを最大 @a usec マイクロ秒待つ。
+ *
+ * イベントスレッドが動いていればイベント処理はそちらに任せる。
+ */
+void
+cusbfx2_wait_events(glong usec)
+{
+	struct timeval tv = { 0, usec };
+
+	if (cusbfx2_is_event_thread_running()) {
+		g_usleep(usec);
+	} else {
+		libusb_handle_events_timeout(NULL, &tv);
+	}
 }
 
 /* Exposed functions */
@@ -178,8 +628,13 @@ gint
 cusbfx2_init(void)
 {
 	gint r;
+	if (!g_thread_supported()) g_thread_init(NULL);
 	r = libusb_init(NULL);
 	g_debug("[cusbfx2_init] libusb_init (%d)", r);
+	if (r == 0) {
+		st_watchdog_mutex = g_mutex_new();
+		cusbfx2_registry_init();
+	}
 	return r;
 }
 
@@ -192,6 +647,14 @@ cusbfx2_init(void)
 void
 cusbfx2_exit(void)
 {
+	cusbfx2_stop_event_thread();
+	cusbfx2_registry_exit();
+	if (st_watchdog_mutex) {
+		g_list_free(st_watchdogs);
+		st_watchdogs = NULL;
+		g_mutex_free(st_watchdog_mutex);
+		st_watchdog_mutex = NULL;
+	}
 	libusb_exit(NULL);
 	g_debug("[cusbfx2_exit] libusb_exit");
 }
@@ -204,70 +667,164 @@ cusbfx2_exit(void)
  *
  * @param[in]	id	FX2のID
  * @param[in]	firmware	ファームウェア
- * @param[in]	firmware_id	ファームウェアのID
  * @param[in]	is_force_load	TRUEなら強制的にファームウェアをロードする
  * @return handle
  */
 cusbfx2_handle *
-cusbfx2_open(guint8 id, guint8 *firmware, const gchar *firmware_id, gboolean is_force_load)
+cusbfx2_open(guint8 id, const cusbfx2_firmware *firmware, gboolean is_force_load)
 {
-
-	libusb_device_handle *usb_handle;
 	cusbfx2_handle *h = NULL;
-	gint r;
 
-	usb_handle = cusbfx2_find_open(id);
-	if (!usb_handle) {
-		g_critical("[cusbfx2_open] cusbfx2_find_open(id=%d) failed", id);
-		return NULL;
+	cusbfx2_open_all(&id, 1, firmware, is_force_load, &h);
+
+	return h;
+}
+
+/**
+ * ID が @a ids である複数の FX2 をまとめてオープンします。
+ *
+ * ファームウェアのロードが必要なデバイスには並行してロードし、
+ * 再検出はホットプラグの通知を受けて探し直す。
+ * ホットプラグが使えなければ一定間隔で探し直す。
+ * いずれの場合も、台数が増えても待ち時間はほぼ一台分で済む。
+ *
+ * @param[in]	ids	FX2のID
+ * @param[in]	n	@a ids の数
+ * @param[in]	firmware	ファームウェア
+ * @param[in]	is_force_load	TRUEなら強制的にファームウェアをロードする
+ * @param[out]	handles	@a n 個のハンドルを受け取る。開けなかったデバイスは NULL
+ * @return 全てのデバイスを開けた場合は TRUE
+ */
+gboolean
+cusbfx2_open_all(const guint8 *ids, gint n, const cusbfx2_firmware *firmware,
+				 gboolean is_force_load, cusbfx2_handle **handles)
+{
+	cusbfx2_opening *openings;
+	gboolean result = TRUE;
+	gint n_pending = 0;
+	gint i;
+	gboolean is_hotplug = st_is_registry_active;
+
+	openings = g_new0(cusbfx2_opening, n);
+
+	/* 全てのデバイスを探し、ファームウェアのロードが必要なものには並行してロードする */
+	for (i = 0; i < n; ++i) {
+		cusbfx2_opening *opening = &openings[i];
+		GError *error = NULL;
+
+		opening->id = ids[i];
+		opening->firmware = firmware;
+		opening->usb_handle = cusbfx2_find_open(ids[i]);
+		if (!opening->usb_handle) {
+			g_critical("[cusbfx2_open] cusbfx2_find_open(id=%d) failed", ids[i]);
+			result = FALSE;
+			continue;
+		}
+
+		if (!firmware || !cusbfx2_is_firmware_required(opening->usb_handle, firmware->id, is_force_load))
+			continue;
+
+		opening->is_reenumerating = TRUE;
+		++n_pending;
+
+		opening->loader = g_thread_create(cusbfx2_firmware_loader, opening, TRUE, &error);
+		if (error) {
+			g_warning("[cusbfx2_open_all] %s", error->message);
+			g_clear_error(&error);
+			opening->loader = NULL;
+			cusbfx2_firmware_loader(opening);
+		}
 	}
 
-	if (firmware) {
-		gint i;
-		gchar *manufacturer;
+	/* ロードに失敗したデバイスは 8051 が止まったままで再検出されないので、待たずに失敗とする */
+	for (i = 0; i < n; ++i) {
+		if (openings[i].loader) g_thread_join(openings[i].loader);
+		if (openings[i].is_load_failed) {
+			openings[i].is_reenumerating = FALSE;
+			--n_pending;
+			result = FALSE;
+		}
+	}
 
-		manufacturer = cusbfx2_get_manufacturer(usb_handle);
-		if (!is_force_load && !strcmp(manufacturer, firmware_id)) {
-			g_message("[cusbfx2_open] required firmware <%s> is already loaded", manufacturer);
-			g_free(manufacturer);
-		} else {
-			g_message("[cusbfx2_open] loaded firmware is <%s>", manufacturer);
-			g_free(manufacturer);
-			if (is_force_load) g_message("[cusbfx2_open] force reload firmware");
-			g_message("[cusbfx2_open] loading firmware <%s>", firmware_id);
-			cusbfx2_load_firmware(usb_handle, id, firmware, firmware_id);
-
-			/* 再起動後のファームウェアに接続 */
-			g_message("[cusbfx2_open] re-enumerate device");
-			r = libusb_release_interface(usb_handle, 0);
-			if (r) {
-				g_critical("[cusbfx2_open] libusb_release_interface failed (%d)", r);
+	/* 再起動後のファームウェアに接続 */
+	if (n_pending > 0) {
+		GTimer *timer;
+		gint seen_arrived = -1;
+		gdouble scanned_time = .0;
+
+		g_message("[cusbfx2_open] re-enumerate %d device(s)%s", n_pending, is_hotplug ? " (hotplug)" : "");
+		timer = g_timer_new();
+		while (n_pending > 0) {
+			gdouble elapsed;
+
+			cusbfx2_wait_events(CUSBFX2_REENUM_POLL_WAIT);
+			elapsed = g_timer_elapsed(timer, NULL);
+
+			/* ホットプラグの通知があったか、通知を待ちきれなくなったら探し直す */
+			if (!is_hotplug || g_atomic_int_get(&st_registry_generation) != seen_arrived ||
+				(elapsed - scanned_time) * G_USEC_PER_SEC >= CUSBFX2_REENUM_RESCAN_WAIT) {
+				seen_arrived = g_atomic_int_get(&st_registry_generation);
+				scanned_time = elapsed;
+
+				for (i = 0; i < n; ++i) {
+					cusbfx2_opening *opening = &openings[i];
+					if (!opening->is_reenumerating)
+						continue;
+
+					opening->usb_handle = cusbfx2_find_open(opening->id);
+					if (opening->usb_handle) {
+						g_message("[cusbfx2_open] re-enumerate succeeded (id=%d, %.1fs)", opening->id, elapsed);
+						opening->is_reenumerating = FALSE;
+						--n_pending;
+					}
+				}
 			}
 
-			libusb_close(usb_handle);
+			if (elapsed * G_USEC_PER_SEC >= CUSBFX2_REENUM_TIMEOUT)
+				break;
+		}
+		g_timer_destroy(timer);
 
-			for (i = 0; i < CUSBFX2_REENUM_RETRY_MAX; ++i) {
-				g_debug("[cusbfx2_open] re-enumerate try %d", i + 1);
-				usb_handle = cusbfx2_find_open(id);
-				if (usb_handle)
-					break;
-				g_usleep(CUSBFX2_REENUM_RETRY_WAIT);
+		for (i = 0; i < n; ++i) {
+			if (openings[i].is_reenumerating) {
+				g_critical("[cusbfx2_open] re-enumerate failed (id=%d)", openings[i].id);
+				result = FALSE;
 			}
+		}
+	}
 
-			if (!usb_handle) {
-				g_critical("[cusbfx2_open] re-enumerate failed");
-				return NULL;
-			}
-			g_message("[cusbfx2_open] re-enumerate succeeded");
+	for (i = 0; i < n; ++i) {
+		cusbfx2_handle *h = NULL;
+
+		if (openings[i].usb_handle) {
+			h = g_malloc0(sizeof(*h));
+			h->usb_handle = openings[i].usb_handle;
+			h->ref_count = 1;
 		}
+		handles[i] = h;
 	}
+	g_free(openings);
 
-	h = g_malloc0(sizeof(*h));
-	h->usb_handle = usb_handle;
+	return result;
+}
 
-	return h;
+/**
+ * ロードしたファームウェアを 8051 を止めたまま読み戻して確かめるかどうかを設定する。
+ *
+ * 確かめられなかったデバイスは開かない。
+ */
+void
+cusbfx2_set_verify_firmware(gboolean is_verify)
+{
+	st_is_verify_firmware = is_verify;
 }
 
+/**
+ * デバイスを閉じる。
+ *
+ * リングのバッファがまだ参照されている転送があれば、
+ * 実際に閉じるのは最後のバッファが解放された時点になる。
+ */
 void
 cusbfx2_close(cusbfx2_handle *h)
 {
@@ -276,6 +833,9 @@ cusbfx2_close(cusbfx2_handle *h)
 
 	g_assert(h->usb_handle);
 
+	if (!g_atomic_int_dec_and_test(&h->ref_count))
+		return;
+
 	if (h->usb_handle) {
 		gint r = libusb_release_interface(h->usb_handle, 0);
 		if (r) {
@@ -291,6 +851,25 @@ cusbfx2_close(cusbfx2_handle *h)
 }
 
 
+/**
+ * エンドポイントのホルトを解除する。
+ *
+ * @return 0 on success, LIBUSB_ERROR_* on error
+ */
+gint
+cusbfx2_clear_halt(cusbfx2_handle *h, guint8 endpoint)
+{
+	gint r;
+
+	g_assert(h);
+
+	r = libusb_clear_halt(h->usb_handle, endpoint);
+	if (r) {
+		g_warning("[cusbfx2_clear_halt] libusb_clear_halt(0x%02x) failed (%d)", endpoint, r);
+	}
+	return r;
+}
+
 gint
 cusbfx2_bulk_transfer(cusbfx2_handle *h, guint8 endpoint, guint8 *data, gint length)
 {
@@ -302,34 +881,661 @@ cusbfx2_bulk_transfer(cusbfx2_handle *h, guint8 endpoint, guint8 *data, gint len
 }
 
 
+static gint
+cusbfx2_oneshot_status(enum libusb_transfer_status status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_INTERRUPTED;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	default:
+		return LIBUSB_ERROR_IO;
+	}
+}
+
 static void
-cusbfx2_transfer_callback(struct libusb_transfer *usb_transfer)
+cusbfx2_oneshot_callback(struct libusb_transfer *usb_transfer)
 {
-	cusbfx2_transfer *transfer;
-	gint r;
-	gboolean is_resubmit = TRUE;
+	cusbfx2_oneshot *oneshot = (cusbfx2_oneshot *)usb_transfer->user_data;
 
-	transfer = (cusbfx2_transfer *)usb_transfer->user_data;
-	g_assert(transfer);
+	oneshot->callback(cusbfx2_oneshot_status(usb_transfer->status),
+					  usb_transfer->buffer, usb_transfer->actual_length, oneshot->user_data);
 
-	switch (usb_transfer->status) {
-	case LIBUSB_TRANSFER_COMPLETED:
-		if (usb_transfer->actual_length != usb_transfer->length) {
-			g_warning("[cusbfx2_transfer_callback] %s: transfered length mismatch (expect=%d, actual=%d)",
-					  transfer->name, usb_transfer->length, usb_transfer->actual_length);
-		}
+	cusbfx2_close(oneshot->device);
+	g_free(usb_transfer->buffer);
+	libusb_free_transfer(usb_transfer);
+	g_free(oneshot);
+}
 
-		if (transfer->callback) {
-			is_resubmit = transfer->callback(usb_transfer->buffer, usb_transfer->actual_length, transfer->user_data);
-		}
+/**
+ * 1 回限りのバルク転送を非同期に投入する。
+ *
+ * @a callback は転送の完了時にイベントを処理しているスレッドから呼ばれ、
+ * 成功なら 0、失敗なら LIBUSB_ERROR_* と、送受信したデータを受け取る。
+ * データは呼び出しの間だけ参照できる。
+ *
+ * @param[in]	data	OUT エンドポイントなら送信するデータ (コピーする)、IN なら無視する
+ * @param[in]	length	送信するバイト数、または受信する最大バイト数
+ * @return 投入できれば TRUE (@a callback は必ず一度呼ばれる)
+ */
+gboolean
+cusbfx2_submit_bulk_transfer(cusbfx2_handle *h, guint8 endpoint, const guint8 *data, gint length,
+							 cusbfx2_bulk_cb_fn callback, gpointer user_data)
+{
+	struct libusb_transfer *usb_transfer;
+	cusbfx2_oneshot *oneshot;
+	guint8 *buf;
+	gint r;
+
+	g_assert(h);
+	g_assert(callback);
+
+	usb_transfer = libusb_alloc_transfer(0);
+	if (!usb_transfer) {
+		g_critical("[cusbfx2_submit_bulk_transfer] libusb_alloc_transfer failed");
+		return FALSE;
+	}
+
+	if (endpoint & LIBUSB_ENDPOINT_IN) {
+		buf = g_malloc(length);
+	} else {
+		buf = g_memdup(data, length);
+	}
+
+	oneshot = g_new(cusbfx2_oneshot, 1);
+	oneshot->device = h;
+	oneshot->callback = callback;
+	oneshot->user_data = user_data;
+
+	libusb_fill_bulk_transfer(usb_transfer, h->usb_handle, endpoint, buf, length,
+							  cusbfx2_oneshot_callback, oneshot, CUSBFX2_TRANSFER_TIMEOUT);
+
+	g_atomic_int_inc(&h->ref_count);
+	r = libusb_submit_transfer(usb_transfer);
+	if (r) {
+		g_warning("[cusbfx2_submit_bulk_transfer] libusb_submit_transfer(0x%02x) failed (%d)", endpoint, r);
+		cusbfx2_close(h);
+		g_free(buf);
+		libusb_free_transfer(usb_transfer);
+		g_free(oneshot);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+
+/* Transfer buffer ring
+   -------------------------------------------------------------------------- */
+
+/**
+ * リングの領域を確保し、バッファを割り当てる。
+ *
+ * 同時に投入する @a nqueues 個分だけは、可能であれば usbfs の DMA 領域 (libusb_dev_mem_alloc) に確保し、
+ * カーネル内でのコピーを省く。DMA 領域はデバイスを開いている間 usbfs_memory_mb の上限を占めるので、
+ * 消費者が保持している残りのバッファはヒープに一つずつ確保する (自動調整で解放できるように)。
+ */
+static void
+cusbfx2_ring_alloc(cusbfx2_transfer *transfer, gint length, gint nqueues, gint nbuffers)
+{
+	gint i, n_dev_buffers = 0;
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	transfer->dev_ring_size = (gsize)length * nqueues;
+	transfer->dev_ring = libusb_dev_mem_alloc(transfer->device->usb_handle, transfer->dev_ring_size);
+	if (transfer->dev_ring) {
+		g_message("[cusbfx2_ring_alloc] %s: using usbfs zero-copy buffer (%" G_GSIZE_FORMAT " bytes)",
+				  transfer->name, transfer->dev_ring_size);
+		n_dev_buffers = nqueues;
+	} else {
+		g_message("[cusbfx2_ring_alloc] %s: usbfs zero-copy buffer is not available "
+				  "(usbfs_memory_mb may be exhausted), fallback to heap", transfer->name);
+	}
+#endif
+
+	for (i = 0; i < nbuffers; ++i) {
+		cusbfx2_buffer *buffer = &transfer->buffers[i];
+		buffer->transfer = transfer;
+		buffer->length = 0;
+		buffer->ref_count = 0;
+		buffer->is_dev_mem = i < n_dev_buffers;
+		if (buffer->is_dev_mem) {
+			buffer->data = transfer->dev_ring + (gsize)length * i;
+			g_queue_push_tail(transfer->free_dev_buffers, buffer);
+		} else {
+			buffer->data = g_malloc(length);
+			g_queue_push_tail(transfer->free_buffers, buffer);
+			++transfer->n_free_allocated;
+		}
+	}
+}
+
+static void
+cusbfx2_ring_free(cusbfx2_transfer *transfer)
+{
+	gint i;
+
+	for (i = 0; i < transfer->nbuffers; ++i) {
+		if (!transfer->buffers[i].is_dev_mem) {
+			g_free(transfer->buffers[i].data);
+		}
+	}
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+	if (transfer->dev_ring) {
+		libusb_dev_mem_free(transfer->device->usb_handle, transfer->dev_ring, transfer->dev_ring_size);
+	}
+#endif
+}
+
+/**
+ * 空きバッファを取り出す。DMA 領域のバッファを優先する。mutex を取って呼ぶこと。
+ */
+static cusbfx2_buffer *
+cusbfx2_ring_pop(cusbfx2_transfer *transfer)
+{
+	cusbfx2_buffer *buffer = g_queue_pop_head(transfer->free_dev_buffers);
+
+	if (buffer)
+		return buffer;
+
+	buffer = g_queue_pop_head(transfer->free_buffers);
+	if (!buffer)
+		return NULL;
+	if (buffer->data) {
+		--transfer->n_free_allocated;
+		transfer->tune_min_free_allocated = MIN(transfer->tune_min_free_allocated, transfer->n_free_allocated);
+	} else {
+		/* 自動調整で解放したバッファは、使うときに確保し直す */
+		buffer->data = g_malloc(transfer->max_length);
+	}
+	return buffer;
+}
+
+/**
+ * 空きバッファを戻す。直前に使ったバッファから再利用し、触るページを少なくする。mutex を取って呼ぶこと。
+ */
+static void
+cusbfx2_ring_push(cusbfx2_transfer *transfer, cusbfx2_buffer *buffer)
+{
+	if (buffer->is_dev_mem) {
+		g_queue_push_head(transfer->free_dev_buffers, buffer);
+	} else {
+		g_queue_push_head(transfer->free_buffers, buffer);
+		++transfer->n_free_allocated;
+	}
+}
+
+/**
+ * 計測期間の間ずっと空いていたヒープのバッファを、@a keep 個を残して解放する。mutex を取って呼ぶこと。
+ *
+ * @return 解放したバッファ数
+ */
+static gint
+cusbfx2_ring_shrink(cusbfx2_transfer *transfer, gint keep)
+{
+	GList *p;
+	gint n, n_released = 0;
+
+	n = MIN(transfer->tune_min_free_allocated, transfer->n_free_allocated) - keep;
+	for (p = g_queue_peek_tail_link(transfer->free_buffers); p && n_released < n; p = p->prev) {
+		cusbfx2_buffer *buffer = p->data;
+		if (buffer->data) {
+			g_free(buffer->data);
+			buffer->data = NULL;
+			++n_released;
+		}
+	}
+	transfer->n_free_allocated -= n_released;
+	transfer->tune_min_free_allocated = G_MAXINT;
+
+	return n_released;
+}
+
+static guint
+cusbfx2_ring_get_free_count(cusbfx2_transfer *transfer)
+{
+	return g_queue_get_length(transfer->free_dev_buffers) + g_queue_get_length(transfer->free_buffers);
+}
+
+static void
+cusbfx2_transfer_destroy(cusbfx2_transfer *transfer)
+{
+	g_queue_free(transfer->free_dev_buffers);
+	g_queue_free(transfer->free_buffers);
+	g_queue_free(transfer->idle_slots);
+	g_queue_free(transfer->spare_slots);
+	g_mutex_free(transfer->mutex);
+	g_free(transfer->buffers);
+	g_free(transfer->slots);
+	cusbfx2_ring_free(transfer);
+	cusbfx2_close(transfer->device);
+	g_free(transfer);
+}
+
+/* Statistics
+   -------------------------------------------------------------------------- */
+
+static gint
+cusbfx2_stats_bucket(gint64 usec)
+{
+	gint i;
+	for (i = 0; i < CUSBFX2_STATS_HISTOGRAM_SIZE - 1; ++i) {
+		if (usec < ((gint64)CUSBFX2_STATS_HISTOGRAM_BASE << i))
+			break;
+	}
+	return i;
+}
+
+/* 最大値を更新する。更新は複数のスレッドから行われることがある */
+static void
+cusbfx2_stats_update_max(volatile gint *max, gint value)
+{
+	gint old;
+	do {
+		old = g_atomic_int_get(max);
+		if (value <= old)
+			return;
+	} while (!g_atomic_int_compare_and_exchange(max, old, value));
+}
+
+/**
+ * 転送完了時の統計を更新する。イベントスレッドからのみ呼ばれる。
+ */
+static void
+cusbfx2_stats_completed(cusbfx2_transfer *transfer, struct libusb_transfer *usb_transfer, gint64 now)
+{
+	if (transfer->stats_last_completed) {
+		gint64 gap = now - transfer->stats_last_completed;
+		g_atomic_int_inc(&transfer->stats_interval_histogram[cusbfx2_stats_bucket(gap)]);
+		cusbfx2_stats_update_max(&transfer->stats_max_gap, (gint)MIN(gap, G_MAXINT));
+	}
+	transfer->stats_last_completed = now;
+
+	switch (usb_transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		g_atomic_int_inc(&transfer->stats_completed);
+		if (usb_transfer->actual_length != usb_transfer->length)
+			g_atomic_int_inc(&transfer->stats_short);
+		g_mutex_lock(transfer->mutex);
+		transfer->stats_bytes += usb_transfer->actual_length;
+		g_mutex_unlock(transfer->mutex);
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		g_atomic_int_inc(&transfer->stats_timeouts);
+		break;
+	case LIBUSB_TRANSFER_ERROR:
+	case LIBUSB_TRANSFER_STALL:
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		g_atomic_int_inc(&transfer->stats_errors);
+		break;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		g_atomic_int_inc(&transfer->stats_overflows);
+		break;
+	default:
+		break;
+	}
+}
+
+static void
+cusbfx2_stats_resubmitted(cusbfx2_transfer *transfer, cusbfx2_slot *slot)
+{
+	gint64 latency;
+
+	if (!slot->completed_time)
+		return;					/* 最初の投入 */
+
+	latency = cusbfx2_get_current_usec() - slot->completed_time;
+	g_atomic_int_inc(&transfer->stats_resubmit_histogram[cusbfx2_stats_bucket(latency)]);
+	cusbfx2_stats_update_max(&transfer->stats_max_resubmit_latency, (gint)MIN(latency, G_MAXINT));
+}
+
+/* Transfer
+   -------------------------------------------------------------------------- */
+
+/**
+ * 参照が無くなったバッファをリングに返す。
+ *
+ * 空きバッファを待っている libusb_transfer があれば、そのまま引き渡して再投入する。
+ */
+static void
+cusbfx2_buffer_release(cusbfx2_buffer *buffer)
+{
+	cusbfx2_transfer *transfer = buffer->transfer;
+	cusbfx2_slot *slot = NULL;
+	gboolean is_destroy = FALSE;
+
+	g_mutex_lock(transfer->mutex);
+	if (transfer->is_running && (slot = g_queue_pop_head(transfer->idle_slots))) {
+		g_atomic_int_set(&buffer->ref_count, 1);
+	} else {
+		cusbfx2_ring_push(transfer, buffer);
+		is_destroy = (--transfer->n_held == 0 && transfer->is_freed);
+	}
+	g_mutex_unlock(transfer->mutex);
+
+	if (slot) {
+		cusbfx2_submit_buffer(slot, buffer);
+	}
+	if (is_destroy) {
+		cusbfx2_transfer_destroy(transfer);
+	}
+}
+
+/**
+ * バッファを slot の libusb_transfer に割り当てて投入する。
+ *
+ * @a buffer の参照は転送中の間 slot が保持する。
+ */
+static void
+cusbfx2_submit_buffer(cusbfx2_slot *slot, cusbfx2_buffer *buffer)
+{
+	cusbfx2_transfer *transfer = slot->transfer;
+	struct libusb_transfer *usb_transfer = slot->usb_transfer;
+	gint r;
+
+	buffer->length = 0;
+	usb_transfer->buffer = buffer->data;
+	usb_transfer->length = g_atomic_int_get(&transfer->cur_length);
+	slot->buffer = buffer;
+	g_atomic_int_inc(&transfer->n_inflight);
+
+	cusbfx2_stats_resubmitted(transfer, slot);
+
+	r = libusb_submit_transfer(usb_transfer);
+	if (r) {
+		g_critical("[cusbfx2_submit_buffer] %s: libusb_submit_transfer failed (%d)", transfer->name, r);
+		slot->buffer = NULL;
+		g_atomic_int_add(&transfer->n_inflight, -1);
+		cusbfx2_buffer_unref(buffer);
+	}
+}
+
+/**
+ * 空きバッファを slot に割り当てて再投入する。
+ *
+ * 空きバッファが無ければ、いずれかのバッファが解放されるまで slot を待機させる。
+ * 同時リクエスト数を越えていれば slot を休ませる。
+ */
+static void
+cusbfx2_rearm_slot(cusbfx2_slot *slot)
+{
+	cusbfx2_transfer *transfer = slot->transfer;
+	cusbfx2_buffer *buffer = NULL;
+
+	slot->buffer = NULL;
+
+	g_mutex_lock(transfer->mutex);
+	if (transfer->is_running && transfer->n_active > transfer->cur_queues) {
+		--transfer->n_active;
+		g_queue_push_tail(transfer->spare_slots, slot);
+	} else if (transfer->is_running) {
+		buffer = cusbfx2_ring_pop(transfer);
+		if (buffer) {
+			g_atomic_int_set(&buffer->ref_count, 1);
+			++transfer->n_held;
+		} else {
+			g_queue_push_tail(transfer->idle_slots, slot);
+			if (g_atomic_int_exchange_and_add(&transfer->stats_starved, 1) == 0) {
+				g_warning("[cusbfx2_rearm_slot] %s: all %d buffers are in use, transfer is waiting",
+						  transfer->name, transfer->nbuffers);
+			}
+		}
+	}
+	g_mutex_unlock(transfer->mutex);
+
+	if (buffer) {
+		cusbfx2_submit_buffer(slot, buffer);
+	}
+}
+
+/**
+ * 転送の完了間隔とスループットから、転送サイズと同時リクエスト数を調整する。
+ *
+ * 転送サイズはできるだけ大きくし、低レートでは完了間隔を長くして起床の回数を減らす。
+ * 完了間隔が CUSBFX2_TUNE_MAX_INTERVAL を越えるほど低いレートでだけ小さくする。
+ * 同時リクエスト数は CUSBFX2_TUNE_BUFFERED か最大の完了間隔の 2 倍のうち
+ * 長い方の時間に届くデータを受けられるように決める。
+ * 増やす方向へはすぐに、減らす方向へは 1/4 ずつ変更する。
+ * 計測期間の間ずっと使われなかったヒープのバッファは、同時リクエスト数の分を残して解放する。
+ */
+static void
+cusbfx2_tune_transfer(cusbfx2_transfer *transfer, gint actual_length, gint64 now)
+{
+	GSList *resume = NULL, *p;
+	gint64 elapsed, gap, budget;
+	gdouble rate;
+	gint length, queues, n_released;
+
+	if (transfer->tune_window_start == 0) {
+		transfer->tune_window_start = transfer->tune_last_completed = now;
+		return;
+	}
+
+	gap = now - transfer->tune_last_completed;
+	if (gap > transfer->tune_max_gap)
+		transfer->tune_max_gap = gap;
+	transfer->tune_last_completed = now;
+	transfer->tune_bytes += actual_length;
+
+	elapsed = now - transfer->tune_window_start;
+	if (elapsed < CUSBFX2_TUNE_WINDOW)
+		return;
+
+	rate = (gdouble)transfer->tune_bytes * G_USEC_PER_SEC / elapsed;
+	budget = MAX(CUSBFX2_TUNE_BUFFERED, transfer->tune_max_gap * 2);
+
+	length = (gint)MIN(rate * CUSBFX2_TUNE_MAX_INTERVAL / G_USEC_PER_SEC, transfer->max_length);
+	length = (length + CUSBFX2_TUNE_ALIGN - 1) / CUSBFX2_TUNE_ALIGN * CUSBFX2_TUNE_ALIGN;
+	length = CLAMP(length, transfer->min_length, transfer->max_length);
+
+	queues = (gint)(rate * budget / G_USEC_PER_SEC / length) + 1;
+	queues = CLAMP(queues, transfer->min_queues, transfer->max_queues);
+
+	g_mutex_lock(transfer->mutex);
+	if (length < transfer->cur_length)
+		length = MAX(length, transfer->cur_length - transfer->cur_length / 4 / CUSBFX2_TUNE_ALIGN * CUSBFX2_TUNE_ALIGN);
+	if (queues < transfer->cur_queues)
+		queues = MAX(queues, transfer->cur_queues - MAX(transfer->cur_queues / 4, 1));
+
+	if (length != transfer->cur_length || queues != transfer->cur_queues) {
+		g_message("[cusbfx2_tune_transfer] %s: %.2f MB/s, max gap %.1f ms: %d x %d -> %d x %d",
+				  transfer->name, rate / (1024 * 1024), transfer->tune_max_gap / 1000.,
+				  transfer->cur_length, transfer->cur_queues, length, queues);
+		g_atomic_int_set(&transfer->cur_length, length);
+		transfer->cur_queues = queues;
+
+		/* 休ませていた転送を再開する */
+		while (transfer->n_active < transfer->cur_queues && !g_queue_is_empty(transfer->spare_slots)) {
+			resume = g_slist_prepend(resume, g_queue_pop_head(transfer->spare_slots));
+			++transfer->n_active;
+		}
+	}
+	n_released = cusbfx2_ring_shrink(transfer, transfer->cur_queues);
+	g_mutex_unlock(transfer->mutex);
+
+	if (n_released > 0) {
+		g_debug("[cusbfx2_tune_transfer] %s: released %d idle buffers (%d bytes)",
+				transfer->name, n_released, n_released * transfer->max_length);
+	}
+
+	for (p = resume; p; p = g_slist_next(p)) {
+		cusbfx2_rearm_slot((cusbfx2_slot *)p->data);
+	}
+	g_slist_free(resume);
+
+	transfer->tune_window_start = now;
+	transfer->tune_bytes = 0;
+	transfer->tune_max_gap = 0;
+}
+
+/* Watchdog
+   -------------------------------------------------------------------------- */
+
+/**
+ * データの受信を記録し、受信レートを更新する。イベントスレッドからのみ呼ばれる。
+ */
+static void
+cusbfx2_watchdog_feed(cusbfx2_transfer *transfer, gint length, gint64 now)
+{
+	gint64 interval = now - transfer->watchdog_last_data;
+
+	if (transfer->watchdog_last_data && interval > 0) {
+		gdouble rate = (gdouble)length / interval;
+		if (transfer->watchdog_rate > 0) {
+			rate = transfer->watchdog_rate * (1 - CUSBFX2_WATCHDOG_WEIGHT) + rate * CUSBFX2_WATCHDOG_WEIGHT;
+		}
+		transfer->watchdog_rate = rate;
+	}
+	transfer->watchdog_last_data = now;
+}
+
+/**
+ * ストールを通知する。再開されるまでは一度しか通知しない。
+ */
+static gboolean
+cusbfx2_watchdog_trip(cusbfx2_transfer *transfer, cusbfx2_stall_reason reason, gint64 now, cusbfx2_stall_info *info)
+{
+	if (!transfer->stall_callback)
+		return FALSE;
+	if (!g_atomic_int_compare_and_exchange(&transfer->is_stalled, FALSE, TRUE))
+		return FALSE;
+
+	info->reason = reason;
+	info->silent = transfer->watchdog_last_data ? (gdouble)(now - transfer->watchdog_last_data) / G_USEC_PER_SEC : 0;
+	info->bytes_per_sec = transfer->watchdog_rate * G_USEC_PER_SEC;
+
+	g_warning("[cusbfx2_watchdog_trip] %s: transfer stalled (reason=%d, silent=%.3fs, rate=%.0fB/s)",
+			  transfer->name, reason, info->silent, info->bytes_per_sec);
+	return TRUE;
+}
+
+static void
+cusbfx2_watchdog_report(cusbfx2_transfer *transfer, cusbfx2_stall_reason reason, gint64 now)
+{
+	cusbfx2_stall_info info;
+
+	if (cusbfx2_watchdog_trip(transfer, reason, now, &info)) {
+		transfer->stall_callback(transfer, &info, transfer->stall_user_data);
+	}
+}
+
+/**
+ * 受信レートから期待される間隔を越えてデータが届かない転送を探す。
+ *
+ * エラーを返さずに止まった転送も、libusb のタイムアウトを待たずに検出できる。
+ */
+static void
+cusbfx2_check_watchdogs(void)
+{
+	gint64 now;
+	GList *l;
+	GArray *reports;
+	guint i;
+
+	if (!st_watchdogs)
+		return;
+
+	now = cusbfx2_get_current_usec();
+	if (now - st_watchdog_last_check < CUSBFX2_WATCHDOG_INTERVAL)
+		return;
+	st_watchdog_last_check = now;
+
+	/* コールバックは復旧のために転送を止めたり監視を変えたりするので、ロックを放してから呼ぶ */
+	reports = g_array_new(FALSE, FALSE, sizeof(cusbfx2_stall_report));
+
+	g_mutex_lock(st_watchdog_mutex);
+	for (l = st_watchdogs; l; l = l->next) {
+		cusbfx2_transfer *transfer = l->data;
+		gint64 threshold = transfer->watchdog_timeout;
+		cusbfx2_stall_report report;
+
+		if (!transfer->is_running || !transfer->watchdog_last_data || g_atomic_int_get(&transfer->is_stalled))
+			continue;
+
+		if (transfer->watchdog_rate > 0) {
+			threshold = MAX(threshold, (gint64)(CUSBFX2_WATCHDOG_FACTOR * g_atomic_int_get(&transfer->cur_length) / transfer->watchdog_rate));
+		}
+		if (now - transfer->watchdog_last_data > threshold &&
+			cusbfx2_watchdog_trip(transfer, CUSBFX2_STALL_SILENT, now, &report.info)) {
+			report.transfer = transfer;
+			report.callback = transfer->stall_callback;
+			report.user_data = transfer->stall_user_data;
+			g_array_append_val(reports, report);
+		}
+	}
+	g_mutex_unlock(st_watchdog_mutex);
+
+	for (i = 0; i < reports->len; ++i) {
+		cusbfx2_stall_report *report = &g_array_index(reports, cusbfx2_stall_report, i);
+		report->callback(report->transfer, &report->info, report->user_data);
+	}
+	g_array_free(reports, TRUE);
+}
+
+static void
+cusbfx2_transfer_callback(struct libusb_transfer *usb_transfer)
+{
+	cusbfx2_slot *slot;
+	cusbfx2_buffer *buffer;
+	cusbfx2_transfer *transfer;
+	gint r;
+	gboolean is_resubmit = TRUE;
+
+	slot = (cusbfx2_slot *)usb_transfer->user_data;
+	g_assert(slot);
+	g_assert(slot->buffer);
+	transfer = slot->transfer;
+	buffer = slot->buffer;
+
+	/* 手放した転送は、消費者に渡さず再投入もしない */
+	if (g_atomic_int_get(&transfer->is_abandoned)) {
+		slot->buffer = NULL;
+		g_atomic_int_add(&transfer->n_inflight, -1);
+		cusbfx2_buffer_unref(buffer);
+		return;
+	}
+
+	slot->completed_time = cusbfx2_get_current_usec();
+	cusbfx2_stats_completed(transfer, usb_transfer, slot->completed_time);
+
+	switch (usb_transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		if (usb_transfer->actual_length != usb_transfer->length) {
+			g_warning("[cusbfx2_transfer_callback] %s: transfered length mismatch (expect=%d, actual=%d)",
+					  transfer->name, usb_transfer->length, usb_transfer->actual_length);
+		}
+
+		buffer->length = usb_transfer->actual_length;
+		if (usb_transfer->actual_length > 0) {
+			cusbfx2_watchdog_feed(transfer, usb_transfer->actual_length, slot->completed_time);
+		}
+		if (transfer->is_auto_tune) {
+			cusbfx2_tune_transfer(transfer, usb_transfer->actual_length, slot->completed_time);
+		}
+		if (transfer->buffer_callback) {
+			is_resubmit = transfer->buffer_callback(buffer, transfer->user_data);
+		} else if (transfer->callback) {
+			is_resubmit = transfer->callback(buffer->data, buffer->length, transfer->user_data);
+		}
 		break;
 
 	case LIBUSB_TRANSFER_ERROR:
 		g_warning("[cusbfx2_transfer_callback] %s: an error occurred", transfer->name);
+		cusbfx2_watchdog_report(transfer, CUSBFX2_STALL_ERROR, slot->completed_time);
 		break;
 
 	case LIBUSB_TRANSFER_TIMED_OUT:
 		g_warning("[cusbfx2_transfer_callback] %s: timeout occurred", transfer->name);
+		cusbfx2_watchdog_report(transfer, CUSBFX2_STALL_TIMEOUT, slot->completed_time);
 		break;
 
 	case LIBUSB_TRANSFER_CANCELLED:
@@ -338,10 +1544,16 @@ cusbfx2_transfer_callback(struct libusb_transfer *usb_transfer)
 
 	case LIBUSB_TRANSFER_STALL:
 		g_warning("[cusbfx2_transfer_callback] %s: stalled", transfer->name);
+		cusbfx2_watchdog_report(transfer, CUSBFX2_STALL_HALT, slot->completed_time);
+		/* 監視していれば、ホルトの解除は cusbfx2_restart_transfer() に任せる */
+		if (transfer->stall_callback)
+			is_resubmit = FALSE;
 		break;
 
 	case LIBUSB_TRANSFER_NO_DEVICE:
 		g_warning("[cusbfx2_transfer_callback] %s: device was disconnected", transfer->name);
+		cusbfx2_watchdog_report(transfer, CUSBFX2_STALL_NO_DEVICE, slot->completed_time);
+		is_resubmit = FALSE;
 		break;
 
 	case LIBUSB_TRANSFER_OVERFLOW:
@@ -352,19 +1564,119 @@ cusbfx2_transfer_callback(struct libusb_transfer *usb_transfer)
 		g_assert_not_reached();
 	}
 
-	/* re-submit transfer */
-	if (usb_transfer->status != LIBUSB_TRANSFER_CANCELLED && is_resubmit) {
+	/* データを受け取っていなければ、同じバッファのまま再投入する */
+	if (usb_transfer->status != LIBUSB_TRANSFER_COMPLETED &&
+		usb_transfer->status != LIBUSB_TRANSFER_CANCELLED && is_resubmit) {
+		cusbfx2_stats_resubmitted(transfer, slot);
 		r = libusb_submit_transfer(usb_transfer);
-		if (r) {
-			g_critical("[cusbfx2_transfer_callback] %s: libusb_submit_transfer failed (%d)", transfer->name, r);
+		if (!r)
+			return;
+		g_critical("[cusbfx2_transfer_callback] %s: libusb_submit_transfer failed (%d)", transfer->name, r);
+		is_resubmit = FALSE;
+	}
+
+	/* 受信したバッファの参照を消費者に委ね、空きバッファで再投入する */
+	slot->buffer = NULL;
+	g_atomic_int_add(&transfer->n_inflight, -1);
+	cusbfx2_buffer_unref(buffer);
+
+	if (usb_transfer->status != LIBUSB_TRANSFER_CANCELLED && is_resubmit) {
+		cusbfx2_rearm_slot(slot);
+	} else {
+		g_mutex_lock(transfer->mutex);
+		--transfer->n_active;
+		g_mutex_unlock(transfer->mutex);
+	}
+}
+
+/**
+ * slot を @a nslots 個まで増やす。転送を開始する前にだけ呼べる。
+ */
+static void
+cusbfx2_transfer_add_slots(cusbfx2_transfer *transfer, gint nslots)
+{
+	gint i;
+
+	/* 配列を移すので、投入前の libusb_transfer が指す slot も付け替える */
+	transfer->slots = g_renew(cusbfx2_slot, transfer->slots, nslots);
+	for (i = 0; i < transfer->nslots; ++i) {
+		transfer->slots[i].usb_transfer->user_data = &transfer->slots[i];
+	}
+
+	for (i = transfer->nslots; i < nslots; ++i) {
+		cusbfx2_slot *slot = &transfer->slots[transfer->nslots];
+		struct libusb_transfer *usb_transfer;
+
+		usb_transfer = libusb_alloc_transfer(0);
+		if (!usb_transfer) {
+			g_critical("[cusbfx2_transfer_add_slots] %s: libusb_alloc_transfer failed", transfer->name);
+			continue;
+		}
+
+		slot->transfer = transfer;
+		slot->usb_transfer = usb_transfer;
+		slot->buffer = NULL;
+		slot->completed_time = 0;
+		++transfer->nslots;
+
+		/* バッファは投入時にリングから割り当てる */
+		if (transfer->is_interrupt) {
+			libusb_fill_interrupt_transfer(usb_transfer, transfer->device->usb_handle, transfer->endpoint,
+										   NULL, transfer->max_length,
+										   cusbfx2_transfer_callback, slot, CUSBFX2_TRANSFER_TIMEOUT);
+		} else {
+			libusb_fill_bulk_transfer(usb_transfer, transfer->device->usb_handle, transfer->endpoint,
+									  NULL, transfer->max_length,
+									  cusbfx2_transfer_callback, slot, CUSBFX2_TRANSFER_TIMEOUT);
 		}
 	}
 }
 
+static cusbfx2_transfer *
+cusbfx2_transfer_new(cusbfx2_handle *h, const gchar *name, gboolean is_interrupt,
+					 guint8 endpoint, gint length, gint nqueues, gint nbuffers)
+{
+	cusbfx2_transfer *transfer;
+
+	g_assert(h);
+	g_assert(h->usb_handle);
+	g_assert(length > 0);
+	g_assert(nqueues > 0);
+	g_assert(nbuffers >= nqueues);
+
+	transfer = g_malloc0(sizeof(*transfer));
+	transfer->name = name;
+	transfer->endpoint = endpoint;
+	transfer->is_interrupt = is_interrupt;
+
+	transfer->device = h;
+	g_atomic_int_inc(&h->ref_count);
+
+	transfer->nbuffers = nbuffers;
+	transfer->buffers = g_new0(cusbfx2_buffer, nbuffers);
+	transfer->mutex = g_mutex_new();
+	transfer->free_dev_buffers = g_queue_new();
+	transfer->free_buffers = g_queue_new();
+	transfer->idle_slots = g_queue_new();
+	transfer->spare_slots = g_queue_new();
+	transfer->max_length = transfer->cur_length = length;
+	cusbfx2_ring_alloc(transfer, length, nqueues, nbuffers);
+	cusbfx2_transfer_add_slots(transfer, nqueues);
+
+	transfer->max_queues = transfer->cur_queues = transfer->nslots;
+
+	g_message("[cusbfx2_init_bulk_transfer] %s: transfer started with %d x %d buffer (ring %d)",
+			  name, length, nqueues, nbuffers);
+
+	return transfer;
+}
+
 
 /**
  * Setup asynchronus bulk or intterupt transfer.
  *
+ * @a callback は受信したデータを呼び出しの間だけ参照できる。
+ *
  * @param[in]	name	Transfer identifier
  * @param[in]	is_interrupt	Setup intterupt transfer when TRUE, elsewhere setup bulk transfer.
  * @param[in]	length	転送サイズ
@@ -375,50 +1687,43 @@ cusbfx2_init_bulk_transfer(cusbfx2_handle *h, const gchar *name, gboolean is_int
 						   guint8 endpoint, gint length, gint nqueues,
 						   cusbfx2_transfer_cb_fn callback, gpointer user_data)
 {
-	gint i;
 	cusbfx2_transfer *transfer;
 
-	g_assert(h);
-	g_assert(h->usb_handle);
-	g_assert(length > 0);
-	g_assert(nqueues > 0);
 	g_assert(callback);
 
-	transfer = g_malloc0(sizeof(*transfer));
-	transfer->name = name;
-	transfer->usb_transfers = NULL;
+	transfer = cusbfx2_transfer_new(h, name, is_interrupt, endpoint, length, nqueues, nqueues);
 	transfer->callback = callback;
 	transfer->user_data = user_data;
 
-	for (i = 0; i < nqueues; ++i) {
-		struct libusb_transfer *usb_transfer;
-		gpointer buffer;
-
-		usb_transfer = libusb_alloc_transfer(0);
-		if (!usb_transfer) {
-			g_critical("[cusbfx2_init_bulk_transfer] %s: libusb_alloc_transfer failed", name);
-			continue;
-		}
+	return transfer;
+}
 
-		transfer->usb_transfers = g_slist_append(transfer->usb_transfers, usb_transfer);
+/**
+ * Setup asynchronus bulk or intterupt transfer with a buffer ring.
+ *
+ * 受信したバッファはコピーされずに @a callback へ渡される。
+ * @a callback の後もデータを使う場合は cusbfx2_buffer_ref() で参照を取得し、
+ * 使い終えたら cusbfx2_buffer_unref() で解放すること。
+ * 全ての参照が解放されたバッファがリングに戻り、再び libusb に投入される。
+ *
+ * @param[in]	name	Transfer identifier
+ * @param[in]	is_interrupt	Setup intterupt transfer when TRUE, elsewhere setup bulk transfer.
+ * @param[in]	length	転送サイズ
+ * @param[in]	nqueues	キュー数
+ * @param[in]	nbuffers	リングのバッファ数 (@a nqueues 以上)
+ */
+cusbfx2_transfer *
+cusbfx2_init_bulk_transfer_ring(cusbfx2_handle *h, const gchar *name, gboolean is_interrupt,
+								guint8 endpoint, gint length, gint nqueues, gint nbuffers,
+								cusbfx2_transfer_buffer_cb_fn callback, gpointer user_data)
+{
+	cusbfx2_transfer *transfer;
 
-		buffer = g_malloc(length);
-		if (is_interrupt) {
-			libusb_fill_interrupt_transfer(usb_transfer, h->usb_handle, endpoint, buffer, length,
-										   cusbfx2_transfer_callback, transfer, CUSBFX2_TRANSFER_TIMEOUT);
-		} else {
-			libusb_fill_bulk_transfer(usb_transfer, h->usb_handle, endpoint, buffer, length,
-									  cusbfx2_transfer_callback, transfer, CUSBFX2_TRANSFER_TIMEOUT);
-		}
-#if 0
-		r = libusb_submit_transfer(usb_transfer);
-		if (r) {
-			g_critical("[cusbfx2_init_bulk_transfer] %s: libusb_submit_transfer failed (%d)", name, r);
-		}
-#endif
-	}
+	g_assert(callback);
 
-	g_message("[cusbfx2_init_bulk_transfer] %s: transfer started with %d x %d buffer", name, length, nqueues);
+	transfer = cusbfx2_transfer_new(h, name, is_interrupt, endpoint, length, nqueues, MAX(nbuffers, nqueues));
+	transfer->buffer_callback = callback;
+	transfer->user_data = user_data;
 
 	return transfer;
 }
@@ -426,50 +1731,306 @@ cusbfx2_init_bulk_transfer(cusbfx2_handle *h, const gchar *name, gboolean is_int
 void
 cusbfx2_start_transfer(cusbfx2_transfer *transfer)
 {
-	GSList *p;
-	for (p = transfer->usb_transfers; p; p = g_slist_next(p)) {
-		struct libusb_transfer *usb_transfer = (struct libusb_transfer *)p->data;
-		gint r = libusb_submit_transfer(usb_transfer);
-		if (r) {
-			g_critical("[cusbfx2_start_transfer] %s: libusb_submit_transfer failed (%d)", transfer->name, r);
-		}
+	gint i;
+
+	g_mutex_lock(transfer->mutex);
+	transfer->is_running = TRUE;
+	transfer->n_active = 0;
+	while (g_queue_pop_head(transfer->spare_slots))
+		;
+	transfer->tune_window_start = 0;
+	transfer->tune_min_free_allocated = G_MAXINT;
+	if (!transfer->stats_start)
+		transfer->stats_start = cusbfx2_get_current_usec();
+	transfer->watchdog_last_data = cusbfx2_get_current_usec();
+	g_atomic_int_set(&transfer->is_stalled, FALSE);
+	g_mutex_unlock(transfer->mutex);
+
+	for (i = 0; i < transfer->nslots; ++i) {
+		g_mutex_lock(transfer->mutex);
+		++transfer->n_active;
+		g_mutex_unlock(transfer->mutex);
+		cusbfx2_rearm_slot(&transfer->slots[i]);
+	}
+}
+
+/**
+ * 転送サイズと同時リクエスト数の自動調整を設定する。
+ *
+ * 自動調整中は cusbfx2_init_bulk_transfer() で指定した転送サイズが上限となり、
+ * スループットと完了間隔のばらつきから実際の値を決める。
+ * 同時リクエスト数は指定したキュー数から始め、@a max_queues (リングのバッファ数まで) まで増やす。
+ * 使われていないヒープのバッファは解放し、必要になれば確保し直す。
+ * 転送を開始する前に呼ぶこと。
+ *
+ * @param[in]	is_auto_tune	TRUE なら自動調整を行う
+ * @param[in]	max_queues	同時リクエスト数の上限
+ */
+void
+cusbfx2_set_transfer_auto_tune(cusbfx2_transfer *transfer, gboolean is_auto_tune, gint max_queues)
+{
+	g_assert(transfer);
+	g_assert(!transfer->is_running);
+
+	if (is_auto_tune && max_queues > transfer->nslots) {
+		cusbfx2_transfer_add_slots(transfer, MIN(max_queues, transfer->nbuffers));
+		transfer->max_queues = transfer->nslots;
+	}
+
+	g_mutex_lock(transfer->mutex);
+	transfer->is_auto_tune = is_auto_tune;
+	transfer->min_length = MIN(CUSBFX2_TUNE_MIN_LENGTH, transfer->max_length);
+	transfer->min_queues = MIN(CUSBFX2_TUNE_MIN_QUEUES, transfer->max_queues);
+	if (!is_auto_tune) {
+		g_atomic_int_set(&transfer->cur_length, transfer->max_length);
+		transfer->cur_queues = transfer->max_queues;
+	}
+	transfer->tune_window_start = 0;
+	g_mutex_unlock(transfer->mutex);
+
+	g_message("[cusbfx2_set_transfer_auto_tune] %s: auto-tune %s (%d-%d bytes x %d-%d)",
+			  transfer->name, is_auto_tune ? "enabled" : "disabled",
+			  transfer->min_length, transfer->max_length, transfer->min_queues, transfer->max_queues);
+}
+
+/**
+ * 転送の統計を取得する。
+ *
+ * 統計はロックを取らずに更新されるため、各値は取得した時点での近似値となる。
+ */
+void
+cusbfx2_get_transfer_stats(cusbfx2_transfer *transfer, cusbfx2_transfer_stats *stats)
+{
+	gint i;
+
+	g_assert(transfer);
+	g_assert(stats);
+
+	stats->elapsed = transfer->stats_start
+		? (gdouble)(cusbfx2_get_current_usec() - transfer->stats_start) / G_USEC_PER_SEC : .0;
+	g_mutex_lock(transfer->mutex);
+	stats->n_bytes = transfer->stats_bytes;
+	g_mutex_unlock(transfer->mutex);
+	stats->bytes_per_sec = stats->elapsed > .0 ? stats->n_bytes / stats->elapsed : .0;
+	stats->n_completed = g_atomic_int_get(&transfer->stats_completed);
+	stats->n_short = g_atomic_int_get(&transfer->stats_short);
+	stats->n_timeouts = g_atomic_int_get(&transfer->stats_timeouts);
+	stats->n_errors = g_atomic_int_get(&transfer->stats_errors);
+	stats->n_overflows = g_atomic_int_get(&transfer->stats_overflows);
+	stats->n_starved = g_atomic_int_get(&transfer->stats_starved);
+	stats->max_gap = (gdouble)g_atomic_int_get(&transfer->stats_max_gap) / G_USEC_PER_SEC;
+	stats->max_resubmit_latency = (gdouble)g_atomic_int_get(&transfer->stats_max_resubmit_latency) / G_USEC_PER_SEC;
+	for (i = 0; i < CUSBFX2_STATS_HISTOGRAM_SIZE; ++i) {
+		stats->interval_histogram[i] = g_atomic_int_get(&transfer->stats_interval_histogram[i]);
+		stats->resubmit_histogram[i] = g_atomic_int_get(&transfer->stats_resubmit_histogram[i]);
 	}
 }
 
 void
 cusbfx2_cancel_transfer(cusbfx2_transfer *transfer)
 {
-	GSList *p;
-	for (p = transfer->usb_transfers; p; p = g_slist_next(p)) {
-		struct libusb_transfer *usb_transfer = (struct libusb_transfer *)p->data;
-		gint r = libusb_cancel_transfer(usb_transfer);
+	gint i;
+
+	g_mutex_lock(transfer->mutex);
+	transfer->is_running = FALSE;
+	while (g_queue_pop_head(transfer->idle_slots))
+		;
+	while (g_queue_pop_head(transfer->spare_slots))
+		;
+	g_mutex_unlock(transfer->mutex);
+
+	for (i = 0; i < transfer->nslots; ++i) {
+		cusbfx2_slot *slot = &transfer->slots[i];
+		gint r;
+		if (!slot->buffer)
+			continue;			/* 転送中ではない */
+		r = libusb_cancel_transfer(slot->usb_transfer);
 		if (r) {
 			g_warning("[cusbfx2_cancel_transfer] %s: libusb_cancel_transfer failed (%d)", transfer->name, r);
 		}
 	}
 }
 
+/**
+ * キャンセルした転送が全て戻ってくるのを待つ。
+ *
+ * @return 全て戻ってくれば TRUE
+ */
+static gboolean
+cusbfx2_wait_cancelled(cusbfx2_transfer *transfer)
+{
+	gint i;
+
+	for (i = 0; g_atomic_int_get(&transfer->n_inflight) > 0 && i < CUSBFX2_CANCEL_WAIT_MAX; ++i) {
+		struct timeval tv = { 0, CUSBFX2_CANCEL_WAIT };
+		libusb_handle_events_timeout(NULL, &tv);
+	}
+	return g_atomic_int_get(&transfer->n_inflight) == 0;
+}
+
+/**
+ * 止まった転送を投げ直す。
+ *
+ * 投入中の転送をキャンセルし、エンドポイントのホルトを解除してから再開する。
+ * イベントを処理しているスレッドやコールバックから呼んではならない。
+ *
+ * @return 再開できれば TRUE
+ */
+gboolean
+cusbfx2_restart_transfer(cusbfx2_transfer *transfer)
+{
+	gint r;
+
+	g_assert(transfer);
+
+	cusbfx2_cancel_transfer(transfer);
+	if (!cusbfx2_wait_cancelled(transfer)) {
+		g_warning("[cusbfx2_restart_transfer] %s: %d transfers are not cancelled",
+				  transfer->name, g_atomic_int_get(&transfer->n_inflight));
+		return FALSE;
+	}
+
+	r = cusbfx2_clear_halt(transfer->device, transfer->endpoint);
+	if (r == LIBUSB_ERROR_NO_DEVICE) {
+		return FALSE;
+	}
+
+	g_message("[cusbfx2_restart_transfer] %s: restarting transfer", transfer->name);
+	cusbfx2_start_transfer(transfer);
+	return TRUE;
+}
+
+/**
+ * 転送のストールを監視する。
+ *
+ * 受信レートから期待される間隔の CUSBFX2_WATCHDOG_FACTOR 倍 (最短 @a timeout_ms) を越えて
+ * データが届かないか、転送がエラーで終わると、@a callback がイベントを処理しているスレッドから
+ * 一度だけ呼ばれる。cusbfx2_restart_transfer() で再開すると再び監視する。
+ * @a callback は監視のロックを取らずに呼ばれる。別のスレッドが呼び出しの直前に転送を
+ * 解放していることがあるので、@a callback に渡る転送は識別にだけ使うこと。
+ *
+ * @param[in]	timeout_ms	ストールとみなす最短の無受信時間 (ミリ秒)
+ * @param[in]	callback	NULL なら監視をやめる
+ */
+void
+cusbfx2_set_transfer_watchdog(cusbfx2_transfer *transfer, gint timeout_ms,
+							  cusbfx2_stall_cb_fn callback, gpointer user_data)
+{
+	g_assert(transfer);
+	g_assert(st_watchdog_mutex);
+
+	g_mutex_lock(st_watchdog_mutex);
+	st_watchdogs = g_list_remove(st_watchdogs, transfer);
+	transfer->stall_callback = callback;
+	transfer->stall_user_data = user_data;
+	transfer->watchdog_timeout = (gint64)timeout_ms * 1000;
+	if (callback) {
+		st_watchdogs = g_list_append(st_watchdogs, transfer);
+	}
+	g_mutex_unlock(st_watchdog_mutex);
+}
+
+/**
+ * 転送を停止して解放する。
+ *
+ * 消費者が参照しているバッファが残っている場合、リングは最後の参照が解放された時点で破棄される。
+ * キャンセルした転送が戻ってこなければ、後で呼ばれるコールバックが触れるので、
+ * slot もリングも解放せずに手放す (メモリはリークする)。
+ */
 void
 cusbfx2_free_transfer(cusbfx2_transfer *transfer)
 {
-	GSList *p;
+	gint i;
+	gboolean is_destroy;
 
 	if (!transfer)
 		return;
 
-	for (p = transfer->usb_transfers; p; p = g_slist_next(p)) {
-		struct libusb_transfer *usb_transfer = (struct libusb_transfer *)p->data;
-		gint r = libusb_cancel_transfer(usb_transfer);
-		if (r) {
-			g_warning("[cusbfx2_cancel_transfer] %s: libusb_cancel_transfer failed (%d)", transfer->name, r);
+	cusbfx2_set_transfer_watchdog(transfer, 0, NULL, NULL);
+	cusbfx2_cancel_transfer(transfer);
+	if (!cusbfx2_wait_cancelled(transfer)) {
+		g_atomic_int_set(&transfer->is_abandoned, TRUE);
+		g_warning("[cusbfx2_free_transfer] %s: %d transfers are not cancelled, leaking the transfer",
+				  transfer->name, g_atomic_int_get(&transfer->n_inflight));
+		return;
+	}
+
+	for (i = 0; i < transfer->nslots; ++i) {
+		cusbfx2_slot *slot = &transfer->slots[i];
+		if (slot->buffer) {
+			cusbfx2_buffer_unref(slot->buffer);
+			slot->buffer = NULL;
 		}
-		g_free(usb_transfer->buffer);
-		libusb_free_transfer(usb_transfer);
+		libusb_free_transfer(slot->usb_transfer);
 	}
-	g_slist_free(transfer->usb_transfers);
-	g_free(transfer);
+	transfer->nslots = 0;
+
+	g_mutex_lock(transfer->mutex);
+	transfer->is_freed = TRUE;
+	is_destroy = (transfer->n_held == 0);
+	g_mutex_unlock(transfer->mutex);
+
+	if (is_destroy) {
+		cusbfx2_transfer_destroy(transfer);
+	}
+}
+
+
+/**
+ * バッファの参照カウントを増やす。
+ */
+cusbfx2_buffer *
+cusbfx2_buffer_ref(cusbfx2_buffer *buffer)
+{
+	g_assert(buffer);
+	g_atomic_int_inc(&buffer->ref_count);
+	return buffer;
+}
+
+/**
+ * バッファの参照カウントを減らす。
+ *
+ * 全ての参照が無くなったバッファはリングに戻り、再び転送に使われる。
+ */
+void
+cusbfx2_buffer_unref(cusbfx2_buffer *buffer)
+{
+	g_assert(buffer);
+	if (g_atomic_int_dec_and_test(&buffer->ref_count)) {
+		cusbfx2_buffer_release(buffer);
+	}
+}
+
+guint8 *
+cusbfx2_buffer_get_data(cusbfx2_buffer *buffer)
+{
+	return buffer->data;
 }
 
+gint
+cusbfx2_buffer_get_length(cusbfx2_buffer *buffer)
+{
+	return buffer->length;
+}
+
+/**
+ * バッファが属するリングの空きが、今の同時リクエスト数を下回っているか調べる。
+ *
+ * TRUE の間にバッファの参照を長く保持すると転送が空きバッファを待って止まるので、
+ * 呼び出し元はデータをコピーして参照をすぐに返すこと。
+ */
+gboolean
+cusbfx2_buffer_is_ring_low(cusbfx2_buffer *buffer)
+{
+	cusbfx2_transfer *transfer = buffer->transfer;
+	gboolean is_low;
+
+	g_mutex_lock(transfer->mutex);
+	is_low = (gint)cusbfx2_ring_get_free_count(transfer) < transfer->cur_queues;
+	g_mutex_unlock(transfer->mutex);
+
+	return is_low;
+}
 
 /**
  * Handle any pending events in blocking mode with a sensible timeout.
@@ -484,5 +2045,123 @@ cusbfx2_free_transfer(cusbfx2_transfer *transfer)
 int
 cusbfx2_poll(void)
 {
-	return libusb_handle_events(NULL);
+	struct timeval tv = { 0, CUSBFX2_WATCHDOG_INTERVAL };
+	gint r;
+
+	/* ストールを監視していれば、イベントが無くても定期的に戻って調べる */
+	if (!st_watchdogs)
+		return libusb_handle_events(NULL);
+
+	r = libusb_handle_events_timeout(NULL, &tv);
+	cusbfx2_check_watchdogs();
+	return r;
+}
+
+
+/* Event thread
+   -------------------------------------------------------------------------- */
+
+static gpointer
+cusbfx2_event_thread(gpointer data)
+{
+	gint r;
+
+	if (st_event_thread_priority > 0) {
+		struct sched_param param;
+		param.sched_priority = CLAMP(st_event_thread_priority,
+									 sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+		r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (r) {
+			g_warning("[cusbfx2_event_thread] couldn't set SCHED_FIFO priority %d (%s)",
+					  param.sched_priority, g_strerror(r));
+		} else {
+			g_message("[cusbfx2_event_thread] running with SCHED_FIFO priority %d", param.sched_priority);
+		}
+	}
+
+#ifdef __linux__
+	if (st_event_thread_cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(st_event_thread_cpu, &cpus);
+		if (sched_setaffinity(0, sizeof(cpus), &cpus)) {
+			g_warning("[cusbfx2_event_thread] couldn't pin to CPU %d (%s)", st_event_thread_cpu, g_strerror(errno));
+		} else {
+			g_message("[cusbfx2_event_thread] pinned to CPU %d", st_event_thread_cpu);
+		}
+	}
+#endif
+
+	while (g_atomic_int_get(&st_is_event_thread_running)) {
+		struct timeval tv = { 0, st_watchdogs ? CUSBFX2_WATCHDOG_INTERVAL : CUSBFX2_EVENT_THREAD_TIMEOUT };
+		r = libusb_handle_events_timeout(NULL, &tv);
+		if (r && r != LIBUSB_ERROR_INTERRUPTED) {
+			g_warning("[cusbfx2_event_thread] libusb_handle_events_timeout failed (%d)", r);
+		}
+		cusbfx2_check_watchdogs();
+	}
+
+	return NULL;
+}
+
+/**
+ * libusb のイベント処理を専用スレッドで開始する。
+ *
+ * スレッドが動いている間は、転送のコールバックはそのスレッドから呼ばれる。
+ * cusbfx2_poll() を呼ぶ必要はない。
+ *
+ * @param[in]	priority	0 より大きければ SCHED_FIFO の優先度として設定する
+ * @param[in]	cpu	0 以上であればスレッドをその CPU に固定する
+ * @return 開始できれば TRUE
+ */
+gboolean
+cusbfx2_start_event_thread(gint priority, gint cpu)
+{
+	GError *error = NULL;
+
+	if (st_event_thread)
+		return TRUE;
+
+	st_event_thread_priority = priority;
+	st_event_thread_cpu = cpu;
+	g_atomic_int_set(&st_is_event_thread_running, TRUE);
+
+	st_event_thread = g_thread_create(cusbfx2_event_thread, NULL, TRUE, &error);
+	if (error) {
+		g_critical("[cusbfx2_start_event_thread] %s", error->message);
+		g_clear_error(&error);
+		st_event_thread = NULL;
+		g_atomic_int_set(&st_is_event_thread_running, FALSE);
+		return FALSE;
+	}
+
+	g_debug("[cusbfx2_start_event_thread] event thread started");
+	return TRUE;
+}
+
+/**
+ * イベント処理スレッドを停止する。
+ *
+ * cusbfx2_exit() より前に呼ぶこと。
+ */
+void
+cusbfx2_stop_event_thread(void)
+{
+	if (!st_event_thread)
+		return;
+
+	g_atomic_int_set(&st_is_event_thread_running, FALSE);
+	g_thread_join(st_event_thread);
+	st_event_thread = NULL;
+
+	g_debug("[cusbfx2_stop_event_thread] event thread stopped");
+}
+
+/**
+ * イベント処理スレッドが動いていれば TRUE を返す。
+ */
+gboolean
+cusbfx2_is_event_thread_running(void)
+{
+	return st_event_thread != NULL;
 }
@@ -8,7 +8,75 @@ typedef struct cusbfx2_handle cusbfx2_handle;
 struct cusbfx2_transfer;
 typedef struct cusbfx2_transfer cusbfx2_transfer;
 
+struct cusbfx2_buffer;
+typedef struct cusbfx2_buffer cusbfx2_buffer;
+
+#define CUSBFX2_STATS_HISTOGRAM_SIZE 12
+#define CUSBFX2_STATS_HISTOGRAM_BASE 250	/* usec */
+
+/**
+ * 転送の統計。
+ *
+ * ヒストグラムの i 番目の区間は CUSBFX2_STATS_HISTOGRAM_BASE << (i - 1) 以上
+ * CUSBFX2_STATS_HISTOGRAM_BASE << i 未満 (usec) で、最後の区間には上限が無い。
+ */
+typedef struct cusbfx2_transfer_stats {
+	gdouble elapsed;				/* 転送開始からの秒数 */
+	guint64 n_bytes;				/* 受信したバイト数 */
+	gdouble bytes_per_sec;			/* 平均スループット */
+	guint n_completed;				/* 完了した転送数 */
+	guint n_short;					/* 要求より短かった転送数 */
+	guint n_timeouts;
+	guint n_errors;					/* エラー・ストール・切断 */
+	guint n_overflows;
+	guint n_starved;				/* 空きバッファが無く転送を待たせた回数 */
+	gdouble max_gap;				/* 転送完了の最大間隔 (秒) */
+	gdouble max_resubmit_latency;	/* 完了から再投入までの最大時間 (秒) */
+	guint interval_histogram[CUSBFX2_STATS_HISTOGRAM_SIZE];	/* 転送完了の間隔 */
+	guint resubmit_histogram[CUSBFX2_STATS_HISTOGRAM_SIZE];	/* 完了から再投入までの時間 */
+} cusbfx2_transfer_stats;
+
+/** 8051 の RAM に連続して書き込むファームウェアの区間 */
+typedef struct cusbfx2_firmware_segment {
+	guint16 address;			/* 書き込み先のアドレス */
+	guint16 length;
+	guint32 offset;				/* image 内の位置 */
+} cusbfx2_firmware_segment;
+
+/**
+ * 事前に区間へ分けたファームウェア。
+ *
+ * firmware/fw2segments.py で EEPROM イメージから生成する。
+ */
+typedef struct cusbfx2_firmware {
+	const gchar *id;			/* ロード後のデバイスが返す iManufacturer */
+	const guint8 *image;		/* 全区間のデータを続けたもの */
+	gsize image_length;
+	const cusbfx2_firmware_segment *segments;
+	gint nsegments;
+	gint patch_offset;			/* FX2 の ID で書き換える bcdDevice の image 内の位置 (-1:無し) */
+} cusbfx2_firmware;
+
+/** 転送が止まった理由 */
+typedef enum cusbfx2_stall_reason {
+	CUSBFX2_STALL_SILENT,		/* 期待される間隔を越えてデータが届かない */
+	CUSBFX2_STALL_TIMEOUT,		/* 転送がタイムアウトした */
+	CUSBFX2_STALL_HALT,			/* エンドポイントがストールした */
+	CUSBFX2_STALL_ERROR,		/* 転送エラー */
+	CUSBFX2_STALL_NO_DEVICE,	/* デバイスが切断された */
+} cusbfx2_stall_reason;
+
+/** ストールの通知 */
+typedef struct cusbfx2_stall_info {
+	cusbfx2_stall_reason reason;
+	gdouble silent;				/* 最後にデータを受信してからの秒数 */
+	gdouble bytes_per_sec;		/* 止まる前の受信レート */
+} cusbfx2_stall_info;
+
 typedef gboolean (*cusbfx2_transfer_cb_fn)(gpointer buf, gint length, gpointer user_data);
+typedef gboolean (*cusbfx2_transfer_buffer_cb_fn)(cusbfx2_buffer *buffer, gpointer user_data);
+typedef void (*cusbfx2_bulk_cb_fn)(gint status, guint8 *data, gint length, gpointer user_data);
+typedef void (*cusbfx2_stall_cb_fn)(cusbfx2_transfer *transfer, const cusbfx2_stall_info *info, gpointer user_data);
 
 
 gint
@@ -18,7 +86,14 @@ void
 cusbfx2_exit(void);
 
 cusbfx2_handle *
-cusbfx2_open(guint8 id, guint8 *firmware, const gchar *firmware_id, gboolean is_force_load);
+cusbfx2_open(guint8 id, const cusbfx2_firmware *firmware, gboolean is_force_load);
+
+gboolean
+cusbfx2_open_all(const guint8 *ids, gint n, const cusbfx2_firmware *firmware,
+				 gboolean is_force_load, cusbfx2_handle **handles);
+
+void
+cusbfx2_set_verify_firmware(gboolean is_verify);
 
 void
 cusbfx2_close(cusbfx2_handle *h);
@@ -26,21 +101,73 @@ cusbfx2_close(cusbfx2_handle *h);
 gint
 cusbfx2_bulk_transfer(cusbfx2_handle *h, guint8 endpoint, guint8 *data, gint length);
 
+gint
+cusbfx2_clear_halt(cusbfx2_handle *h, guint8 endpoint);
+
+gboolean
+cusbfx2_submit_bulk_transfer(cusbfx2_handle *h, guint8 endpoint, const guint8 *data, gint length,
+							 cusbfx2_bulk_cb_fn callback, gpointer user_data);
+
 cusbfx2_transfer *
 cusbfx2_init_bulk_transfer(cusbfx2_handle *h, const gchar *name, gboolean is_interrupt,
 						   guint8 endpoint, gint length, gint nqueues,
 						   cusbfx2_transfer_cb_fn callback, gpointer user_data);
 
+cusbfx2_transfer *
+cusbfx2_init_bulk_transfer_ring(cusbfx2_handle *h, const gchar *name, gboolean is_interrupt,
+								guint8 endpoint, gint length, gint nqueues, gint nbuffers,
+								cusbfx2_transfer_buffer_cb_fn callback, gpointer user_data);
+
 void
 cusbfx2_start_transfer(cusbfx2_transfer *transfer);
 
+void
+cusbfx2_set_transfer_auto_tune(cusbfx2_transfer *transfer, gboolean is_auto_tune, gint max_queues);
+
+void
+cusbfx2_get_transfer_stats(cusbfx2_transfer *transfer, cusbfx2_transfer_stats *stats);
+
 void
 cusbfx2_cancel_transfer(cusbfx2_transfer *transfer);
 
+gboolean
+cusbfx2_restart_transfer(cusbfx2_transfer *transfer);
+
+void
+cusbfx2_set_transfer_watchdog(cusbfx2_transfer *transfer, gint timeout_ms,
+							  cusbfx2_stall_cb_fn callback, gpointer user_data);
+
 void
 cusbfx2_free_transfer(cusbfx2_transfer *transfer);
 
 int
 cusbfx2_poll(void);
 
+gboolean
+cusbfx2_start_event_thread(gint priority, gint cpu);
+
+void
+cusbfx2_stop_event_thread(void);
+
+gboolean
+cusbfx2_is_event_thread_running(void);
+
+void
+cusbfx2_wait_events(glong usec);
+
+cusbfx2_buffer *
+cusbfx2_buffer_ref(cusbfx2_buffer *buffer);
+
+void
+cusbfx2_buffer_unref(cusbfx2_buffer *buffer);
+
+guint8 *
+cusbfx2_buffer_get_data(cusbfx2_buffer *buffer);
+
+gint
+cusbfx2_buffer_get_length(cusbfx2_buffer *buffer);
+
+gboolean
+cusbfx2_buffer_is_ring_low(cusbfx2_buffer *buffer);
+
 #endif	/* CUSBFX2_H_INCLUDED */
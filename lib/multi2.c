@@ -0,0 +1,522 @@
+#include <string.h>
+#include <glib.h>
+
+#include "multi2.h"
+#include "ts_simd.h"
+
+/*
+ * ARIB STD-B25 の MULTI2 暗号の復号。
+ *
+ * 8 バイトのブロックを CBC で復号し、8 バイトに満たない残りは CBC の値を暗号化した OFB で復号する。
+ * ブロックはビッグエンディアンの 32 ビット整数二つ (left, right) として扱う。
+ *
+ * CBC の復号はブロックごとに独立しているので、同じ鍵のブロックを MULTI2_LANES 個ずつ集め、
+ * AVX2 の使える CPU では 32 ビットのレーンに一つずつ載せて並列に復号する。
+ */
+
+#define MULTI2_LANES 16				/* 一度に復号するブロック数 (AVX2 の 8 レーン x 2) */
+
+/** 展開したワーク鍵と、その元になった鍵 */
+typedef struct {
+	Multi2Key key;				/* multi2_key_cache_unref() で戻せるよう先頭に置く */
+	guint32 system_key[8];
+	guint8 data_key[MULTI2_DATA_KEY_SIZE];
+	gint ref_count;
+	GList link;					/* 最近使った順のリストでの位置 */
+} Multi2KeyCacheEntry;
+
+struct Multi2KeyCache {
+	GQueue entries;				/* 先頭が最近使った鍵 */
+	guint max_keys;
+	guint64 n_hits;
+	guint64 n_misses;
+};
+
+/** MULTI2_LANES 個のブロックをその場で復号する */
+typedef void (*Multi2BlocksFunc)(const guint32 *work, gint round, guint32 *left, guint32 *right);
+
+static Multi2BlocksFunc st_decrypt_blocks = NULL;
+static gsize st_is_decrypt_blocks_initialized = 0;
+
+static inline guint32
+rol(guint32 x, guint n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+static inline guint32
+load_be32(const guint8 *p)
+{
+	return ((guint32)p[0] << 24) | ((guint32)p[1] << 16) | ((guint32)p[2] << 8) | p[3];
+}
+
+static inline void
+store_be32(guint8 *p, guint32 x)
+{
+	p[0] = x >> 24;
+	p[1] = (x >> 16) & 0xFF;
+	p[2] = (x >> 8) & 0xFF;
+	p[3] = x & 0xFF;
+}
+
+static inline void
+pi1(guint32 *left, guint32 *right)
+{
+	*right ^= *left;
+}
+
+static inline void
+pi2(guint32 *left, guint32 *right, guint32 k)
+{
+	guint32 x = *right + k;
+	guint32 y = rol(x, 1) + x - 1;
+	*left ^= rol(y, 4) ^ y;
+}
+
+static inline void
+pi3(guint32 *left, guint32 *right, guint32 k1, guint32 k2)
+{
+	guint32 x = *left + k1;
+	guint32 y = rol(x, 2) + x + 1;
+	guint32 z = rol(y, 8) ^ y;
+	guint32 w = z + k2;
+	guint32 v = rol(w, 14) - w;
+	*right ^= rol(v, 16) ^ (v | *left);
+}
+
+static inline void
+pi4(guint32 *left, guint32 *right, guint32 k)
+{
+	guint32 x = *right + k;
+	*left ^= rol(x, 2) + x + 1;
+}
+
+static void
+multi2_encrypt_block(const guint32 *work, gint round, guint32 *left, guint32 *right)
+{
+	gint i;
+
+	for (i = 0; i < round; ++i) {
+		pi1(left, right);
+		pi2(left, right, work[0]);
+		pi3(left, right, work[1], work[2]);
+		pi4(left, right, work[3]);
+		pi1(left, right);
+		pi2(left, right, work[4]);
+		pi3(left, right, work[5], work[6]);
+		pi4(left, right, work[7]);
+	}
+}
+
+static void
+multi2_decrypt_block(const guint32 *work, gint round, guint32 *left, guint32 *right)
+{
+	gint i;
+
+	for (i = 0; i < round; ++i) {
+		pi4(left, right, work[7]);
+		pi3(left, right, work[5], work[6]);
+		pi2(left, right, work[4]);
+		pi1(left, right);
+		pi4(left, right, work[3]);
+		pi3(left, right, work[1], work[2]);
+		pi2(left, right, work[0]);
+		pi1(left, right);
+	}
+}
+
+static void
+multi2_decrypt_blocks_scalar(const guint32 *work, gint round, guint32 *left, guint32 *right)
+{
+	guint i;
+
+	for (i = 0; i < MULTI2_LANES; ++i) {
+		multi2_decrypt_block(work, round, &left[i], &right[i]);
+	}
+}
+
+#ifdef TS_SIMD_HAVE_X86
+/*
+ * スカラーの pi1〜pi4 と同じ計算を 8 レーンで行う。
+ * 8 ビット・16 ビットの回転はバイトの並べ替えで済ませる。
+ */
+__attribute__((target("avx2")))
+static inline __m256i
+rol_avx2(__m256i x, gint n)
+{
+	return _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - n));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+rol8_avx2(__m256i x)
+{
+	return _mm256_shuffle_epi8(x, _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+												   3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+rol16_avx2(__m256i x)
+{
+	return _mm256_shuffle_epi8(x, _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+												   2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13));
+}
+
+__attribute__((target("avx2")))
+static inline void
+pi1_avx2(__m256i *left, __m256i *right)
+{
+	*right = _mm256_xor_si256(*right, *left);
+}
+
+__attribute__((target("avx2")))
+static inline void
+pi2_avx2(__m256i *left, __m256i *right, __m256i k)
+{
+	__m256i x = _mm256_add_epi32(*right, k);
+	__m256i y = _mm256_sub_epi32(_mm256_add_epi32(rol_avx2(x, 1), x), _mm256_set1_epi32(1));
+	*left = _mm256_xor_si256(*left, _mm256_xor_si256(rol_avx2(y, 4), y));
+}
+
+__attribute__((target("avx2")))
+static inline void
+pi3_avx2(__m256i *left, __m256i *right, __m256i k1, __m256i k2)
+{
+	__m256i x = _mm256_add_epi32(*left, k1);
+	__m256i y = _mm256_add_epi32(_mm256_add_epi32(rol_avx2(x, 2), x), _mm256_set1_epi32(1));
+	__m256i z = _mm256_xor_si256(rol8_avx2(y), y);
+	__m256i w = _mm256_add_epi32(z, k2);
+	__m256i v = _mm256_sub_epi32(rol_avx2(w, 14), w);
+	*right = _mm256_xor_si256(*right, _mm256_xor_si256(rol16_avx2(v), _mm256_or_si256(v, *left)));
+}
+
+__attribute__((target("avx2")))
+static inline void
+pi4_avx2(__m256i *left, __m256i *right, __m256i k)
+{
+	__m256i x = _mm256_add_epi32(*right, k);
+	*left = _mm256_xor_si256(*left, _mm256_add_epi32(_mm256_add_epi32(rol_avx2(x, 2), x),
+													 _mm256_set1_epi32(1)));
+}
+
+/**
+ * 16 ブロックを 8 レーンのベクトル二組で復号する。二組は依存しないので命令の待ちを埋め合う。
+ */
+__attribute__((target("avx2")))
+static void
+multi2_decrypt_blocks_avx2(const guint32 *work, gint round, guint32 *left, guint32 *right)
+{
+	__m256i l0 = _mm256_loadu_si256((const __m256i *)left);
+	__m256i l1 = _mm256_loadu_si256((const __m256i *)(left + 8));
+	__m256i r0 = _mm256_loadu_si256((const __m256i *)right);
+	__m256i r1 = _mm256_loadu_si256((const __m256i *)(right + 8));
+	__m256i k[8];
+	gint i;
+
+	for (i = 0; i < 8; ++i) {
+		k[i] = _mm256_set1_epi32(work[i]);
+	}
+
+	for (i = 0; i < round; ++i) {
+		pi4_avx2(&l0, &r0, k[7]);
+		pi4_avx2(&l1, &r1, k[7]);
+		pi3_avx2(&l0, &r0, k[5], k[6]);
+		pi3_avx2(&l1, &r1, k[5], k[6]);
+		pi2_avx2(&l0, &r0, k[4]);
+		pi2_avx2(&l1, &r1, k[4]);
+		pi1_avx2(&l0, &r0);
+		pi1_avx2(&l1, &r1);
+		pi4_avx2(&l0, &r0, k[3]);
+		pi4_avx2(&l1, &r1, k[3]);
+		pi3_avx2(&l0, &r0, k[1], k[2]);
+		pi3_avx2(&l1, &r1, k[1], k[2]);
+		pi2_avx2(&l0, &r0, k[0]);
+		pi2_avx2(&l1, &r1, k[0]);
+		pi1_avx2(&l0, &r0);
+		pi1_avx2(&l1, &r1);
+	}
+
+	_mm256_storeu_si256((__m256i *)left, l0);
+	_mm256_storeu_si256((__m256i *)(left + 8), l1);
+	_mm256_storeu_si256((__m256i *)right, r0);
+	_mm256_storeu_si256((__m256i *)(right + 8), r1);
+}
+#endif
+
+/**
+ * @a func がスカラーの復号と全てのビットで一致するかを、固定の鍵とブロックで確かめる。
+ */
+static gboolean
+multi2_check_blocks(Multi2BlocksFunc func)
+{
+	guint32 work[8], left[MULTI2_LANES], right[MULTI2_LANES];
+	guint32 expect_left[MULTI2_LANES], expect_right[MULTI2_LANES];
+	guint32 seed = 0x2545F491;
+	gint round;
+	guint i;
+
+	for (i = 0; i < 8; ++i) {
+		work[i] = seed = seed * 1103515245 + 12345;
+	}
+	for (i = 0; i < MULTI2_LANES; ++i) {
+		expect_left[i] = seed = seed * 1103515245 + 12345;
+		expect_right[i] = seed = seed * 1103515245 + 12345;
+	}
+
+	for (round = 1; round <= MULTI2_MAX_ROUND; ++round) {
+		memcpy(left, expect_left, sizeof(left));
+		memcpy(right, expect_right, sizeof(right));
+		multi2_decrypt_blocks_scalar(work, round, expect_left, expect_right);
+		func(work, round, left, right);
+		if (memcmp(left, expect_left, sizeof(left)) != 0 || memcmp(right, expect_right, sizeof(right)) != 0)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void
+multi2_init_decrypt_blocks(void)
+{
+	if (g_once_init_enter(&st_is_decrypt_blocks_initialized)) {
+		st_decrypt_blocks = multi2_decrypt_blocks_scalar;
+#ifdef TS_SIMD_HAVE_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			if (multi2_check_blocks(multi2_decrypt_blocks_avx2)) {
+				st_decrypt_blocks = multi2_decrypt_blocks_avx2;
+			} else {
+				g_warning("[multi2_init_decrypt_blocks] AVX2 kernel disagrees with scalar, disabled");
+			}
+		}
+#endif
+		g_once_init_leave(&st_is_decrypt_blocks_initialized, 1);
+	}
+}
+
+
+/* Exposed functions
+   -------------------------------------------------------------------------- */
+
+/**
+ * B-CAS カードの初期データから復号の共通の値を作る。
+ *
+ * @param system_key	MULTI2_SYSTEM_KEY_SIZE バイトのシステム鍵
+ * @param init_cbc	MULTI2_CBC_SIZE バイトの初期 CBC
+ */
+void
+multi2_init(Multi2 *self, const guint8 *system_key, const guint8 *init_cbc, gint round)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(self->system_key); ++i) {
+		self->system_key[i] = load_be32(system_key + i * 4);
+	}
+	self->cbc_left = load_be32(init_cbc);
+	self->cbc_right = load_be32(init_cbc + 4);
+	self->round = round;
+}
+
+/**
+ * ECM から得た MULTI2_DATA_KEY_SIZE バイトのスクランブル鍵をワーク鍵に展開する。
+ */
+void
+multi2_schedule(const Multi2 *self, const guint8 *data_key, Multi2Key *key)
+{
+	const guint32 *s = self->system_key;
+	guint32 left = load_be32(data_key), right = load_be32(data_key + 4);
+
+	pi1(&left, &right);
+	pi2(&left, &right, s[0]);
+	key->work[0] = left;
+	pi3(&left, &right, s[1], s[2]);
+	key->work[1] = right;
+	pi4(&left, &right, s[3]);
+	key->work[2] = left;
+	pi1(&left, &right);
+	key->work[3] = right;
+	pi2(&left, &right, s[4]);
+	key->work[4] = left;
+	pi3(&left, &right, s[5], s[6]);
+	key->work[5] = right;
+	pi4(&left, &right, s[7]);
+	key->work[6] = left;
+	pi1(&left, &right);
+	key->work[7] = right;
+}
+
+/**
+ * 同じ鍵でスクランブルされた複数のパケットのペイロードをその場で復号する。
+ *
+ * 全てのペイロードの 8 バイトのブロックを MULTI2_LANES 個ずつまとめて復号する。
+ */
+void
+multi2_decrypt_payloads(const Multi2 *self, const Multi2Key *key, const Multi2Payload *payloads, guint n_payloads)
+{
+	guint32 left[MULTI2_LANES], right[MULTI2_LANES];
+	guint32 cbc_left[MULTI2_LANES], cbc_right[MULTI2_LANES];
+	guint8 *dst[MULTI2_LANES];
+	guint n_blocks = 0, i, j;
+
+	multi2_init_decrypt_blocks();
+
+	for (i = 0; i < n_payloads; ++i) {
+		guint32 prev_left = self->cbc_left, prev_right = self->cbc_right;
+		guint8 *p = payloads[i].data, *end = p + payloads[i].len;
+
+		for (; p + 8 <= end; p += 8) {
+			dst[n_blocks] = p;
+			cbc_left[n_blocks] = prev_left;
+			cbc_right[n_blocks] = prev_right;
+			left[n_blocks] = prev_left = load_be32(p);
+			right[n_blocks] = prev_right = load_be32(p + 4);
+
+			if (++n_blocks == MULTI2_LANES) {
+				st_decrypt_blocks(key->work, self->round, left, right);
+				for (j = 0; j < MULTI2_LANES; ++j) {
+					store_be32(dst[j], left[j] ^ cbc_left[j]);
+					store_be32(dst[j] + 4, right[j] ^ cbc_right[j]);
+				}
+				n_blocks = 0;
+			}
+		}
+
+		/* 残りは直前の暗号文を暗号化して XOR する */
+		if (p < end) {
+			guint8 stream[8];
+
+			multi2_encrypt_block(key->work, self->round, &prev_left, &prev_right);
+			store_be32(stream, prev_left);
+			store_be32(stream + 4, prev_right);
+			for (j = 0; p + j < end; ++j) {
+				p[j] ^= stream[j];
+			}
+		}
+	}
+
+	if (n_blocks > 0) {
+		st_decrypt_blocks(key->work, self->round, left, right);
+		for (j = 0; j < n_blocks; ++j) {
+			store_be32(dst[j], left[j] ^ cbc_left[j]);
+			store_be32(dst[j] + 4, right[j] ^ cbc_right[j]);
+		}
+	}
+}
+
+/**
+ * パケットのペイロードをその場で復号する。
+ */
+void
+multi2_decrypt(const Multi2 *self, const Multi2Key *key, guint8 *data, guint len)
+{
+	Multi2Payload payload;
+
+	payload.data = data;
+	payload.len = len;
+	multi2_decrypt_payloads(self, key, &payload, 1);
+}
+
+/**
+ * 展開したワーク鍵を覚えておくキャッシュを作る。
+ *
+ * ECM は奇数・偶数の二つの鍵を送り、鍵が変わっても片方は前の ECM と同じなので、
+ * 同じスクランブル鍵が何度も届く。展開済みの鍵を最近使った順に @a max_keys 個まで残す。
+ */
+Multi2KeyCache *
+multi2_key_cache_new(guint max_keys)
+{
+	Multi2KeyCache *self = g_new0(Multi2KeyCache, 1);
+
+	g_queue_init(&self->entries);
+	self->max_keys = MAX(max_keys, 1);
+
+	return self;
+}
+
+void
+multi2_key_cache_free(Multi2KeyCache *self)
+{
+	GList *link;
+
+	if (!self)
+		return;
+
+	/* リストの要素は鍵に埋め込んであるので、要素ごと外す */
+	while ((link = g_queue_pop_head_link(&self->entries))) {
+		g_slice_free(Multi2KeyCacheEntry, link->data);
+	}
+	g_free(self);
+}
+
+/**
+ * スクランブル鍵を展開したワーク鍵を返す。
+ *
+ * 返した鍵は multi2_key_cache_unref() で戻すまで書き換えられない。
+ * 使用中の鍵しか残っていなければ、@a max_keys を越えて加える。
+ */
+const Multi2Key *
+multi2_key_cache_get(Multi2KeyCache *self, const Multi2 *multi2, const guint8 *data_key)
+{
+	Multi2KeyCacheEntry *entry = NULL;
+	GList *link;
+
+	for (link = self->entries.head; link; link = link->next) {
+		Multi2KeyCacheEntry *cached = link->data;
+		if (memcmp(cached->data_key, data_key, MULTI2_DATA_KEY_SIZE) == 0 &&
+			memcmp(cached->system_key, multi2->system_key, sizeof(cached->system_key)) == 0) {
+			entry = cached;
+			break;
+		}
+	}
+
+	if (entry) {
+		++self->n_hits;
+		g_queue_unlink(&self->entries, &entry->link);
+	} else {
+		++self->n_misses;
+
+		/* 使われていない中で最も古い鍵を入れ替える */
+		if (self->entries.length >= self->max_keys) {
+			for (link = self->entries.tail; link; link = link->prev) {
+				Multi2KeyCacheEntry *cached = link->data;
+				if (cached->ref_count == 0) {
+					entry = cached;
+					g_queue_unlink(&self->entries, &entry->link);
+					break;
+				}
+			}
+		}
+		if (!entry) {
+			entry = g_slice_new0(Multi2KeyCacheEntry);
+			entry->link.data = entry;
+		}
+
+		multi2_schedule(multi2, data_key, &entry->key);
+		memcpy(entry->system_key, multi2->system_key, sizeof(entry->system_key));
+		memcpy(entry->data_key, data_key, MULTI2_DATA_KEY_SIZE);
+	}
+
+	g_queue_push_head_link(&self->entries, &entry->link);
+	++entry->ref_count;
+
+	return &entry->key;
+}
+
+void
+multi2_key_cache_unref(Multi2KeyCache *self, const Multi2Key *key)
+{
+	Multi2KeyCacheEntry *entry = (Multi2KeyCacheEntry *)key;
+
+	if (!key)
+		return;
+
+	g_return_if_fail(entry->ref_count > 0);
+	--entry->ref_count;
+}
+
+void
+multi2_key_cache_get_stats(Multi2KeyCache *self, guint64 *n_hits, guint64 *n_misses)
+{
+	if (n_hits) *n_hits = self->n_hits;
+	if (n_misses) *n_misses = self->n_misses;
+}
@@ -0,0 +1,60 @@
+#ifndef MULTI2_H_INCLUDED
+#define MULTI2_H_INCLUDED
+
+#define MULTI2_SYSTEM_KEY_SIZE 32
+#define MULTI2_DATA_KEY_SIZE 8
+#define MULTI2_CBC_SIZE 8
+#define MULTI2_DEFAULT_ROUND 4
+#define MULTI2_MAX_ROUND 32			/* 起動時に AVX2 とスカラーの一致を確かめる最大のラウンド数 */
+#define MULTI2_KEY_CACHE_SIZE 16
+
+/** システム鍵・初期 CBC・ラウンド数。ストリームごとに一つ */
+typedef struct Multi2 {
+	guint32 system_key[8];
+	guint32 cbc_left;
+	guint32 cbc_right;
+	gint round;
+} Multi2;
+
+/** スクランブル鍵 (Ks) から展開したワーク鍵 */
+typedef struct Multi2Key {
+	guint32 work[8];
+} Multi2Key;
+
+/** その場で復号するデータ */
+typedef struct Multi2Payload {
+	guint8 *data;
+	guint len;
+} Multi2Payload;
+
+struct Multi2KeyCache;
+typedef struct Multi2KeyCache Multi2KeyCache;
+
+void
+multi2_init(Multi2 *self, const guint8 *system_key, const guint8 *init_cbc, gint round);
+
+void
+multi2_schedule(const Multi2 *self, const guint8 *data_key, Multi2Key *key);
+
+void
+multi2_decrypt_payloads(const Multi2 *self, const Multi2Key *key, const Multi2Payload *payloads, guint n_payloads);
+
+void
+multi2_decrypt(const Multi2 *self, const Multi2Key *key, guint8 *data, guint len);
+
+Multi2KeyCache *
+multi2_key_cache_new(guint max_keys);
+
+void
+multi2_key_cache_free(Multi2KeyCache *self);
+
+const Multi2Key *
+multi2_key_cache_get(Multi2KeyCache *self, const Multi2 *multi2, const guint8 *data_key);
+
+void
+multi2_key_cache_unref(Multi2KeyCache *self, const Multi2Key *key);
+
+void
+multi2_key_cache_get_stats(Multi2KeyCache *self, guint64 *n_hits, guint64 *n_misses);
+
+#endif	/* MULTI2_H_INCLUDED */
@@ -0,0 +1,876 @@
+#include <string.h>
+#include <glib.h>
+
+#include "portable.h"
+#include "arib_std_b25.h"
+#include "b_cas_card.h"
+#include "multi2.h"
+#include "psi.h"
+#include "parallel_b25.h"
+#include "ts_simd.h"
+
+/*
+ * MULTI2 の復号を複数のスレッドで行う ARIB_STD_B25。
+ *
+ * PSI の解析・ECM の処理・パケットごとの鍵の選択は put() を呼んだスレッドで順に行い、
+ * 復号だけをスレッドプールに分けて並列に行う。復号はパケットの位置を変えずにその場で行うので、
+ * 全ての分担が終わるのを待てば、出力の順序は入力のまま保たれる。
+ * 復号待ちのパケットが使っている鍵は書き換えないよう、ECM が新しい鍵を返す前に復号を済ませる。
+ *
+ * スクランブルされておらず PSI・ECM でもないパケットは、8 個ずつヘッダをまとめて調べて
+ * 数えるだけで出力に回し、proc_packet() を通さない。
+ */
+
+#define TS_PACKET_SIZE 188
+#define TS_SYNC_BYTE 0x47
+#define ECM_TABLE_ID 0x82
+#define ECM_HEADER_SIZE 8			/* ECM のセクションヘッダ */
+#define ECM_CRC_SIZE 4
+#define MIN_JOBS_PER_SHARD 16		/* これより少なければスレッドに分けない */
+#define CLASSIFY_BLOCK 8			/* 一度にヘッダを調べるパケット数 */
+
+enum { KEY_ODD = 0, KEY_EVEN = 1 };
+
+struct Context;
+
+/** ECM の PID 一つ分の鍵 */
+typedef struct {
+	struct Context *context;
+	guint16 pid;
+	PsiSection section;
+	guint8 last_ecm[PSI_MAX_SECTION_SIZE];	/* 最後に B-CAS カードに渡した ECM */
+	guint last_ecm_len;
+
+	const Multi2Key *keys[2];	/* キャッシュから借りた鍵 (NULL:なし) */
+
+	gint32 ecm_unpurchased_count;
+	gint32 last_ecm_error_code;
+} ParallelEcm;
+
+typedef struct {
+	guint16 program_number;
+	gint ecm;					/* 番組の ECM の位置 (-1:なし) */
+	gint64 total_packet_count;
+	gint64 undecrypted_packet_count;
+} ParallelProgram;
+
+typedef struct {
+	guint begin, end;
+} ParallelShard;
+
+typedef struct Context {
+	B_CAS_CARD *bcas;
+	Multi2 multi2;
+	gboolean is_multi2_valid;
+	Multi2KeyCache *key_cache;	/* 全ての ECM で共有する展開済みの鍵 */
+	gboolean is_strip;
+
+	PsiTables *psi;
+	GPtrArray *ecms;
+	ParallelProgram programs[PSI_MAX_PROGRAMS];
+	guint n_programs;
+	gint16 ecm_of_pid[0x2000];		/* スクランブルされた PID の ECM の位置 (-1:なし) */
+	gint16 ecm_of_ecm_pid[0x2000];	/* ECM の PID の位置 (-1:ECM ではない) */
+	gint16 program_of_pid[0x2000];	/* PID が属する番組の位置 (-1:なし) */
+	guint32 slow_pids[0x2000 / 32];	/* 必ず proc_packet() を通す PID (PAT・PMT・ECM、strip なら NULL) */
+
+	/* [0, n_done) が復号済み、その後ろがパケットに満たない残り。get() で渡した n_got は次に捨てる */
+	GByteArray *buffer;
+	guint n_done;
+	guint n_got;
+	GArray *kept;				/* 出力するパケットの位置 */
+
+	/* 復号するパケットのペイロードとその鍵 */
+	Multi2Payload *payloads;
+	const Multi2Key **keys;
+	guint n_jobs;
+	guint max_jobs;
+
+	guint n_threads;
+	GThreadPool *pool;
+	ParallelShard *shards;
+	GMutex *mutex;
+	GCond *cond;
+	guint n_pending;			/* 終わっていない分担の数 */
+} Context;
+
+typedef guint (*ClassifyFunc)(const guint32 *slow_pids, const guint8 *packets, guint32 *pids);
+
+static ClassifyFunc st_classify = NULL;
+static gsize st_is_classify_initialized = 0;
+
+
+/* Jobs
+   -------------------------------------------------------------------------- */
+
+/**
+ * 同じ鍵が続くパケットをまとめて復号する。
+ */
+static void
+descramble_jobs(Context *self, guint begin, guint end)
+{
+	guint i, j;
+
+	for (i = begin; i < end; i = j) {
+		for (j = i + 1; j < end && self->keys[j] == self->keys[i]; ++j)
+			;
+		multi2_decrypt_payloads(&self->multi2, self->keys[i], self->payloads + i, j - i);
+	}
+}
+
+static void
+worker_func(gpointer data, gpointer user_data)
+{
+	ParallelShard *shard = data;
+	Context *self = user_data;
+
+	descramble_jobs(self, shard->begin, shard->end);
+
+	g_mutex_lock(self->mutex);
+	if (--self->n_pending == 0) {
+		g_cond_signal(self->cond);
+	}
+	g_mutex_unlock(self->mutex);
+}
+
+/**
+ * 溜めたパケットを分担して復号し、全て終わるまで待つ。最初の分担は呼び出したスレッドで行う。
+ */
+static void
+run_jobs(Context *self)
+{
+	guint n_shards = 1, per_shard, i;
+
+	if (self->n_jobs == 0)
+		return;
+
+	if (self->pool) {
+		n_shards = MIN(self->n_threads, (self->n_jobs + MIN_JOBS_PER_SHARD - 1) / MIN_JOBS_PER_SHARD);
+	}
+	per_shard = (self->n_jobs + n_shards - 1) / n_shards;
+
+	self->n_pending = n_shards - 1;
+	for (i = 1; i < n_shards; ++i) {
+		self->shards[i].begin = per_shard * i;
+		self->shards[i].end = MIN(per_shard * (i + 1), self->n_jobs);
+		g_thread_pool_push(self->pool, &self->shards[i], NULL);
+	}
+
+	descramble_jobs(self, 0, MIN(per_shard, self->n_jobs));
+
+	if (n_shards > 1) {
+		g_mutex_lock(self->mutex);
+		while (self->n_pending > 0) {
+			g_cond_wait(self->cond, self->mutex);
+		}
+		g_mutex_unlock(self->mutex);
+	}
+
+	self->n_jobs = 0;
+}
+
+static void
+add_job(Context *self, guint8 *payload, guint len, const Multi2Key *key)
+{
+	if (self->n_jobs == self->max_jobs) {
+		self->max_jobs = self->max_jobs ? self->max_jobs * 2 : 1024;
+		self->payloads = g_renew(Multi2Payload, self->payloads, self->max_jobs);
+		self->keys = g_renew(const Multi2Key *, self->keys, self->max_jobs);
+	}
+
+	self->payloads[self->n_jobs].data = payload;
+	self->payloads[self->n_jobs].len = len;
+	self->keys[self->n_jobs] = key;
+	++self->n_jobs;
+}
+
+
+/* ECM
+   -------------------------------------------------------------------------- */
+
+/**
+ * ECM の鍵を入れ替える。
+ *
+ * @param scramble_key	奇数・偶数の順の鍵 (NULL なら鍵をなくす)
+ */
+static void
+set_ecm_keys(Context *self, ParallelEcm *ecm, const guint8 *scramble_key)
+{
+	const Multi2Key *odd = NULL, *even = NULL;
+
+	if (scramble_key) {
+		odd = multi2_key_cache_get(self->key_cache, &self->multi2, scramble_key);
+		even = multi2_key_cache_get(self->key_cache, &self->multi2, scramble_key + MULTI2_DATA_KEY_SIZE);
+	}
+	multi2_key_cache_unref(self->key_cache, ecm->keys[KEY_ODD]);
+	multi2_key_cache_unref(self->key_cache, ecm->keys[KEY_EVEN]);
+	ecm->keys[KEY_ODD] = odd;
+	ecm->keys[KEY_EVEN] = even;
+}
+
+static void
+ecm_section_cb(const guint8 *section, guint len, gpointer user_data)
+{
+	ParallelEcm *ecm = user_data;
+	Context *self = ecm->context;
+	B_CAS_ECM_RESULT result;
+	gint r;
+
+	if (section[0] != ECM_TABLE_ID || len < ECM_HEADER_SIZE + ECM_CRC_SIZE)
+		return;
+
+	/* 同じ ECM が繰り返し送られてくるので、変わった時だけ B-CAS カードに渡す */
+	if (len == ecm->last_ecm_len && memcmp(section, ecm->last_ecm, len) == 0)
+		return;
+	memcpy(ecm->last_ecm, section, len);
+	ecm->last_ecm_len = len;
+
+	/* 今の鍵で復号するパケットを先に片付ける */
+	run_jobs(self);
+
+	r = self->bcas->proc_ecm(self->bcas, &result, (uint8_t *)section + ECM_HEADER_SIZE,
+							 len - ECM_HEADER_SIZE - ECM_CRC_SIZE);
+	if (r < 0) {
+		g_warning("[parallel_b25] ECM failed on PID 0x%04x (%d)", ecm->pid, r);
+		++ecm->ecm_unpurchased_count;
+		ecm->last_ecm_error_code = r;
+		set_ecm_keys(self, ecm, NULL);
+		return;
+	}
+	if (result.return_code != 0x0800 && result.return_code != 0x0400 && result.return_code != 0x0200) {
+		++ecm->ecm_unpurchased_count;
+		ecm->last_ecm_error_code = result.return_code;
+		set_ecm_keys(self, ecm, NULL);
+		return;
+	}
+
+	set_ecm_keys(self, ecm, result.scramble_key);
+}
+
+/**
+ * ECM の PID の位置を返す。初めての PID なら加える。
+ */
+static gint
+get_ecm(Context *self, guint pid)
+{
+	ParallelEcm *ecm;
+	guint i;
+
+	for (i = 0; i < self->ecms->len; ++i) {
+		ecm = g_ptr_array_index(self->ecms, i);
+		if (ecm->pid == pid)
+			return i;
+	}
+
+	ecm = g_new0(ParallelEcm, 1);
+	ecm->context = self;
+	ecm->pid = pid;
+	psi_section_reset(&ecm->section);
+	g_ptr_array_add(self->ecms, ecm);
+
+	return self->ecms->len - 1;
+}
+
+static void
+free_ecms(Context *self)
+{
+	guint i;
+
+	for (i = 0; i < self->ecms->len; ++i) {
+		ParallelEcm *ecm = g_ptr_array_index(self->ecms, i);
+		set_ecm_keys(self, ecm, NULL);
+		g_free(ecm);
+	}
+	g_ptr_array_set_size(self->ecms, 0);
+}
+
+static inline void
+set_slow_pid(Context *self, guint pid)
+{
+	self->slow_pids[pid >> 5] |= 1U << (pid & 31);
+}
+
+/**
+ * proc_packet() を通す PID を作り直す。PMT を受け取っていない番組の PMT の PID も含める。
+ */
+static void
+rebuild_slow_pids(Context *self)
+{
+	const PsiProgram *program;
+	guint i;
+
+	memset(self->slow_pids, 0, sizeof(self->slow_pids));
+	set_slow_pid(self, PSI_PAT_PID);
+	for (i = 0; (program = psi_tables_get_nth_program(self->psi, i)); ++i) {
+		set_slow_pid(self, program->pmt_pid);
+	}
+	for (i = 0; i < self->ecms->len; ++i) {
+		ParallelEcm *ecm = g_ptr_array_index(self->ecms, i);
+		set_slow_pid(self, ecm->pid);
+	}
+	if (self->is_strip) {
+		set_slow_pid(self, PSI_NULL_PID);
+	}
+}
+
+/**
+ * PAT・PMT が更新されたら、PID と番組・ECM の対応を作り直す。
+ *
+ * ECM の鍵と番組ごとの数え値は引き継ぐ。
+ */
+static void
+psi_tables_cb(PsiTables *tables, guint table_id, guint id, gpointer user_data)
+{
+	Context *self = user_data;
+	ParallelProgram *old_programs;
+	guint n_old_programs, i, j, k;
+	const PsiProgram *program;
+
+	if (table_id != PSI_PAT_TABLE_ID && table_id != PSI_PMT_TABLE_ID)
+		return;
+
+	old_programs = g_memdup(self->programs, sizeof(ParallelProgram) * self->n_programs);
+	n_old_programs = self->n_programs;
+
+	memset(self->ecm_of_pid, 0xFF, sizeof(self->ecm_of_pid));
+	memset(self->ecm_of_ecm_pid, 0xFF, sizeof(self->ecm_of_ecm_pid));
+	memset(self->program_of_pid, 0xFF, sizeof(self->program_of_pid));
+	self->n_programs = 0;
+
+	for (i = 0; (program = psi_tables_get_nth_program(tables, i)); ++i) {
+		ParallelProgram *counted = &self->programs[self->n_programs];
+		gint program_ecm = -1;
+
+		if (program->version == PSI_UNKNOWN)
+			continue;
+
+		memset(counted, 0, sizeof(*counted));
+		counted->program_number = program->program_number;
+		for (j = 0; j < n_old_programs; ++j) {
+			if (old_programs[j].program_number == program->program_number) {
+				*counted = old_programs[j];
+				break;
+			}
+		}
+
+		if (program->ecm_pid != PSI_NULL_PID) {
+			program_ecm = get_ecm(self, program->ecm_pid);
+			self->ecm_of_ecm_pid[program->ecm_pid] = program_ecm;
+		}
+		counted->ecm = program_ecm;
+
+		if (self->program_of_pid[program->pmt_pid] < 0) {
+			self->program_of_pid[program->pmt_pid] = self->n_programs;
+		}
+		for (k = 0; k < program->n_streams; ++k) {
+			const PsiStream *stream = &program->streams[k];
+			gint ecm = program_ecm;
+
+			if (stream->ecm_pid != PSI_NULL_PID) {
+				ecm = get_ecm(self, stream->ecm_pid);
+				self->ecm_of_ecm_pid[stream->ecm_pid] = ecm;
+				if (counted->ecm < 0) {
+					counted->ecm = ecm;
+				}
+			}
+			if (ecm >= 0 && self->ecm_of_pid[stream->pid] < 0) {
+				self->ecm_of_pid[stream->pid] = ecm;
+			}
+			if (self->program_of_pid[stream->pid] < 0) {
+				self->program_of_pid[stream->pid] = self->n_programs;
+			}
+		}
+		++self->n_programs;
+	}
+
+	g_free(old_programs);
+	rebuild_slow_pids(self);
+}
+
+
+/* Packets
+   -------------------------------------------------------------------------- */
+
+/**
+ * CLASSIFY_BLOCK 個のパケットの PID を取り出し、proc_packet() を通すパケットのビットを返す。
+ *
+ * スクランブルされたもの、transport_error_indicator の立ったもの、同期バイトのないもの、
+ * @a slow_pids の PID のものを通す。
+ */
+static guint
+classify_scalar(const guint32 *slow_pids, const guint8 *packets, guint32 *pids)
+{
+	guint i, mask = 0;
+
+	for (i = 0; i < CLASSIFY_BLOCK; ++i) {
+		const guint8 *packet = packets + i * TS_PACKET_SIZE;
+
+		pids[i] = ((packet[1] & 0x1F) << 8) | packet[2];
+		if (packet[0] != TS_SYNC_BYTE || (packet[1] & 0x80) || (packet[3] & 0x80) ||
+			((slow_pids[pids[i] >> 5] >> (pids[i] & 31)) & 1)) {
+			mask |= 1 << i;
+		}
+	}
+	return mask;
+}
+
+#ifdef TS_SIMD_HAVE_X86
+/**
+ * classify_scalar() の AVX2 版。8 パケットのヘッダをまとめて読んで調べる。
+ */
+__attribute__((target("avx2")))
+static guint
+classify_avx2(const guint32 *slow_pids, const guint8 *packets, guint32 *pids)
+{
+	__m256i header, pid, is_clear;
+
+	header = ts_simd_gather_headers(packets, &pid);
+	_mm256_storeu_si256((__m256i *)pids, pid);
+
+	/* 同期バイトがあり、transport_error_indicator とスクランブル制御の上位ビットが 0 */
+	is_clear = _mm256_and_si256(
+		_mm256_cmpeq_epi32(_mm256_and_si256(header, _mm256_set1_epi32(0xFF)), _mm256_set1_epi32(TS_SYNC_BYTE)),
+		_mm256_cmpeq_epi32(_mm256_and_si256(header, _mm256_set1_epi32((gint)0x80008000)), _mm256_setzero_si256()));
+
+	return ts_simd_movemask(_mm256_or_si256(ts_simd_test_bitmap(slow_pids, pid),
+											_mm256_andnot_si256(is_clear, _mm256_set1_epi32(-1))));
+}
+#endif
+
+static void
+init_classify(void)
+{
+	if (g_once_init_enter(&st_is_classify_initialized)) {
+		st_classify = classify_scalar;
+#ifdef TS_SIMD_HAVE_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			st_classify = classify_avx2;
+		}
+#endif
+		g_once_init_leave(&st_is_classify_initialized, 1);
+	}
+}
+
+/**
+ * @a pos から続く、proc_packet() を通さなくてよいパケットを数えて出力に加える。
+ *
+ * PSI・ECM のパケットを処理すると @a slow_pids が変わるので、通すパケットの手前で止める。
+ *
+ * @return 次に proc_packet() を通す位置
+ */
+static guint
+skip_clear_packets(Context *self, const guint8 *data, guint pos, guint len)
+{
+	guint32 pids[CLASSIFY_BLOCK];
+	guint slow, n, i;
+
+	while (pos + CLASSIFY_BLOCK * TS_PACKET_SIZE <= len) {
+		slow = st_classify(self->slow_pids, data + pos, pids);
+		n = slow ? (guint)g_bit_nth_lsf(slow, -1) : CLASSIFY_BLOCK;
+
+		for (i = 0; i < n; ++i) {
+			gint index = self->program_of_pid[pids[i]];
+			if (index >= 0) {
+				++self->programs[index].total_packet_count;
+			}
+			g_array_append_val(self->kept, pos);
+			pos += TS_PACKET_SIZE;
+		}
+		if (n < CLASSIFY_BLOCK)
+			break;
+	}
+	return pos;
+}
+
+/**
+ * パケットを一つ調べ、スクランブルされていれば復号を予約する。
+ *
+ * @return 出力するなら TRUE
+ */
+static gboolean
+proc_packet(Context *self, guint8 *packet)
+{
+	guint pid = ((packet[1] & 0x1F) << 8) | packet[2];
+	guint scrambling = packet[3] >> 6;
+	gint index;
+
+	if (packet[1] & 0x80)
+		return TRUE;
+
+	psi_tables_push(self->psi, packet, 1);
+
+	index = self->ecm_of_ecm_pid[pid];
+	if (index >= 0) {
+		ParallelEcm *ecm = g_ptr_array_index(self->ecms, index);
+		psi_section_push(&ecm->section, packet, ecm_section_cb, ecm);
+	}
+
+	index = self->program_of_pid[pid];
+	if (index >= 0) {
+		++self->programs[index].total_packet_count;
+	}
+
+	if (scrambling & 0x02) {
+		const Multi2Key *key = NULL;
+
+		if (self->ecm_of_pid[pid] >= 0) {
+			ParallelEcm *ecm = g_ptr_array_index(self->ecms, self->ecm_of_pid[pid]);
+			key = ecm->keys[scrambling == 0x03 ? KEY_ODD : KEY_EVEN];
+		}
+		if (key && self->is_multi2_valid) {
+			guint adaptation = (packet[3] >> 4) & 0x03;
+			guint offset = 4;
+
+			if (adaptation & 0x02) {
+				offset += 1 + packet[4];
+			}
+			if ((adaptation & 0x01) && offset < TS_PACKET_SIZE) {
+				add_job(self, packet + offset, TS_PACKET_SIZE - offset, key);
+			}
+			packet[3] &= 0x3F;
+		} else if (index >= 0) {
+			++self->programs[index].undecrypted_packet_count;
+		}
+	}
+
+	return !(self->is_strip && pid == PSI_NULL_PID);
+}
+
+/**
+ * get() で渡したデータを捨てる。
+ */
+static void
+drop_got(Context *self)
+{
+	if (self->n_got == 0)
+		return;
+
+	g_byte_array_remove_range(self->buffer, 0, self->n_got);
+	self->n_done -= self->n_got;
+	self->n_got = 0;
+}
+
+/**
+ * 溜まったパケットを復号し、出力するパケットを n_done の後ろに詰める。
+ */
+static void
+proc_buffer(Context *self)
+{
+	guint8 *data = self->buffer->data;
+	guint len = self->buffer->len, pos = self->n_done, dst = self->n_done, i;
+
+	g_array_set_size(self->kept, 0);
+	while (pos + TS_PACKET_SIZE <= len) {
+		pos = skip_clear_packets(self, data, pos, len);
+		if (pos + TS_PACKET_SIZE > len)
+			break;
+		if (data[pos] != TS_SYNC_BYTE) {
+			++pos;
+			continue;
+		}
+		if (proc_packet(self, data + pos)) {
+			g_array_append_val(self->kept, pos);
+		}
+		pos += TS_PACKET_SIZE;
+	}
+
+	run_jobs(self);
+
+	for (i = 0; i < self->kept->len; ++i) {
+		guint src = g_array_index(self->kept, guint, i);
+		if (src != dst) {
+			memmove(data + dst, data + src, TS_PACKET_SIZE);
+		}
+		dst += TS_PACKET_SIZE;
+	}
+	if (pos < len && pos != dst) {
+		memmove(data + dst, data + pos, len - pos);
+	}
+	g_byte_array_set_size(self->buffer, dst + (len - pos));
+	self->n_done = dst;
+}
+
+
+/*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+ interface method implementation
+ ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+static void
+release_b25(void *std_b25)
+{
+	Context *self = (Context *)((ARIB_STD_B25 *)std_b25)->private_data;
+	guint64 n_hits, n_misses;
+
+	if (self->pool) g_thread_pool_free(self->pool, FALSE, TRUE);
+	g_mutex_free(self->mutex);
+	g_cond_free(self->cond);
+	g_free(self->shards);
+	g_free(self->payloads);
+	g_free(self->keys);
+	g_array_free(self->kept, TRUE);
+	g_byte_array_free(self->buffer, TRUE);
+	multi2_key_cache_get_stats(self->key_cache, &n_hits, &n_misses);
+	g_debug("[parallel_b25] key cache hits=%"G_GUINT64_FORMAT" misses=%"G_GUINT64_FORMAT, n_hits, n_misses);
+
+	free_ecms(self);
+	g_ptr_array_free(self->ecms, TRUE);
+	multi2_key_cache_free(self->key_cache);
+	psi_tables_free(self->psi);
+	g_free(self);
+
+	g_free(std_b25);
+}
+
+static int
+set_multi2_round_b25(void *std_b25, int32_t round)
+{
+	Context *self = (Context *)((ARIB_STD_B25 *)std_b25)->private_data;
+
+	/* AVX2 の復号は MULTI2_MAX_ROUND までしか確かめていない */
+	if (round < 1 || round > MULTI2_MAX_ROUND) {
+		g_warning("[parallel_b25] MULTI2 round %d is out of range (1..%d)", round, MULTI2_MAX_ROUND);
+		return -1;
+	}
+	self->multi2.round = round;
+	return 0;
+}
+
+static int
+set_strip_b25(void *std_b25, int32_t strip)
+{
+	Context *self = (Context *)((ARIB_STD_B25 *)std_b25)->private_data;
+
+	self->is_strip = strip != 0;
+	rebuild_slow_pids(self);
+	return 0;
+}
+
+static int
+set_emm_proc_b25(void *std_b25, int32_t on)
+{
+	/* EMM は処理しない */
+	return 0;
+}
+
+static int
+set_b_cas_card_b25(void *std_b25, B_CAS_CARD *bcas)
+{
+	Context *self = (Context *)((ARIB_STD_B25 *)std_b25)->private_data;
+	B_CAS_INIT_STATUS status;
+
+	self->bcas = bcas;
+	self->is_multi2_valid = FALSE;
+	if (!bcas)
+		return 0;
+
+	if (bcas->get_init_status(bcas, &status) < 0) {
+		g_warning("[parallel_b25] couldn't get B-CAS initial status");
+		return -1;
+	}
+	multi2_init(&self->multi2, status.system_key, status.init_cbc, self->multi2.round);
+	self->is_multi2_valid = TRUE;
+
+	return 0;
+}
+
+static int
+reset_b25(void *std_b25)
+{
+	Context *self = (Context *)((ARIB_STD_B25 *)std_b25)->private_data;
+
+	psi_tables_reset(self->psi);
+	free_ecms(self);
+	memset(self->ecm_of_pid, 0xFF, sizeof(self->ecm_of_pid));
+	memset(self->ecm_of_ecm_pid, 0xFF, sizeof(self->ecm_of_ecm_pid));
+	memset(self->program_of_pid, 0xFF, sizeof(self->program_of_pid));
+	self->n_programs = 0;
+	rebuild_slow_pids(self);
+	g_byte_array_set_size(self->buffer, 0);
+	self->n_done = self->n_got = 0;
+
+	return 0;
+}
+
+static int
+flush_b25(void *std_b25)
+{
+	Context *self = (Context *)((ARIB_STD_B25 *)std_b25)->private_data;
+
+	/* パケットに満たない残りは捨てる */
+	drop_got(self);
+	g_byte_array_set_size(self->buffer, self->n_done);
+
+	return 0;
+}
+
+static int
+put_b25(void *std_b25, ARIB_STD_B25_BUFFER *buf)
+{
+	Context *self = (Context *)((ARIB_STD_B25 *)std_b25)->private_data;
+
+	if (!buf || buf->size < 0)
+		return -1;
+
+	drop_got(self);
+	g_byte_array_append(self->buffer, buf->data, buf->size);
+	proc_buffer(self);
+
+	return 0;
+}
+
+static int
+get_b25(void *std_b25, ARIB_STD_B25_BUFFER *buf)
+{
+	Context *self = (Context *)((ARIB_STD_B25 *)std_b25)->private_data;
+
+	if (!buf)
+		return -1;
+
+	drop_got(self);
+	buf->data = self->buffer->data;
+	buf->size = self->n_done;
+	self->n_got = self->n_done;
+
+	return 0;
+}
+
+static int
+get_program_count_b25(void *std_b25)
+{
+	Context *self = (Context *)((ARIB_STD_B25 *)std_b25)->private_data;
+
+	return self->n_programs;
+}
+
+static int
+get_program_info_b25(void *std_b25, ARIB_STD_B25_PROGRAM_INFO *info, int32_t idx)
+{
+	Context *self = (Context *)((ARIB_STD_B25 *)std_b25)->private_data;
+	ParallelProgram *program;
+
+	if (!info || idx < 0 || (guint)idx >= self->n_programs)
+		return -1;
+
+	program = &self->programs[idx];
+	memset(info, 0, sizeof(*info));
+	info->program_number = program->program_number;
+	if (program->ecm >= 0) {
+		ParallelEcm *ecm = g_ptr_array_index(self->ecms, program->ecm);
+		info->ecm_unpurchased_count = ecm->ecm_unpurchased_count;
+		info->last_ecm_error_code = ecm->last_ecm_error_code;
+	}
+	info->total_packet_count = program->total_packet_count;
+	info->undecrypted_packet_count = program->undecrypted_packet_count;
+
+	return 0;
+}
+
+/*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+ extended method implementation
+ ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+/**
+ * 呼び出し元のバッファのパケットをその場で復号し、出力する範囲を返す。
+ *
+ * put()/get() と違い内部のバッファにコピーしないので、返した範囲をそのまま書き出せる。
+ * 捨てるパケット (--b25-strip の NULL パケットと、同期バイトのないパケット) は範囲に含めない。
+ * 一つのストリームに put() と混ぜて使ってはならない。
+ *
+ * @param ranges	PARALLEL_B25_MAX_RANGES(@a n_packets) 個の範囲を書ける配列
+ * @return 範囲の数 (負ならエラー)
+ */
+static gint
+descramble(void *std_b25, guint8 *packets, guint n_packets, ParallelB25Range *ranges)
+{
+	Context *self = (Context *)((ARIB_STD_B25 *)std_b25)->private_data;
+	guint n_ranges = 0, len = n_packets * TS_PACKET_SIZE, pos, i;
+
+	if (!packets || !ranges)
+		return -1;
+
+	/* 呼び出し元がパケット境界に揃えているので、同期は取り直さない */
+	g_array_set_size(self->kept, 0);
+	for (pos = 0; pos < len; pos += TS_PACKET_SIZE) {
+		pos = skip_clear_packets(self, packets, pos, len);
+		if (pos >= len)
+			break;
+		if (packets[pos] == TS_SYNC_BYTE && proc_packet(self, packets + pos)) {
+			g_array_append_val(self->kept, pos);
+		}
+	}
+
+	run_jobs(self);
+
+	/* 続いているパケットは一つの範囲にまとめる */
+	for (i = 0; i < self->kept->len; ++i) {
+		guint8 *packet = packets + g_array_index(self->kept, guint, i);
+
+		if (n_ranges > 0 && ranges[n_ranges - 1].data + ranges[n_ranges - 1].size == packet) {
+			ranges[n_ranges - 1].size += TS_PACKET_SIZE;
+		} else {
+			ranges[n_ranges].data = packet;
+			ranges[n_ranges].size = TS_PACKET_SIZE;
+			++n_ranges;
+		}
+	}
+
+	return n_ranges;
+}
+
+/*+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+ global function implementation
+ ++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++*/
+/**
+ * @param n_threads	復号に使うスレッド数 (put() を呼んだスレッドを含む)
+ */
+PARALLEL_ARIB_STD_B25 *
+parallel_b25_new(guint n_threads)
+{
+	PARALLEL_ARIB_STD_B25 *r;
+	Context *self;
+	GError *error = NULL;
+
+	self = g_new0(Context, 1);
+	self->multi2.round = MULTI2_DEFAULT_ROUND;
+	self->psi = psi_tables_new(psi_tables_cb, self);
+	self->ecms = g_ptr_array_new();
+	self->key_cache = multi2_key_cache_new(MULTI2_KEY_CACHE_SIZE);
+	memset(self->ecm_of_pid, 0xFF, sizeof(self->ecm_of_pid));
+	memset(self->ecm_of_ecm_pid, 0xFF, sizeof(self->ecm_of_ecm_pid));
+	memset(self->program_of_pid, 0xFF, sizeof(self->program_of_pid));
+	self->buffer = g_byte_array_new();
+	self->kept = g_array_new(FALSE, FALSE, sizeof(guint));
+	rebuild_slow_pids(self);
+	init_classify();
+
+	self->n_threads = MAX(n_threads, 1);
+	self->shards = g_new0(ParallelShard, self->n_threads);
+	self->mutex = g_mutex_new();
+	self->cond = g_cond_new();
+	if (self->n_threads > 1) {
+		self->pool = g_thread_pool_new(worker_func, self, self->n_threads - 1, TRUE, &error);
+		if (error) {
+			g_warning("[parallel_b25] %s", error->message);
+			g_clear_error(&error);
+			self->pool = NULL;
+			self->n_threads = 1;
+		}
+	}
+
+	r = g_new0(PARALLEL_ARIB_STD_B25, 1);
+	r->super.private_data = self;
+	r->super.release = release_b25;
+	r->super.set_multi2_round = set_multi2_round_b25;
+	r->super.set_strip = set_strip_b25;
+	r->super.set_emm_proc = set_emm_proc_b25;
+	r->super.set_b_cas_card = set_b_cas_card_b25;
+	r->super.reset = reset_b25;
+	r->super.flush = flush_b25;
+	r->super.put = put_b25;
+	r->super.get = get_b25;
+	r->super.get_program_count = get_program_count_b25;
+	r->super.get_program_info = get_program_info_b25;
+
+	r->descramble = descramble;
+
+	return r;
+}
@@ -0,0 +1,35 @@
+#ifndef PARALLEL_B25_H
+#define PARALLEL_B25_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** descramble() が返す、出力するバイトの範囲 */
+typedef struct ParallelB25Range {
+	guint8 *data;
+	guint size;
+} ParallelB25Range;
+
+/* 範囲の間には捨てるパケットが一つ以上あるので、範囲の数はパケット数の半分を越えない */
+#define PARALLEL_B25_MAX_RANGES(n_packets) (((n_packets) + 1) / 2)
+
+/*
+ * PARALLEL_ARIB_STD_B25 *b25 = parallel_b25_new(n_threads);
+ * ((ARIB_STD_B25 *)b25)->set_b_cas_card(b25, bcas);
+ * n_ranges = b25->descramble(b25, packets, n_packets, ranges);
+ */
+typedef struct PARALLEL_ARIB_STD_B25 {
+	ARIB_STD_B25 super;
+
+	gint (*descramble)(void *std_b25, guint8 *packets, guint n_packets, ParallelB25Range *ranges);
+} PARALLEL_ARIB_STD_B25;
+
+PARALLEL_ARIB_STD_B25 *
+parallel_b25_new(guint n_threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PARALLEL_B25_H */
@@ -0,0 +1,268 @@
+#include <string.h>
+#include <glib.h>
+
+#include "psi.h"
+#include "pcr_tracker.h"
+
+/*
+ * PCR からプログラムごとのビットレートを求め、ホストに届いた時刻と比べる。
+ *
+ * PCR が示す送出時刻と到着時刻の差 (offset) は、転送やバッファで遅れた分だけ大きくなる。
+ * 窓の中で最も小さい offset を遅れのない基準とし、そこからの差を遅れとみなす。
+ */
+
+#define TS_PACKET_SIZE 188
+#define PCR_HZ 27000000.0
+#define PCR_WRAP ((G_GINT64_CONSTANT(1) << 33) * 300)
+#define PCR_MAX_GAP (PCR_HZ * 1)		/* これ以上 PCR が飛んだら不連続とみなす */
+#define JITTER_WINDOW 10.0				/* 基準の offset を取り直す間隔 (秒) */
+#define BITRATE_WEIGHT 0.125			/* ビットレートと遅れの移動平均の重み */
+
+typedef struct {
+	guint16 program_number;
+	guint16 pcr_pid;
+
+	guint64 n_bytes;			/* プログラムの PID のバイト数 */
+	gint64 last_pcr;			/* 最後の PCR (-1:未受信) */
+	guint64 last_bytes;			/* 最後の PCR の時点の n_bytes */
+	guint64 last_ts_bytes;		/* 最後の PCR の時点の TS 全体のバイト数 */
+	gdouble pcr_time;			/* 最初の PCR からの時間 (秒) */
+
+	gdouble bitrate;
+	gdouble ts_bitrate;
+
+	/* offset の窓ごとの最小・最大。基準は今の窓と前の窓の小さい方 */
+	gdouble window_start;
+	gdouble min_offset, prev_min_offset;
+	gdouble max_offset, prev_max_offset;
+	gdouble base_offset;		/* 最初の PCR の時点の到着時刻 (秒) */
+	gdouble delay;
+	guint n_discontinuities;
+} PcrTrackerProgram;
+
+struct PcrTracker {
+	PcrTrackerProgram programs[PSI_MAX_PROGRAMS];
+	guint n_programs;
+	gint16 program_of_pid[0x2000];	/* PID が属するプログラムの位置 (-1:なし) */
+	gint16 pcr_of_pid[0x2000];		/* PID を PCR_PID とする最初のプログラムの位置 (-1:なし) */
+	guint64 n_ts_bytes;
+};
+
+
+static void
+pcr_tracker_restart(PcrTrackerProgram *program)
+{
+	program->last_pcr = -1;
+	program->pcr_time = 0;
+	program->window_start = 0;
+	program->min_offset = program->prev_min_offset = G_MAXDOUBLE;
+	program->max_offset = program->prev_max_offset = -G_MAXDOUBLE;
+}
+
+static void
+pcr_tracker_proc_pcr(PcrTracker *self, PcrTrackerProgram *program, gint64 pcr, gboolean is_discontinuity,
+					 gdouble arrival)
+{
+	gdouble offset, base;
+
+	if (program->last_pcr >= 0 && !is_discontinuity) {
+		gint64 delta = (pcr - program->last_pcr + PCR_WRAP) % PCR_WRAP;
+
+		if (delta == 0)
+			return;
+		if (delta > PCR_MAX_GAP) {
+			is_discontinuity = TRUE;
+		} else {
+			gdouble seconds = delta / PCR_HZ;
+			gdouble bitrate = (program->n_bytes - program->last_bytes) * 8 / seconds;
+			gdouble ts_bitrate = (self->n_ts_bytes - program->last_ts_bytes) * 8 / seconds;
+
+			if (program->bitrate > 0) {
+				program->bitrate += (bitrate - program->bitrate) * BITRATE_WEIGHT;
+				program->ts_bitrate += (ts_bitrate - program->ts_bitrate) * BITRATE_WEIGHT;
+			} else {
+				program->bitrate = bitrate;
+				program->ts_bitrate = ts_bitrate;
+			}
+			program->pcr_time += seconds;
+		}
+	}
+
+	if (program->last_pcr < 0 || is_discontinuity) {
+		if (program->last_pcr >= 0) {
+			g_debug("[pcr_tracker_proc_pcr] PCR discontinuity on PID 0x%04x", program->pcr_pid);
+			++program->n_discontinuities;
+		}
+		pcr_tracker_restart(program);
+		program->base_offset = arrival;
+	}
+	program->last_pcr = pcr;
+	program->last_bytes = program->n_bytes;
+	program->last_ts_bytes = self->n_ts_bytes;
+
+	/* 窓を進める */
+	offset = arrival - program->base_offset - program->pcr_time;
+	if (program->pcr_time - program->window_start >= JITTER_WINDOW) {
+		program->window_start = program->pcr_time;
+		program->prev_min_offset = program->min_offset;
+		program->prev_max_offset = program->max_offset;
+		program->min_offset = G_MAXDOUBLE;
+		program->max_offset = -G_MAXDOUBLE;
+	}
+	program->min_offset = MIN(program->min_offset, offset);
+	program->max_offset = MAX(program->max_offset, offset);
+
+	base = MIN(program->min_offset, program->prev_min_offset);
+	program->delay += (offset - base - program->delay) * BITRATE_WEIGHT;
+}
+
+
+/* Exposed functions
+   -------------------------------------------------------------------------- */
+
+PcrTracker *
+pcr_tracker_new(void)
+{
+	PcrTracker *self = g_new0(PcrTracker, 1);
+
+	memset(self->program_of_pid, 0xFF, sizeof(self->program_of_pid));
+	memset(self->pcr_of_pid, 0xFF, sizeof(self->pcr_of_pid));
+
+	return self;
+}
+
+void
+pcr_tracker_free(PcrTracker *self)
+{
+	g_free(self);
+}
+
+/**
+ * PAT・PMT が更新されたら呼び、測るプログラムと PID を作り直す。
+ *
+ * PCR_PID の変わらないプログラムは測った値を引き継ぐ。
+ */
+void
+pcr_tracker_update(PcrTracker *self, PsiTables *psi)
+{
+	PcrTrackerProgram *old_programs;
+	guint n_old_programs, i, j, k;
+	const PsiProgram *program;
+
+	old_programs = g_memdup(self->programs, sizeof(PcrTrackerProgram) * self->n_programs);
+	n_old_programs = self->n_programs;
+
+	memset(self->program_of_pid, 0xFF, sizeof(self->program_of_pid));
+	memset(self->pcr_of_pid, 0xFF, sizeof(self->pcr_of_pid));
+	self->n_programs = 0;
+
+	for (i = 0; (program = psi_tables_get_nth_program(psi, i)); ++i) {
+		PcrTrackerProgram *tracked;
+
+		if (program->version == PSI_UNKNOWN || program->pcr_pid == PSI_NULL_PID)
+			continue;
+
+		tracked = &self->programs[self->n_programs];
+		memset(tracked, 0, sizeof(*tracked));
+		for (j = 0; j < n_old_programs; ++j) {
+			if (old_programs[j].program_number == program->program_number &&
+				old_programs[j].pcr_pid == program->pcr_pid) {
+				*tracked = old_programs[j];
+				break;
+			}
+		}
+		if (j == n_old_programs) {
+			tracked->program_number = program->program_number;
+			tracked->pcr_pid = program->pcr_pid;
+			pcr_tracker_restart(tracked);
+		}
+
+		if (self->pcr_of_pid[program->pcr_pid] < 0) {
+			self->pcr_of_pid[program->pcr_pid] = self->n_programs;
+		}
+		if (self->program_of_pid[program->pmt_pid] < 0) {
+			self->program_of_pid[program->pmt_pid] = self->n_programs;
+		}
+		if (self->program_of_pid[program->pcr_pid] < 0) {
+			self->program_of_pid[program->pcr_pid] = self->n_programs;
+		}
+		for (k = 0; k < program->n_streams; ++k) {
+			if (self->program_of_pid[program->streams[k].pid] < 0) {
+				self->program_of_pid[program->streams[k].pid] = self->n_programs;
+			}
+		}
+		++self->n_programs;
+	}
+
+	g_free(old_programs);
+}
+
+/**
+ * パケット境界に揃ったパケットを調べる。
+ *
+ * @param arrival_usec	パケットがホストに届いた時刻
+ */
+void
+pcr_tracker_push(PcrTracker *self, const guint8 *packets, guint n_packets, gint64 arrival_usec)
+{
+	const guint8 *packet, *end = packets + n_packets * TS_PACKET_SIZE;
+	gdouble arrival = (gdouble)arrival_usec / G_USEC_PER_SEC;
+
+	for (packet = packets; packet < end; packet += TS_PACKET_SIZE) {
+		guint pid = ((packet[1] & 0x1F) << 8) | packet[2];
+		gint index;
+
+		self->n_ts_bytes += TS_PACKET_SIZE;
+
+		index = self->program_of_pid[pid];
+		if (index >= 0) {
+			self->programs[index].n_bytes += TS_PACKET_SIZE;
+		}
+
+		index = self->pcr_of_pid[pid];
+		if (index < 0 || (packet[1] & 0x80))
+			continue;
+
+		/* adaptation_field があり PCR_flag が立っている */
+		if ((packet[3] & 0x20) && packet[4] >= 7 && (packet[5] & 0x10)) {
+			gint64 base = ((gint64)packet[6] << 25) | (packet[7] << 17) | (packet[8] << 9) |
+				(packet[9] << 1) | (packet[10] >> 7);
+			gint64 pcr = base * 300 + (((packet[10] & 0x01) << 8) | packet[11]);
+			gboolean is_discontinuity = (packet[5] & 0x80) != 0;
+			guint i;
+
+			/* PCR_PID を共有するプログラムは全て進める */
+			for (i = index; i < self->n_programs; ++i) {
+				if (self->programs[i].pcr_pid == pid) {
+					pcr_tracker_proc_pcr(self, &self->programs[i], pcr, is_discontinuity, arrival);
+				}
+			}
+		}
+	}
+}
+
+/**
+ * プログラムごとの値を返す。
+ *
+ * @return @a status に書いた数
+ */
+guint
+pcr_tracker_get_status(PcrTracker *self, PcrTrackerStatus *status, guint max_status)
+{
+	guint i, n = MIN(self->n_programs, max_status);
+
+	for (i = 0; i < n; ++i) {
+		PcrTrackerProgram *program = &self->programs[i];
+		gdouble min_offset = MIN(program->min_offset, program->prev_min_offset);
+		gdouble max_offset = MAX(program->max_offset, program->prev_max_offset);
+
+		status[i].program_number = program->program_number;
+		status[i].pcr_pid = program->pcr_pid;
+		status[i].bitrate = program->bitrate;
+		status[i].ts_bitrate = program->ts_bitrate;
+		status[i].jitter = max_offset > min_offset ? max_offset - min_offset : 0;
+		status[i].delay = program->delay;
+		status[i].n_discontinuities = program->n_discontinuities;
+	}
+	return n;
+}
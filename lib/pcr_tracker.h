@@ -0,0 +1,33 @@
+#ifndef PCR_TRACKER_H_INCLUDED
+#define PCR_TRACKER_H_INCLUDED
+
+struct PcrTracker;
+typedef struct PcrTracker PcrTracker;
+
+/** プログラムごとの PCR から測った値 */
+typedef struct PcrTrackerStatus {
+	guint program_number;
+	guint pcr_pid;
+	gdouble bitrate;			/* プログラムのビットレート (bps) */
+	gdouble ts_bitrate;			/* TS 全体のビットレート (bps) */
+	gdouble jitter;				/* PCR に対する到着時刻のゆらぎの幅 (秒) */
+	gdouble delay;				/* 最も早く届いた場合に対する平均の遅れ (秒) */
+	guint n_discontinuities;	/* PCR が不連続だった回数 */
+} PcrTrackerStatus;
+
+PcrTracker *
+pcr_tracker_new(void);
+
+void
+pcr_tracker_free(PcrTracker *self);
+
+void
+pcr_tracker_update(PcrTracker *self, PsiTables *psi);
+
+void
+pcr_tracker_push(PcrTracker *self, const guint8 *packets, guint n_packets, gint64 arrival_usec);
+
+guint
+pcr_tracker_get_status(PcrTracker *self, PcrTrackerStatus *status, guint max_status);
+
+#endif	/* PCR_TRACKER_H_INCLUDED */
@@ -0,0 +1,464 @@
+#include <string.h>
+#include <glib.h>
+
+#include "pid_filter.h"
+#include "psi.h"
+#include "ts_simd.h"
+
+/*
+ * 選んだサービスの PID だけを残すフィルタ。
+ *
+ * PAT から選んだサービスの PMT の PID を、PMT から PCR・ES・ECM の PID を調べ、
+ * 8192 ビットのビットマップで残す PID を表す。PAT や NIT などの SI (0x0000〜0x001F) は常に残す。
+ * パケットの並びはその場で詰め直すので、呼び出し元のバッファをそのまま使える。
+ */
+
+#define TS_PACKET_SIZE 188
+#define CA_DESCRIPTOR_TAG 0x09
+#define SI_PID_MAX 0x001F			/* これ以下の PID は常に残す */
+#define BITMAP_WORDS (PID_FILTER_MAX_PID / 32)
+#define CLASSIFY_BLOCK 8			/* 一度に PID を取り出すパケット数 */
+
+typedef struct {
+	guint service_id;
+	gint pmt_pid;				/* PAT から得た PMT の PID (-1:不明) */
+	PsiSection pmt;
+	gint pmt_version;			/* 最後に処理した PMT のバージョン (-1:未処理) */
+	GArray *pids;				/* PMT から得た PID */
+} PidFilterService;
+
+struct PidFilter {
+	guint32 bitmap[BITMAP_WORDS];		/* 残す PID */
+	guint32 fixed_bitmap[BITMAP_WORDS];	/* サービスによらず残す PID */
+	guint32 psi_bitmap[BITMAP_WORDS];	/* 解析する PAT・PMT の PID */
+	guint32 drop_bitmap[BITMAP_WORDS];	/* サービスによらず捨てる PID */
+	gboolean is_selective;				/* サービスか PID が追加されたか */
+
+	PsiSection pat;
+	gint pat_version;			/* 最後に処理した PAT のバージョン (-1:未処理) */
+	gint pat_tsid;
+	GPtrArray *services;
+
+	guint64 n_passed;
+	guint64 n_dropped;
+};
+
+typedef guint (*PidFilterClassifyFunc)(const guint32 *bitmap, const guint8 *packets, guint32 *pids);
+
+static PidFilterClassifyFunc st_classify = NULL;
+static gsize st_is_classify_initialized = 0;
+
+
+/* Bitmap
+   -------------------------------------------------------------------------- */
+
+static inline guint
+get_pid(const guint8 *packet)
+{
+	return ((packet[1] & 0x1F) << 8) | packet[2];
+}
+
+static inline gboolean
+bitmap_test(const guint32 *bitmap, guint pid)
+{
+	return (bitmap[pid >> 5] >> (pid & 31)) & 1;
+}
+
+static inline void
+bitmap_set(guint32 *bitmap, guint pid)
+{
+	bitmap[pid >> 5] |= 1U << (pid & 31);
+}
+
+/**
+ * CLASSIFY_BLOCK 個のパケットの PID を取り出し、残すパケットのビットを返す。
+ */
+static guint
+pid_filter_classify_scalar(const guint32 *bitmap, const guint8 *packets, guint32 *pids)
+{
+	guint i, mask = 0;
+
+	for (i = 0; i < CLASSIFY_BLOCK; ++i) {
+		pids[i] = get_pid(packets + i * TS_PACKET_SIZE);
+		mask |= bitmap_test(bitmap, pids[i]) << i;
+	}
+	return mask;
+}
+
+#ifdef TS_SIMD_HAVE_X86
+/**
+ * 8 パケットのヘッダを gather でまとめて読み、PID の取り出しとビットマップの参照を並列に行う。
+ */
+__attribute__((target("avx2")))
+static guint
+pid_filter_classify_avx2(const guint32 *bitmap, const guint8 *packets, guint32 *pids)
+{
+	__m256i pid;
+
+	ts_simd_gather_headers(packets, &pid);
+	_mm256_storeu_si256((__m256i *)pids, pid);
+	return ts_simd_movemask(ts_simd_test_bitmap(bitmap, pid));
+}
+#endif
+
+static void
+pid_filter_init_classify(void)
+{
+	if (g_once_init_enter(&st_is_classify_initialized)) {
+		st_classify = pid_filter_classify_scalar;
+#ifdef TS_SIMD_HAVE_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			st_classify = pid_filter_classify_avx2;
+		}
+#endif
+		g_once_init_leave(&st_is_classify_initialized, 1);
+	}
+}
+
+/**
+ * 選んだサービスの PAT・PMT から残す PID を作り直す。
+ */
+static void
+pid_filter_rebuild(PidFilter *self)
+{
+	guint i, j;
+
+	memcpy(self->bitmap, self->fixed_bitmap, sizeof(self->bitmap));
+	memset(self->psi_bitmap, 0, sizeof(self->psi_bitmap));
+	if (self->services->len > 0) {
+		bitmap_set(self->psi_bitmap, PSI_PAT_PID);
+	}
+
+	for (i = 0; i < self->services->len; ++i) {
+		PidFilterService *service = g_ptr_array_index(self->services, i);
+
+		if (service->pmt_pid < 0)
+			continue;
+		bitmap_set(self->bitmap, service->pmt_pid);
+		bitmap_set(self->psi_bitmap, service->pmt_pid);
+		for (j = 0; j < service->pids->len; ++j) {
+			bitmap_set(self->bitmap, g_array_index(service->pids, guint16, j));
+		}
+	}
+
+	for (i = 0; i < BITMAP_WORDS; ++i) {
+		self->bitmap[i] &= ~self->drop_bitmap[i];
+	}
+}
+
+
+/* PSI
+   -------------------------------------------------------------------------- */
+
+static void
+pid_filter_proc_pat(const guint8 *data, guint len, gpointer user_data)
+{
+	PidFilter *self = user_data;
+	const guint8 *p, *end;
+	gint version, tsid;
+	guint i;
+
+	if (data[0] != PSI_PAT_TABLE_ID || !(data[5] & 0x01))
+		return;					/* current_next_indicator が 0 のものは使わない */
+
+	tsid = (data[3] << 8) | data[4];
+	version = (data[5] >> 1) & 0x1F;
+	if (version == self->pat_version && tsid == self->pat_tsid)
+		return;
+	self->pat_version = version;
+	self->pat_tsid = tsid;
+
+	end = data + len - 4;		/* CRC_32 */
+	for (i = 0; i < self->services->len; ++i) {
+		PidFilterService *service = g_ptr_array_index(self->services, i);
+		gint pmt_pid = -1;
+
+		for (p = data + 8; p + 4 <= end; p += 4) {
+			if (((p[0] << 8) | p[1]) == service->service_id) {
+				pmt_pid = ((p[2] & 0x1F) << 8) | p[3];
+				break;
+			}
+		}
+
+		/* PMT の PID が変わらなければ、PMT から得た PID をそのまま残す */
+		if (pmt_pid == service->pmt_pid)
+			continue;
+		if (pmt_pid >= 0) {
+			g_debug("[pid_filter_proc_pat] service 0x%04x: PMT PID 0x%04x", service->service_id, pmt_pid);
+		} else {
+			g_debug("[pid_filter_proc_pat] service 0x%04x: not in PAT", service->service_id);
+		}
+		service->pmt_pid = pmt_pid;
+		service->pmt_version = -1;
+		psi_section_reset(&service->pmt);
+		g_array_set_size(service->pids, 0);
+	}
+
+	pid_filter_rebuild(self);
+}
+
+/**
+ * 記述子の並びから CA_descriptor の CA_PID (ECM) を拾う。
+ */
+static void
+pid_filter_proc_descriptors(GArray *pids, const guint8 *p, const guint8 *end)
+{
+	while (p + 2 <= end && p + 2 + p[1] <= end) {
+		if (p[0] == CA_DESCRIPTOR_TAG && p[1] >= 4) {
+			guint16 pid = ((p[4] & 0x1F) << 8) | p[5];
+			g_array_append_val(pids, pid);
+		}
+		p += 2 + p[1];
+	}
+}
+
+static void
+pid_filter_proc_pmt(const guint8 *data, guint len, gpointer user_data)
+{
+	PidFilter *self = user_data;
+	PidFilterService *service = NULL;
+	const guint8 *p, *end;
+	guint16 pcr_pid;
+	guint info_len, program_number, i;
+	gint version;
+
+	if (data[0] != PSI_PMT_TABLE_ID || !(data[5] & 0x01))
+		return;
+
+	program_number = (data[3] << 8) | data[4];
+	for (i = 0; i < self->services->len; ++i) {
+		PidFilterService *candidate = g_ptr_array_index(self->services, i);
+		if (candidate->service_id == program_number) {
+			service = candidate;
+			break;
+		}
+	}
+	version = (data[5] >> 1) & 0x1F;
+	if (!service || version == service->pmt_version)
+		return;
+	service->pmt_version = version;
+
+	g_array_set_size(service->pids, 0);
+
+	end = data + len - 4;		/* CRC_32 */
+	pcr_pid = ((data[8] & 0x1F) << 8) | data[9];
+	if (pcr_pid != PSI_NULL_PID) {
+		g_array_append_val(service->pids, pcr_pid);	/* 0x1FFF は PCR なし */
+	}
+
+	info_len = ((data[10] & 0x0F) << 8) | data[11];
+	p = data + 12;
+	pid_filter_proc_descriptors(service->pids, p, MIN(p + info_len, end));
+	p += info_len;
+
+	while (p + 5 <= end) {
+		guint16 pid = ((p[1] & 0x1F) << 8) | p[2];
+		info_len = ((p[3] & 0x0F) << 8) | p[4];
+		g_array_append_val(service->pids, pid);
+		pid_filter_proc_descriptors(service->pids, p + 5, MIN(p + 5 + info_len, end));
+		p += 5 + info_len;
+	}
+
+	g_debug("[pid_filter_proc_pmt] service 0x%04x: %u PIDs", service->service_id, service->pids->len);
+	pid_filter_rebuild(self);
+}
+
+/**
+ * PAT・PMT のパケットを解析する。
+ */
+static void
+pid_filter_proc_psi(PidFilter *self, const guint8 *packet, guint pid)
+{
+	guint i;
+
+	if (pid == PSI_PAT_PID) {
+		psi_section_push(&self->pat, packet, pid_filter_proc_pat, self);
+		return;
+	}
+
+	for (i = 0; i < self->services->len; ++i) {
+		PidFilterService *service = g_ptr_array_index(self->services, i);
+
+		if (service->pmt_pid != (gint)pid)
+			continue;
+		psi_section_push(&service->pmt, packet, pid_filter_proc_pmt, self);
+	}
+}
+
+
+/* Exposed functions
+   -------------------------------------------------------------------------- */
+
+/**
+ * PID フィルタを作る。
+ *
+ * サービスも PID も追加しなければ、全てのパケットを残す。
+ */
+PidFilter *
+pid_filter_new(void)
+{
+	PidFilter *self;
+
+	pid_filter_init_classify();
+
+	self = g_new0(PidFilter, 1);
+	self->services = g_ptr_array_new();
+	psi_section_reset(&self->pat);
+	self->pat_version = -1;
+	self->pat_tsid = -1;
+	memset(self->fixed_bitmap, 0xFF, sizeof(self->fixed_bitmap));
+	pid_filter_rebuild(self);
+
+	return self;
+}
+
+void
+pid_filter_free(PidFilter *self)
+{
+	guint i;
+
+	if (!self)
+		return;
+
+	for (i = 0; i < self->services->len; ++i) {
+		PidFilterService *service = g_ptr_array_index(self->services, i);
+		g_array_free(service->pids, TRUE);
+		g_free(service);
+	}
+	g_ptr_array_free(self->services, TRUE);
+	g_free(self);
+}
+
+/**
+ * サービスによらず残す PID を初期状態 (SI のみ) にする。
+ */
+static void
+pid_filter_init_fixed(PidFilter *self)
+{
+	guint pid;
+
+	if (self->is_selective)
+		return;
+
+	self->is_selective = TRUE;
+	memset(self->fixed_bitmap, 0, sizeof(self->fixed_bitmap));
+	for (pid = 0; pid <= SI_PID_MAX; ++pid) {
+		bitmap_set(self->fixed_bitmap, pid);
+	}
+}
+
+/**
+ * 残すサービスを追加する。
+ *
+ * @param service_id	PAT の program_number
+ */
+void
+pid_filter_add_service(PidFilter *self, guint service_id)
+{
+	PidFilterService *service;
+
+	pid_filter_init_fixed(self);
+
+	service = g_new0(PidFilterService, 1);
+	service->service_id = service_id & 0xFFFF;
+	service->pmt_pid = -1;
+	service->pids = g_array_new(FALSE, FALSE, sizeof(guint16));
+	service->pmt_version = -1;
+	psi_section_reset(&service->pmt);
+	g_ptr_array_add(self->services, service);
+
+	/* 次の PAT から調べ直す */
+	psi_section_reset(&self->pat);
+	self->pat_version = -1;
+	self->pat_tsid = -1;
+	pid_filter_rebuild(self);
+}
+
+/**
+ * サービスによらず残す PID を追加する。
+ */
+void
+pid_filter_add_pid(PidFilter *self, guint pid)
+{
+	g_return_if_fail(pid < PID_FILTER_MAX_PID);
+
+	pid_filter_init_fixed(self);
+	bitmap_set(self->fixed_bitmap, pid);
+	pid_filter_rebuild(self);
+}
+
+/**
+ * サービスによらず捨てる PID を追加する。
+ *
+ * PMT に載っていても捨てる。
+ */
+void
+pid_filter_drop_pid(PidFilter *self, guint pid)
+{
+	g_return_if_fail(pid < PID_FILTER_MAX_PID);
+
+	bitmap_set(self->drop_bitmap, pid);
+	pid_filter_rebuild(self);
+}
+
+/**
+ * 残さないパケットを取り除き、残すパケットを先頭に詰める。
+ *
+ * @param packets	パケット境界に揃った @a n_packets 個のパケット
+ * @return 残したパケット数
+ */
+guint
+pid_filter_apply(PidFilter *self, guint8 *packets, guint n_packets)
+{
+	guint8 *in = packets, *out = packets;
+	guint32 pids[CLASSIFY_BLOCK];
+	guint i, n, mask;
+	gboolean is_rebuilt;
+
+	while (n_packets > 0) {
+		n = MIN(n_packets, CLASSIFY_BLOCK);
+		if (n == CLASSIFY_BLOCK) {
+			mask = st_classify(self->bitmap, in, pids);
+		} else {
+			mask = 0;
+			for (i = 0; i < n; ++i) {
+				pids[i] = get_pid(in + i * TS_PACKET_SIZE);
+				mask |= bitmap_test(self->bitmap, pids[i]) << i;
+			}
+		}
+
+		is_rebuilt = FALSE;
+		for (i = 0; i < n; ++i, in += TS_PACKET_SIZE) {
+			gboolean is_pass;
+
+			/* PMT を読んで PID が増えたら、ブロックの残りは引き直す */
+			is_pass = is_rebuilt ? bitmap_test(self->bitmap, pids[i]) : (mask >> i) & 1;
+			if (!is_pass) {
+				++self->n_dropped;
+				continue;
+			}
+
+			if (bitmap_test(self->psi_bitmap, pids[i])) {
+				pid_filter_proc_psi(self, in, pids[i]);
+				is_rebuilt = TRUE;
+			}
+
+			if (out != in) {
+				memcpy(out, in, TS_PACKET_SIZE);
+			}
+			out += TS_PACKET_SIZE;
+			++self->n_passed;
+		}
+		n_packets -= n;
+	}
+
+	return (out - packets) / TS_PACKET_SIZE;
+}
+
+void
+pid_filter_get_stats(PidFilter *self, guint64 *n_passed, guint64 *n_dropped)
+{
+	if (n_passed) *n_passed = self->n_passed;
+	if (n_dropped) *n_dropped = self->n_dropped;
+}
@@ -0,0 +1,30 @@
+#ifndef PID_FILTER_H_INCLUDED
+#define PID_FILTER_H_INCLUDED
+
+struct PidFilter;
+typedef struct PidFilter PidFilter;
+
+#define PID_FILTER_MAX_PID 0x2000
+
+PidFilter *
+pid_filter_new(void);
+
+void
+pid_filter_free(PidFilter *self);
+
+void
+pid_filter_add_service(PidFilter *self, guint service_id);
+
+void
+pid_filter_add_pid(PidFilter *self, guint pid);
+
+void
+pid_filter_drop_pid(PidFilter *self, guint pid);
+
+guint
+pid_filter_apply(PidFilter *self, guint8 *packets, guint n_packets);
+
+void
+pid_filter_get_stats(PidFilter *self, guint64 *n_passed, guint64 *n_dropped);
+
+#endif	/* PID_FILTER_H_INCLUDED */
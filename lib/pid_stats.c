@@ -0,0 +1,171 @@
+#include <string.h>
+#include <glib.h>
+
+#include "pid_stats.h"
+
+/*
+ * PID ごとの受信品質を数える。
+ *
+ * 8192 個の PID の数え値を平らな配列で持ち、パケット境界を揃えた直後に全パケットを通す。
+ * 数え値は他のスレッドからは概算として読む。
+ */
+
+#define TS_PACKET_SIZE 188
+#define NULL_PID 0x1FFF
+
+typedef struct {
+	PidStatsCounters counters;
+	gint last_cc;				/* 最後の continuity_counter (-1:未受信) */
+} PidStatsEntry;
+
+struct PidStats {
+	PidStatsEntry entries[PID_STATS_MAX_PID];
+	PidStatsCounters totals;
+
+	/* pid_stats_write() でレートを計算するための前回の値 */
+	GTimer *timer;
+	gdouble last_write_time;
+	guint64 last_packets[PID_STATS_MAX_PID];
+};
+
+
+/* Exposed functions
+   -------------------------------------------------------------------------- */
+
+PidStats *
+pid_stats_new(void)
+{
+	PidStats *self;
+	guint pid;
+
+	self = g_new0(PidStats, 1);
+	for (pid = 0; pid < PID_STATS_MAX_PID; ++pid) {
+		self->entries[pid].last_cc = -1;
+	}
+	self->timer = g_timer_new();
+
+	return self;
+}
+
+void
+pid_stats_free(PidStats *self)
+{
+	if (!self)
+		return;
+
+	g_timer_destroy(self->timer);
+	g_free(self);
+}
+
+/**
+ * パケット境界に揃ったパケットを数える。
+ */
+void
+pid_stats_push(PidStats *self, const guint8 *packets, guint n_packets)
+{
+	const guint8 *packet, *end = packets + n_packets * TS_PACKET_SIZE;
+
+	for (packet = packets; packet < end; packet += TS_PACKET_SIZE) {
+		guint pid = ((packet[1] & 0x1F) << 8) | packet[2];
+		PidStatsEntry *entry = &self->entries[pid];
+		guint cc, adaptation;
+
+		++entry->counters.n_packets;
+
+		if (packet[1] & 0x80) {
+			/* ヘッダも信用できないので、連続性は確かめない */
+			++entry->counters.n_tei;
+			++self->totals.n_tei;
+			continue;
+		}
+		if (packet[3] & 0xC0) {
+			++entry->counters.n_scrambled;
+			++self->totals.n_scrambled;
+		}
+		if (pid == NULL_PID)
+			continue;
+
+		adaptation = (packet[3] >> 4) & 0x03;
+		cc = packet[3] & 0x0F;
+
+		/* discontinuity_indicator が立っていれば、そこから数え直す */
+		if ((adaptation & 0x02) && packet[4] > 0 && (packet[5] & 0x80)) {
+			entry->last_cc = cc;
+			continue;
+		}
+
+		/* ペイロードのないパケットでは continuity_counter は進まない。重送は一度だけ許される */
+		if ((adaptation & 0x01) && entry->last_cc >= 0 &&
+			cc != ((entry->last_cc + 1) & 0x0F) && cc != (guint)entry->last_cc) {
+			++entry->counters.n_cc_errors;
+			++self->totals.n_cc_errors;
+		}
+		entry->last_cc = cc;
+	}
+
+	self->totals.n_packets += n_packets;
+}
+
+void
+pid_stats_get_counters(PidStats *self, guint pid, PidStatsCounters *counters)
+{
+	g_return_if_fail(pid < PID_STATS_MAX_PID);
+
+	*counters = self->entries[pid].counters;
+}
+
+/**
+ * 全ての PID の合計を返す。
+ */
+void
+pid_stats_get_totals(PidStats *self, PidStatsCounters *totals)
+{
+	*totals = self->totals;
+}
+
+/**
+ * 受信した PID の数え値と、前回呼んだ時からのバイトレートをファイルに書き出す。
+ *
+ * 読み手が書きかけのファイルを見ないよう、一時ファイルに書いてから置き換える。
+ */
+gboolean
+pid_stats_write(PidStats *self, const gchar *filename, GError **error)
+{
+	GString *text;
+	gdouble now, interval;
+	gboolean result;
+	guint pid;
+
+	now = g_timer_elapsed(self->timer, NULL);
+	interval = now - self->last_write_time;
+	self->last_write_time = now;
+
+	text = g_string_sized_new(4096);
+	g_string_append_printf(text, "# elapsed=%.1f packets=%"G_GUINT64_FORMAT" scrambled=%"G_GUINT64_FORMAT
+						   " cc_errors=%u tei=%u\n",
+						   now, self->totals.n_packets, self->totals.n_scrambled,
+						   self->totals.n_cc_errors, self->totals.n_tei);
+
+	for (pid = 0; pid < PID_STATS_MAX_PID; ++pid) {
+		PidStatsCounters counters = self->entries[pid].counters;
+		gdouble bytes_per_sec = 0;
+
+		if (counters.n_packets == 0)
+			continue;
+
+		if (interval > 0) {
+			bytes_per_sec = (counters.n_packets - self->last_packets[pid]) * TS_PACKET_SIZE / interval;
+		}
+		self->last_packets[pid] = counters.n_packets;
+
+		g_string_append_printf(text, "pid=0x%04x packets=%"G_GUINT64_FORMAT" bytes_per_sec=%.0f"
+							   " scrambled=%"G_GUINT64_FORMAT" cc_errors=%u tei=%u\n",
+							   pid, counters.n_packets, bytes_per_sec,
+							   counters.n_scrambled, counters.n_cc_errors, counters.n_tei);
+	}
+
+	result = g_file_set_contents(filename, text->str, text->len, error);
+	g_string_free(text, TRUE);
+
+	return result;
+}
@@ -0,0 +1,35 @@
+#ifndef PID_STATS_H_INCLUDED
+#define PID_STATS_H_INCLUDED
+
+struct PidStats;
+typedef struct PidStats PidStats;
+
+#define PID_STATS_MAX_PID 0x2000
+
+/** PID 一つ分の受信品質 */
+typedef struct PidStatsCounters {
+	guint64 n_packets;
+	guint64 n_scrambled;		/* transport_scrambling_control が 0 でないパケット数 */
+	guint32 n_cc_errors;		/* continuity_counter の不連続 */
+	guint32 n_tei;				/* transport_error_indicator の立ったパケット数 */
+} PidStatsCounters;
+
+PidStats *
+pid_stats_new(void);
+
+void
+pid_stats_free(PidStats *self);
+
+void
+pid_stats_push(PidStats *self, const guint8 *packets, guint n_packets);
+
+void
+pid_stats_get_counters(PidStats *self, guint pid, PidStatsCounters *counters);
+
+void
+pid_stats_get_totals(PidStats *self, PidStatsCounters *totals);
+
+gboolean
+pid_stats_write(PidStats *self, const gchar *filename, GError **error);
+
+#endif	/* PID_STATS_H_INCLUDED */
@@ -0,0 +1,652 @@
+#include <string.h>
+#include <glib.h>
+
+#include "psi.h"
+
+/*
+ * PAT・PMT・CAT・NIT のセクションを TS パケットから組み立てて解析する。
+ *
+ * セクションはパケットをまたいでも、一つのパケットに複数あってもよい。
+ * 同じバージョンのセクションは CRC を確かめるだけで読み飛ばすので、
+ * 入力の全パケットに対して呼んでも負荷は小さい。
+ */
+
+#define TS_PACKET_SIZE 188
+#define CA_DESCRIPTOR_TAG 0x09
+#define MIN_SECTION_SIZE (3 + 5 + 4)	/* ヘッダと CRC_32 */
+#define MAX_PID 0x2000
+
+typedef struct {
+	gint version;				/* 受信中のバージョン (PSI_UNKNOWN:未受信) */
+	gint id;					/* table_id_extension */
+	guint32 section_mask[256 / 32];	/* 受信した section_number */
+	gboolean is_complete;		/* 全てのセクションを受信したか */
+} PsiTableVersion;
+
+struct PsiTables {
+	PsiTablesFunc func;
+	gpointer user_data;
+
+	PsiSection pat_section;
+	PsiSection cat_section;
+	PsiSection nit_section;
+	PsiTableVersion pat_version;
+	PsiTableVersion cat_version;
+	PsiTableVersion nit_version;
+
+	gint transport_stream_id;
+	gint network_id;
+
+	PsiProgram programs[PSI_MAX_PROGRAMS];
+	PsiSection *pmt_sections;	/* programs[] と同じ並びの PMT の組み立て */
+	gboolean is_stale[PSI_MAX_PROGRAMS];	/* 新しい PAT にまだ現われていない */
+	guint n_programs;
+	gint16 pmt_index[MAX_PID];	/* PID から programs[] の位置を引く (-1:PMT ではない) */
+
+	guint16 emm_pids[PSI_MAX_EMM_PIDS];
+	guint n_emm_pids;
+
+	guint64 n_sections;
+	guint n_updates;
+};
+
+static guint32 st_crc32_table[8][256];
+static gsize st_is_crc32_table_initialized = 0;
+
+
+/* CRC32
+   -------------------------------------------------------------------------- */
+
+/**
+ * slice-by-8 の表を作る。
+ *
+ * st_crc32_table[k][i] は、バイト i に続けて k バイトの 0 を処理した時の CRC になる。
+ */
+static void
+psi_crc32_init_table(void)
+{
+	guint32 i, j, c;
+
+	for (i = 0; i < 256; ++i) {
+		c = i << 24;
+		for (j = 0; j < 8; ++j) {
+			c = (c & 0x80000000) ? (c << 1) ^ 0x04C11DB7 : (c << 1);
+		}
+		st_crc32_table[0][i] = c;
+	}
+	for (i = 0; i < 256; ++i) {
+		c = st_crc32_table[0][i];
+		for (j = 1; j < 8; ++j) {
+			c = (c << 8) ^ st_crc32_table[0][c >> 24];
+			st_crc32_table[j][i] = c;
+		}
+	}
+}
+
+/**
+ * MPEG-2 の CRC32 を計算する。CRC を含めたセクション全体に掛けると 0 になる。
+ *
+ * 8 バイトずつ表を引く (slice-by-8)。
+ */
+guint32
+psi_crc32(const guint8 *data, guint len)
+{
+	guint32 crc = 0xFFFFFFFF;
+
+	if (g_once_init_enter(&st_is_crc32_table_initialized)) {
+		psi_crc32_init_table();
+		g_once_init_leave(&st_is_crc32_table_initialized, 1);
+	}
+
+	for (; len >= 8; data += 8, len -= 8) {
+		crc ^= ((guint32)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+		crc = st_crc32_table[7][crc >> 24] ^
+			st_crc32_table[6][(crc >> 16) & 0xFF] ^
+			st_crc32_table[5][(crc >> 8) & 0xFF] ^
+			st_crc32_table[4][crc & 0xFF] ^
+			st_crc32_table[3][data[4]] ^
+			st_crc32_table[2][data[5]] ^
+			st_crc32_table[1][data[6]] ^
+			st_crc32_table[0][data[7]];
+	}
+	for (; len > 0; ++data, --len) {
+		crc = (crc << 8) ^ st_crc32_table[0][(crc >> 24) ^ *data];
+	}
+	return crc;
+}
+
+
+/* Section
+   -------------------------------------------------------------------------- */
+
+void
+psi_section_reset(PsiSection *self)
+{
+	self->len = 0;
+	self->section_len = 0;
+	self->is_started = FALSE;
+	self->last_cc = -1;
+}
+
+/**
+ * ペイロードをセクションに積み、完成したセクションを @a func に渡す。
+ *
+ * セクションの後に続くのが詰め物 (0xFF) でなければ、次のセクションとして続けて積む。
+ */
+static guint
+psi_section_feed(PsiSection *self, const guint8 *p, guint len, PsiSectionFunc func, gpointer user_data)
+{
+	guint n_sections = 0;
+
+	while (len > 0 && self->is_started) {
+		guint n;
+
+		if (self->len == 0 && p[0] == 0xFF) {
+			self->is_started = FALSE;	/* 残りは詰め物 */
+			break;
+		}
+
+		n = MIN(len, (self->section_len ? self->section_len : 3) - self->len);
+		memcpy(self->data + self->len, p, n);
+		self->len += n;
+		p += n;
+		len -= n;
+
+		if (self->section_len == 0) {
+			if (self->len < 3)
+				break;
+			self->section_len = 3 + (((self->data[1] & 0x0F) << 8) | self->data[2]);
+			if (self->section_len > PSI_MAX_SECTION_SIZE || self->section_len < MIN_SECTION_SIZE) {
+				psi_section_reset(self);
+				break;
+			}
+			continue;
+		}
+
+		if (self->len == self->section_len) {
+			if (psi_crc32(self->data, self->len) != 0) {
+				++self->n_crc_errors;
+			} else {
+				++n_sections;
+				func(self->data, self->len, user_data);
+			}
+			self->len = 0;
+			self->section_len = 0;
+		}
+	}
+	return n_sections;
+}
+
+/**
+ * パケットを積む。
+ *
+ * @return このパケットで完成したセクションの数
+ */
+guint
+psi_section_push(PsiSection *self, const guint8 *packet, PsiSectionFunc func, gpointer user_data)
+{
+	const guint8 *payload;
+	guint payload_len, adaptation, cc, pointer, n_sections = 0;
+
+	if (packet[1] & 0x80)
+		return 0;				/* transport_error_indicator */
+
+	adaptation = (packet[3] >> 4) & 0x03;
+	cc = packet[3] & 0x0F;
+	if (!(adaptation & 0x01))
+		return 0;
+
+	if (self->last_cc >= 0) {
+		if (cc == (guint)self->last_cc)
+			return 0;			/* 重送されたパケット */
+		if (cc != ((self->last_cc + 1) & 0x0F)) {
+			/* 連続性が途切れたら組み立て中のセクションは捨てる */
+			self->is_started = FALSE;
+		}
+	}
+	self->last_cc = cc;
+
+	payload = packet + 4;
+	payload_len = TS_PACKET_SIZE - 4;
+	if (adaptation & 0x02) {
+		guint adaptation_len = payload[0] + 1;
+		if (adaptation_len >= payload_len)
+			return 0;
+		payload += adaptation_len;
+		payload_len -= adaptation_len;
+	}
+
+	if (!(packet[1] & 0x40))
+		return psi_section_feed(self, payload, payload_len, func, user_data);
+
+	/* pointer_field の前は組み立て中のセクションの続き */
+	pointer = payload[0];
+	++payload;
+	--payload_len;
+	if (pointer >= payload_len) {
+		self->is_started = FALSE;
+		return 0;
+	}
+	if (self->is_started) {
+		n_sections += psi_section_feed(self, payload, pointer, func, user_data);
+	}
+
+	self->len = 0;
+	self->section_len = 0;
+	self->is_started = TRUE;
+	n_sections += psi_section_feed(self, payload + pointer, payload_len - pointer, func, user_data);
+
+	return n_sections;
+}
+
+
+/* Tables
+   -------------------------------------------------------------------------- */
+
+static void
+psi_table_version_reset(PsiTableVersion *version)
+{
+	version->version = PSI_UNKNOWN;
+	version->id = PSI_UNKNOWN;
+	memset(version->section_mask, 0, sizeof(version->section_mask));
+	version->is_complete = FALSE;
+}
+
+/**
+ * セクションのバージョンと section_number を調べる。
+ *
+ * table_id_extension が変わった場合も新しいバージョンとみなす (切り替え先の TS の PAT など)。
+ *
+ * @param[out]	is_new_version	新しいバージョンの最初のセクションなら TRUE
+ * @return まだ受け取っていないセクションなら TRUE
+ */
+static gboolean
+psi_table_version_check(PsiTableVersion *version, const guint8 *section, gboolean *is_new_version)
+{
+	gint version_number, id;
+	guint section_number;
+
+	*is_new_version = FALSE;
+	if (!(section[5] & 0x01))
+		return FALSE;			/* current_next_indicator が 0 のものは使わない */
+
+	id = (section[3] << 8) | section[4];
+	version_number = (section[5] >> 1) & 0x1F;
+	section_number = section[6];
+
+	if (version_number != version->version || id != version->id) {
+		psi_table_version_reset(version);
+		version->version = version_number;
+		version->id = id;
+		*is_new_version = TRUE;
+	} else if (version->section_mask[section_number >> 5] & (1U << (section_number & 31))) {
+		return FALSE;
+	}
+	version->section_mask[section_number >> 5] |= 1U << (section_number & 31);
+	return TRUE;
+}
+
+/**
+ * 0〜last_section_number のセクションが揃ったら TRUE を返す。揃った後は FALSE を返す。
+ */
+static gboolean
+psi_table_version_complete(PsiTableVersion *version, const guint8 *section)
+{
+	guint i, last = section[7];
+
+	if (version->is_complete)
+		return FALSE;
+	for (i = 0; i <= last; ++i) {
+		if (!(version->section_mask[i >> 5] & (1U << (i & 31))))
+			return FALSE;
+	}
+	version->is_complete = TRUE;
+	return TRUE;
+}
+
+static void
+psi_tables_notify(PsiTables *self, guint table_id, guint id)
+{
+	++self->n_updates;
+	if (self->func) {
+		self->func(self, table_id, id, self->user_data);
+	}
+}
+
+/**
+ * 記述子の並びから CA_descriptor の CA_PID を返す。なければ PSI_NULL_PID を返す。
+ */
+static guint16
+psi_find_ca_pid(const guint8 *p, const guint8 *end)
+{
+	while (p + 2 <= end && p + 2 + p[1] <= end) {
+		if (p[0] == CA_DESCRIPTOR_TAG && p[1] >= 4) {
+			return ((p[4] & 0x1F) << 8) | p[5];
+		}
+		p += 2 + p[1];
+	}
+	return PSI_NULL_PID;
+}
+
+static void
+psi_tables_rebuild_pmt_index(PsiTables *self)
+{
+	guint i;
+
+	memset(self->pmt_index, 0xFF, sizeof(self->pmt_index));
+	for (i = 0; i < self->n_programs; ++i) {
+		if (self->pmt_index[self->programs[i].pmt_pid] < 0) {
+			self->pmt_index[self->programs[i].pmt_pid] = i;
+		}
+	}
+}
+
+static void
+psi_tables_proc_pat(const guint8 *section, guint len, gpointer user_data)
+{
+	PsiTables *self = user_data;
+	const guint8 *p, *end;
+	gboolean is_new_version;
+	guint i, j;
+
+	if (section[0] != PSI_PAT_TABLE_ID)
+		return;
+	if (!psi_table_version_check(&self->pat_version, section, &is_new_version))
+		return;
+	++self->n_sections;
+
+	/* 新しいバージョンに現われなかったプログラムは、全セクションが揃った時に消す */
+	if (is_new_version) {
+		self->transport_stream_id = (section[3] << 8) | section[4];
+		for (i = 0; i < self->n_programs; ++i) {
+			self->is_stale[i] = TRUE;
+		}
+	}
+
+	end = section + len - 4;	/* CRC_32 */
+	for (p = section + 8; p + 4 <= end; p += 4) {
+		guint program_number = (p[0] << 8) | p[1];
+		guint pid = ((p[2] & 0x1F) << 8) | p[3];
+		PsiProgram *program = NULL;
+
+		if (program_number == 0)
+			continue;			/* network_PID */
+
+		for (i = 0; i < self->n_programs; ++i) {
+			if (self->programs[i].program_number == program_number) {
+				program = &self->programs[i];
+				break;
+			}
+		}
+		if (!program) {
+			if (self->n_programs >= PSI_MAX_PROGRAMS)
+				continue;
+			i = self->n_programs++;
+			program = &self->programs[i];
+			program->program_number = program_number;
+			program->pmt_pid = PSI_NULL_PID;
+		}
+		self->is_stale[i] = FALSE;
+
+		if (program->pmt_pid != pid) {
+			program->pmt_pid = pid;
+			program->version = PSI_UNKNOWN;
+			program->pcr_pid = PSI_NULL_PID;
+			program->ecm_pid = PSI_NULL_PID;
+			program->n_streams = 0;
+			psi_section_reset(&self->pmt_sections[i]);
+		}
+	}
+
+	if (!psi_table_version_complete(&self->pat_version, section)) {
+		psi_tables_rebuild_pmt_index(self);
+		return;
+	}
+
+	for (i = j = 0; i < self->n_programs; ++i) {
+		if (self->is_stale[i])
+			continue;
+		if (i != j) {
+			self->programs[j] = self->programs[i];
+			self->pmt_sections[j] = self->pmt_sections[i];
+		}
+		self->is_stale[j++] = FALSE;
+	}
+	self->n_programs = j;
+	psi_tables_rebuild_pmt_index(self);
+
+	g_debug("[psi_tables_proc_pat] transport_stream_id=0x%04x version=%d programs=%u",
+			self->transport_stream_id, self->pat_version.version, self->n_programs);
+	psi_tables_notify(self, PSI_PAT_TABLE_ID, self->transport_stream_id);
+}
+
+static void
+psi_tables_proc_pmt(const guint8 *section, guint len, gpointer user_data)
+{
+	PsiTables *self = user_data;
+	PsiProgram *program = NULL;
+	const guint8 *p, *end;
+	guint program_number, info_len, i;
+	gint version;
+
+	if (section[0] != PSI_PMT_TABLE_ID || !(section[5] & 0x01))
+		return;
+
+	program_number = (section[3] << 8) | section[4];
+	for (i = 0; i < self->n_programs; ++i) {
+		if (self->programs[i].program_number == program_number) {
+			program = &self->programs[i];
+			break;
+		}
+	}
+	version = (section[5] >> 1) & 0x1F;
+	if (!program || program->version == version)
+		return;
+	++self->n_sections;
+
+	end = section + len - 4;	/* CRC_32 */
+	program->version = version;
+	program->pcr_pid = ((section[8] & 0x1F) << 8) | section[9];
+	info_len = ((section[10] & 0x0F) << 8) | section[11];
+	p = section + 12;
+	program->ecm_pid = psi_find_ca_pid(p, MIN(p + info_len, end));
+	p += info_len;
+
+	program->n_streams = 0;
+	while (p + 5 <= end) {
+		info_len = ((p[3] & 0x0F) << 8) | p[4];
+		if (program->n_streams < PSI_MAX_STREAMS) {
+			PsiStream *stream = &program->streams[program->n_streams++];
+			stream->stream_type = p[0];
+			stream->pid = ((p[1] & 0x1F) << 8) | p[2];
+			stream->ecm_pid = psi_find_ca_pid(p + 5, MIN(p + 5 + info_len, end));
+		}
+		p += 5 + info_len;
+	}
+
+	g_debug("[psi_tables_proc_pmt] program_number=0x%04x version=%d streams=%u",
+			program_number, version, program->n_streams);
+	psi_tables_notify(self, PSI_PMT_TABLE_ID, program_number);
+}
+
+static void
+psi_tables_proc_cat(const guint8 *section, guint len, gpointer user_data)
+{
+	PsiTables *self = user_data;
+	const guint8 *p, *end;
+	gboolean is_new_version;
+
+	if (section[0] != PSI_CAT_TABLE_ID)
+		return;
+	if (!psi_table_version_check(&self->cat_version, section, &is_new_version))
+		return;
+	++self->n_sections;
+
+	if (is_new_version) {
+		self->n_emm_pids = 0;
+	}
+
+	end = section + len - 4;	/* CRC_32 */
+	for (p = section + 8; p + 2 <= end && p + 2 + p[1] <= end; p += 2 + p[1]) {
+		if (p[0] == CA_DESCRIPTOR_TAG && p[1] >= 4 && self->n_emm_pids < PSI_MAX_EMM_PIDS) {
+			self->emm_pids[self->n_emm_pids++] = ((p[4] & 0x1F) << 8) | p[5];
+		}
+	}
+
+	if (psi_table_version_complete(&self->cat_version, section)) {
+		g_debug("[psi_tables_proc_cat] version=%d EMM PIDs=%u", self->cat_version.version, self->n_emm_pids);
+		psi_tables_notify(self, PSI_CAT_TABLE_ID, 0);
+	}
+}
+
+static void
+psi_tables_proc_nit(const guint8 *section, guint len, gpointer user_data)
+{
+	PsiTables *self = user_data;
+	gboolean is_new_version;
+
+	if (section[0] != PSI_NIT_TABLE_ID)
+		return;
+	if (!psi_table_version_check(&self->nit_version, section, &is_new_version))
+		return;
+	++self->n_sections;
+
+	if (is_new_version) {
+		self->network_id = (section[3] << 8) | section[4];
+	}
+
+	if (psi_table_version_complete(&self->nit_version, section)) {
+		g_debug("[psi_tables_proc_nit] network_id=0x%04x version=%d", self->network_id, self->nit_version.version);
+		psi_tables_notify(self, PSI_NIT_TABLE_ID, self->network_id);
+	}
+}
+
+
+/* Exposed functions
+   -------------------------------------------------------------------------- */
+
+/**
+ * PSI の解析器を作る。
+ *
+ * @param func	テーブルが更新された時に呼ぶ関数 (NULL でもよい)
+ */
+PsiTables *
+psi_tables_new(PsiTablesFunc func, gpointer user_data)
+{
+	PsiTables *self = g_new0(PsiTables, 1);
+
+	self->func = func;
+	self->user_data = user_data;
+	self->pmt_sections = g_new(PsiSection, PSI_MAX_PROGRAMS);
+	psi_tables_reset(self);
+
+	return self;
+}
+
+void
+psi_tables_free(PsiTables *self)
+{
+	if (!self)
+		return;
+
+	g_free(self->pmt_sections);
+	g_free(self);
+}
+
+/**
+ * 受信したテーブルを全て捨てる。
+ */
+void
+psi_tables_reset(PsiTables *self)
+{
+	psi_section_reset(&self->pat_section);
+	psi_section_reset(&self->cat_section);
+	psi_section_reset(&self->nit_section);
+	psi_table_version_reset(&self->pat_version);
+	psi_table_version_reset(&self->cat_version);
+	psi_table_version_reset(&self->nit_version);
+
+	self->transport_stream_id = PSI_UNKNOWN;
+	self->network_id = PSI_UNKNOWN;
+	self->n_programs = 0;
+	self->n_emm_pids = 0;
+	psi_tables_rebuild_pmt_index(self);
+}
+
+/**
+ * パケット境界に揃ったパケットを解析する。
+ */
+void
+psi_tables_push(PsiTables *self, const guint8 *packets, guint n_packets)
+{
+	const guint8 *packet, *end = packets + n_packets * TS_PACKET_SIZE;
+
+	for (packet = packets; packet < end; packet += TS_PACKET_SIZE) {
+		guint pid = ((packet[1] & 0x1F) << 8) | packet[2];
+		gint index;
+
+		switch (pid) {
+		case PSI_PAT_PID:
+			psi_section_push(&self->pat_section, packet, psi_tables_proc_pat, self);
+			break;
+		case PSI_CAT_PID:
+			psi_section_push(&self->cat_section, packet, psi_tables_proc_cat, self);
+			break;
+		case PSI_NIT_PID:
+			psi_section_push(&self->nit_section, packet, psi_tables_proc_nit, self);
+			break;
+		default:
+			index = self->pmt_index[pid];
+			if (index >= 0) {
+				psi_section_push(&self->pmt_sections[index], packet, psi_tables_proc_pmt, self);
+			}
+			break;
+		}
+	}
+}
+
+void
+psi_tables_get_status(PsiTables *self, PsiTablesStatus *status)
+{
+	guint i;
+
+	status->transport_stream_id = self->transport_stream_id;
+	status->network_id = self->network_id;
+	status->pat_version = self->pat_version.version;
+	status->cat_version = self->cat_version.version;
+	status->nit_version = self->nit_version.version;
+	status->n_programs = self->n_programs;
+	status->n_emm_pids = self->n_emm_pids;
+	memcpy(status->emm_pids, self->emm_pids, sizeof(status->emm_pids));
+	status->n_sections = self->n_sections;
+	status->n_updates = self->n_updates;
+
+	status->n_crc_errors = self->pat_section.n_crc_errors + self->cat_section.n_crc_errors +
+		self->nit_section.n_crc_errors;
+	for (i = 0; i < self->n_programs; ++i) {
+		status->n_crc_errors += self->pmt_sections[i].n_crc_errors;
+	}
+}
+
+/**
+ * PAT に載ったプログラムを返す。なければ NULL を返す。
+ *
+ * 返した値は次に psi_tables_push() を呼ぶまで有効。
+ */
+const PsiProgram *
+psi_tables_get_program(PsiTables *self, guint program_number)
+{
+	guint i;
+
+	for (i = 0; i < self->n_programs; ++i) {
+		if (self->programs[i].program_number == program_number)
+			return &self->programs[i];
+	}
+	return NULL;
+}
+
+const PsiProgram *
+psi_tables_get_nth_program(PsiTables *self, guint n)
+{
+	return n < self->n_programs ? &self->programs[n] : NULL;
+}
@@ -0,0 +1,121 @@
+#ifndef PSI_H_INCLUDED
+#define PSI_H_INCLUDED
+
+#define PSI_PAT_PID 0x0000
+#define PSI_CAT_PID 0x0001
+#define PSI_NIT_PID 0x0010
+#define PSI_NULL_PID 0x1FFF
+
+#define PSI_PAT_TABLE_ID 0x00
+#define PSI_CAT_TABLE_ID 0x01
+#define PSI_PMT_TABLE_ID 0x02
+#define PSI_NIT_TABLE_ID 0x40		/* 自ネットワーク */
+
+#define PSI_MAX_SECTION_SIZE (3 + 1021)
+#define PSI_MAX_PROGRAMS 253		/* 1 セクションの PAT に載るプログラム数 */
+#define PSI_MAX_STREAMS 32
+#define PSI_MAX_EMM_PIDS 16
+
+#define PSI_UNKNOWN (-1)
+
+
+/* Section
+   -------------------------------------------------------------------------- */
+
+/**
+ * PID 一つ分のセクションの組み立て。
+ *
+ * 組み立て中のセクションを中に持つので、メモリを確保せずにパケットを積める。
+ */
+typedef struct PsiSection {
+	guint8 data[PSI_MAX_SECTION_SIZE];
+	guint len;					/* 組み立てたバイト数 */
+	guint section_len;			/* 組み立て中のセクションの長さ (ヘッダが揃うまで 0) */
+	gboolean is_started;
+	gint last_cc;
+	guint n_crc_errors;
+} PsiSection;
+
+/**
+ * CRC の一致した完全なセクションを受け取る関数。
+ */
+typedef void (*PsiSectionFunc)(const guint8 *section, guint len, gpointer user_data);
+
+guint32
+psi_crc32(const guint8 *data, guint len);
+
+void
+psi_section_reset(PsiSection *self);
+
+guint
+psi_section_push(PsiSection *self, const guint8 *packet, PsiSectionFunc func, gpointer user_data);
+
+
+/* Tables
+   -------------------------------------------------------------------------- */
+
+struct PsiTables;
+typedef struct PsiTables PsiTables;
+
+typedef struct PsiStream {
+	guint8 stream_type;
+	guint16 pid;
+	guint16 ecm_pid;			/* ES の CA_descriptor の CA_PID (なければ PSI_NULL_PID) */
+} PsiStream;
+
+/** PAT に載ったプログラムと、その PMT の内容 */
+typedef struct PsiProgram {
+	guint16 program_number;
+	guint16 pmt_pid;
+	gint version;				/* PMT の version_number (未受信なら PSI_UNKNOWN) */
+	guint16 pcr_pid;
+	guint16 ecm_pid;			/* プログラムの CA_descriptor の CA_PID (なければ PSI_NULL_PID) */
+	guint n_streams;
+	PsiStream streams[PSI_MAX_STREAMS];
+} PsiProgram;
+
+/** 受信したテーブルの概要 (未受信の値は PSI_UNKNOWN) */
+typedef struct PsiTablesStatus {
+	gint transport_stream_id;
+	gint network_id;
+	gint pat_version;
+	gint cat_version;
+	gint nit_version;
+	guint n_programs;
+	guint n_emm_pids;
+	guint16 emm_pids[PSI_MAX_EMM_PIDS];	/* CAT の CA_descriptor の CA_PID */
+	guint64 n_sections;			/* CRC の一致したセクション数 */
+	guint n_crc_errors;
+	guint n_updates;			/* テーブルが更新された回数 */
+} PsiTablesStatus;
+
+/**
+ * テーブルが新しいバージョンになった時に呼ばれる関数。
+ *
+ * @param table_id	PSI_*_TABLE_ID
+ * @param id	PAT は transport_stream_id、PMT は program_number、NIT は network_id、CAT は 0
+ */
+typedef void (*PsiTablesFunc)(PsiTables *tables, guint table_id, guint id, gpointer user_data);
+
+PsiTables *
+psi_tables_new(PsiTablesFunc func, gpointer user_data);
+
+void
+psi_tables_free(PsiTables *self);
+
+void
+psi_tables_reset(PsiTables *self);
+
+void
+psi_tables_push(PsiTables *self, const guint8 *packets, guint n_packets);
+
+void
+psi_tables_get_status(PsiTables *self, PsiTablesStatus *status);
+
+const PsiProgram *
+psi_tables_get_program(PsiTables *self, guint program_number);
+
+const PsiProgram *
+psi_tables_get_nth_program(PsiTables *self, guint n);
+
+#endif	/* PSI_H_INCLUDED */
@@ -0,0 +1,278 @@
+#include <string.h>
+#include <glib.h>
+
+#include "ts_demux.h"
+#include "psi.h"
+
+/*
+ * 一つの TS をサービスごとの TS に振り分ける。
+ *
+ * 各サービスの TS には、そのサービスだけを載せた PAT と、元の PMT・PCR・ES・ECM・SI を出力する。
+ * PMT はサービスごとに別の PID なので書き換えずにそのまま出力する。
+ * 振り分けたパケットはサービスごとのバッファに溜め、入力一回につき一度ずつ書き出す。
+ */
+
+#define TS_PACKET_SIZE 188
+#define SI_PID_MAX 0x001F			/* PAT 以外のこれ以下の PID は全てのサービスに出力する */
+#define BITMAP_WORDS (0x2000 / 32)
+#define BUFFER_PACKETS 348			/* サービスごとのバッファのパケット数 (約 64KB) */
+
+typedef struct {
+	guint service_id;
+	guint32 bitmap[BITMAP_WORDS];	/* 出力する PID */
+
+	guint8 pat[TS_PACKET_SIZE];	/* このサービスだけを載せた PAT のパケット */
+	gboolean has_pat;
+	guint pat_cc;
+
+	guint8 *buffer;
+	guint n_buffered;
+} TsDemuxService;
+
+struct TsDemux {
+	TsDemuxWriteFunc func;
+	gpointer user_data;
+
+	PsiTables *psi;
+	GPtrArray *services;
+};
+
+
+static inline gboolean
+bitmap_test(const guint32 *bitmap, guint pid)
+{
+	return (bitmap[pid >> 5] >> (pid & 31)) & 1;
+}
+
+static inline void
+bitmap_set(guint32 *bitmap, guint pid)
+{
+	bitmap[pid >> 5] |= 1U << (pid & 31);
+}
+
+/**
+ * サービスだけを載せた PAT のパケットを作る。
+ */
+static void
+ts_demux_build_pat(TsDemuxService *service, guint tsid, guint version, guint pmt_pid)
+{
+	guint8 *p = service->pat, *section;
+	guint32 crc;
+
+	memset(p, 0xFF, TS_PACKET_SIZE);
+	p[0] = 0x47;
+	p[1] = 0x40;				/* payload_unit_start_indicator, PID 0x0000 */
+	p[2] = 0x00;
+	p[3] = 0x10;				/* payload only */
+	p[4] = 0x00;				/* pointer_field */
+
+	section = p + 5;
+	section[0] = PSI_PAT_TABLE_ID;
+	section[1] = 0xB0;
+	section[2] = 5 + 4 * 2 + 4;
+	section[3] = tsid >> 8;
+	section[4] = tsid & 0xFF;
+	section[5] = 0xC1 | ((version & 0x1F) << 1);
+	section[6] = 0;
+	section[7] = 0;
+	/* network_PID */
+	section[8] = 0x00;
+	section[9] = 0x00;
+	section[10] = 0xE0 | (PSI_NIT_PID >> 8);
+	section[11] = PSI_NIT_PID & 0xFF;
+	/* program_map_PID */
+	section[12] = service->service_id >> 8;
+	section[13] = service->service_id & 0xFF;
+	section[14] = 0xE0 | (pmt_pid >> 8);
+	section[15] = pmt_pid & 0xFF;
+
+	crc = psi_crc32(section, 16);
+	section[16] = crc >> 24;
+	section[17] = (crc >> 16) & 0xFF;
+	section[18] = (crc >> 8) & 0xFF;
+	section[19] = crc & 0xFF;
+
+	service->has_pat = TRUE;
+}
+
+/**
+ * PAT・PMT からサービスの出力する PID と PAT を作り直す。
+ */
+static void
+ts_demux_rebuild(TsDemux *self, TsDemuxService *service)
+{
+	const PsiProgram *program;
+	PsiTablesStatus status;
+	guint pid, i;
+
+	memset(service->bitmap, 0, sizeof(service->bitmap));
+	for (pid = PSI_PAT_PID + 1; pid <= SI_PID_MAX; ++pid) {
+		bitmap_set(service->bitmap, pid);
+	}
+
+	program = psi_tables_get_program(self->psi, service->service_id);
+	if (!program) {
+		service->has_pat = FALSE;
+		return;
+	}
+
+	psi_tables_get_status(self->psi, &status);
+	ts_demux_build_pat(service, status.transport_stream_id, status.pat_version, program->pmt_pid);
+
+	bitmap_set(service->bitmap, program->pmt_pid);
+	if (program->version == PSI_UNKNOWN)
+		return;
+
+	bitmap_set(service->bitmap, program->pcr_pid);
+	bitmap_set(service->bitmap, program->ecm_pid);
+	for (i = 0; i < program->n_streams; ++i) {
+		bitmap_set(service->bitmap, program->streams[i].pid);
+		bitmap_set(service->bitmap, program->streams[i].ecm_pid);
+	}
+	/* 「なし」を表す PSI_NULL_PID が立っていても NULL パケットは出力しない */
+	service->bitmap[PSI_NULL_PID >> 5] &= ~(1U << (PSI_NULL_PID & 31));
+}
+
+static void
+ts_demux_psi_cb(PsiTables *tables, guint table_id, guint id, gpointer user_data)
+{
+	TsDemux *self = user_data;
+	guint i;
+
+	if (table_id != PSI_PAT_TABLE_ID && table_id != PSI_PMT_TABLE_ID)
+		return;
+
+	for (i = 0; i < self->services->len; ++i) {
+		TsDemuxService *service = g_ptr_array_index(self->services, i);
+		if (table_id == PSI_PAT_TABLE_ID || service->service_id == id) {
+			ts_demux_rebuild(self, service);
+		}
+	}
+}
+
+static void
+ts_demux_flush(TsDemux *self, guint index)
+{
+	TsDemuxService *service = g_ptr_array_index(self->services, index);
+
+	if (service->n_buffered == 0)
+		return;
+	self->func(index, service->buffer, service->n_buffered * TS_PACKET_SIZE, self->user_data);
+	service->n_buffered = 0;
+}
+
+static inline void
+ts_demux_append(TsDemux *self, guint index, const guint8 *packet)
+{
+	TsDemuxService *service = g_ptr_array_index(self->services, index);
+
+	memcpy(service->buffer + service->n_buffered * TS_PACKET_SIZE, packet, TS_PACKET_SIZE);
+	if (++service->n_buffered == BUFFER_PACKETS) {
+		ts_demux_flush(self, index);
+	}
+}
+
+
+/* Exposed functions
+   -------------------------------------------------------------------------- */
+
+/**
+ * 振り分け器を作る。
+ *
+ * @param func	サービスごとの TS を受け取る関数
+ */
+TsDemux *
+ts_demux_new(TsDemuxWriteFunc func, gpointer user_data)
+{
+	TsDemux *self;
+
+	g_assert(func);
+
+	self = g_new0(TsDemux, 1);
+	self->func = func;
+	self->user_data = user_data;
+	self->psi = psi_tables_new(ts_demux_psi_cb, self);
+	self->services = g_ptr_array_new();
+
+	return self;
+}
+
+void
+ts_demux_free(TsDemux *self)
+{
+	guint i;
+
+	if (!self)
+		return;
+
+	for (i = 0; i < self->services->len; ++i) {
+		TsDemuxService *service = g_ptr_array_index(self->services, i);
+		g_free(service->buffer);
+		g_free(service);
+	}
+	g_ptr_array_free(self->services, TRUE);
+	psi_tables_free(self->psi);
+	g_free(self);
+}
+
+/**
+ * 振り分け先のサービスを追加する。
+ *
+ * @param service_id	PAT の program_number
+ * @return 書き出し関数に渡される index
+ */
+guint
+ts_demux_add_service(TsDemux *self, guint service_id)
+{
+	TsDemuxService *service;
+
+	service = g_new0(TsDemuxService, 1);
+	service->service_id = service_id & 0xFFFF;
+	service->buffer = g_malloc(BUFFER_PACKETS * TS_PACKET_SIZE);
+	g_ptr_array_add(self->services, service);
+	ts_demux_rebuild(self, service);
+
+	return self->services->len - 1;
+}
+
+/**
+ * パケット境界に揃ったパケットを振り分ける。
+ */
+void
+ts_demux_push(TsDemux *self, const guint8 *packets, guint n_packets)
+{
+	const guint8 *packet, *end = packets + n_packets * TS_PACKET_SIZE;
+	guint i;
+
+	for (packet = packets; packet < end; packet += TS_PACKET_SIZE) {
+		guint pid = ((packet[1] & 0x1F) << 8) | packet[2];
+
+		/* PAT・PMT が更新されたら、このパケットから振り分けに使う */
+		psi_tables_push(self->psi, packet, 1);
+
+		if (pid == PSI_PAT_PID) {
+			/* 元の PAT の送出間隔に合わせて、書き換えた PAT を出力する */
+			if (!(packet[1] & 0x40))
+				continue;
+			for (i = 0; i < self->services->len; ++i) {
+				TsDemuxService *service = g_ptr_array_index(self->services, i);
+				if (!service->has_pat)
+					continue;
+				service->pat[3] = 0x10 | (service->pat_cc++ & 0x0F);
+				ts_demux_append(self, i, service->pat);
+			}
+			continue;
+		}
+
+		for (i = 0; i < self->services->len; ++i) {
+			TsDemuxService *service = g_ptr_array_index(self->services, i);
+			if (bitmap_test(service->bitmap, pid)) {
+				ts_demux_append(self, i, packet);
+			}
+		}
+	}
+
+	for (i = 0; i < self->services->len; ++i) {
+		ts_demux_flush(self, i);
+	}
+}
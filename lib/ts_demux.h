@@ -0,0 +1,27 @@
+#ifndef TS_DEMUX_H_INCLUDED
+#define TS_DEMUX_H_INCLUDED
+
+struct TsDemux;
+typedef struct TsDemux TsDemux;
+
+/**
+ * サービスごとに振り分けたパケットを受け取る関数。
+ *
+ * @param index	ts_demux_add_service() で追加した順番 (0 から)
+ * @param data	パケット境界に揃った TS (呼び出しの間だけ参照できる)
+ */
+typedef void (*TsDemuxWriteFunc)(guint index, const guint8 *data, guint len, gpointer user_data);
+
+TsDemux *
+ts_demux_new(TsDemuxWriteFunc func, gpointer user_data);
+
+void
+ts_demux_free(TsDemux *self);
+
+guint
+ts_demux_add_service(TsDemux *self, guint service_id);
+
+void
+ts_demux_push(TsDemux *self, const guint8 *packets, guint n_packets);
+
+#endif	/* TS_DEMUX_H_INCLUDED */
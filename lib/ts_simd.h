@@ -0,0 +1,65 @@
+#ifndef TS_SIMD_H_INCLUDED
+#define TS_SIMD_H_INCLUDED
+
+/*
+ * x86 の SIMD で TS を処理するモジュールが共有する部分。
+ *
+ * TS_SIMD_HAVE_X86 が定義されていれば、__attribute__((target(...))) の関数と
+ * __builtin_cpu_supports() で CPU ごとに実装を選べる。
+ * 関数は AVX2 の関数からだけ呼び、呼び出し元に展開させる。
+ */
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)) && \
+	(__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define TS_SIMD_HAVE_X86
+#include <immintrin.h>
+
+#define TS_SIMD_PACKET_SIZE 188
+
+/**
+ * 188 バイトおきに並んだ 8 パケットのヘッダを gather でまとめて読み、PID を取り出す。
+ *
+ * ヘッダの 4 バイトはリトルエンディアンで sync | b1 << 8 | b2 << 16 | b3 << 24 になる。
+ */
+__attribute__((target("avx2")))
+static inline __m256i
+ts_simd_gather_headers(const guint8 *packets, __m256i *pid)
+{
+	const __m256i offsets = _mm256_setr_epi32(0, TS_SIMD_PACKET_SIZE * 1, TS_SIMD_PACKET_SIZE * 2,
+											  TS_SIMD_PACKET_SIZE * 3, TS_SIMD_PACKET_SIZE * 4,
+											  TS_SIMD_PACKET_SIZE * 5, TS_SIMD_PACKET_SIZE * 6,
+											  TS_SIMD_PACKET_SIZE * 7);
+	__m256i header;
+
+	header = _mm256_i32gather_epi32((const int *)packets, offsets, 1);
+	*pid = _mm256_or_si256(_mm256_and_si256(header, _mm256_set1_epi32(0x1F00)),
+						   _mm256_and_si256(_mm256_srli_epi32(header, 16), _mm256_set1_epi32(0xFF)));
+	return header;
+}
+
+/**
+ * 8192 ビットのビットマップを PID で引き、ビットが立っているレーンの最上位ビットを立てて返す。
+ */
+__attribute__((target("avx2")))
+static inline __m256i
+ts_simd_test_bitmap(const guint32 *bitmap, __m256i pid)
+{
+	__m256i word, bit;
+
+	word = _mm256_i32gather_epi32((const int *)bitmap, _mm256_srli_epi32(pid, 5), 4);
+	bit = _mm256_srlv_epi32(word, _mm256_and_si256(pid, _mm256_set1_epi32(31)));
+	return _mm256_slli_epi32(bit, 31);
+}
+
+/**
+ * レーンの最上位ビットを、レーンごとに 1 ビットのマスクにする。
+ */
+__attribute__((target("avx2")))
+static inline guint
+ts_simd_movemask(__m256i lanes)
+{
+	return _mm256_movemask_ps(_mm256_castsi256_ps(lanes));
+}
+#endif
+
+#endif	/* TS_SIMD_H_INCLUDED */
@@ -0,0 +1,298 @@
+#include <string.h>
+#include <glib.h>
+
+#include "ts_sync.h"
+#include "ts_simd.h"
+
+/*
+ * 任意の境界で切られたバイトストリームから TS パケットの境界を見つけ、
+ * パケット単位に揃えて後段へ渡す。
+ *
+ * 同期が取れている間は入力のバッファをそのまま (コピーせずに) 渡し、
+ * バッファをまたぐパケットと、同期を取り直している途中のデータだけをコピーする。
+ */
+
+#define TS_PACKET_SIZE TS_SYNC_PACKET_SIZE
+#define TS_SYNC_BYTE 0x47
+#define TS_SYNC_CONFIRM 4			/* 同期バイトがこの数だけ 188 バイトおきに続けば同期とみなす */
+
+struct TsSync {
+	TsSyncPacketsFunc func;
+	gpointer user_data;
+
+	gboolean is_synced;
+	guint8 carry[TS_PACKET_SIZE];	/* 前の入力の末尾で途切れたパケット */
+	guint carry_len;
+	GByteArray *pending;		/* 同期を確かめるのにデータが足りなかった入力 */
+	GByteArray *spare;
+
+	/* 統計 (他のスレッドからは概算として読む) */
+	guint64 n_packets;
+	guint64 n_lost_bytes;
+	guint n_resyncs;
+	guint n_sync_losses;
+};
+
+typedef const guint8 *(*TsSyncFindFunc)(const guint8 *p, const guint8 *end);
+
+static TsSyncFindFunc st_find = NULL;
+static gsize st_is_find_initialized = 0;
+
+
+/* Sync byte search
+   -------------------------------------------------------------------------- */
+
+static const guint8 *
+ts_sync_find_scalar(const guint8 *p, const guint8 *end)
+{
+	const guint8 *q = memchr(p, TS_SYNC_BYTE, end - p);
+	return q ? q : end;
+}
+
+#ifdef TS_SIMD_HAVE_X86
+__attribute__((target("sse2")))
+static const guint8 *
+ts_sync_find_sse2(const guint8 *p, const guint8 *end)
+{
+	const __m128i sync = _mm_set1_epi8(TS_SYNC_BYTE);
+
+	for (; p + 16 <= end; p += 16) {
+		gint mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), sync));
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+	return ts_sync_find_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const guint8 *
+ts_sync_find_avx2(const guint8 *p, const guint8 *end)
+{
+	const __m256i sync = _mm256_set1_epi8(TS_SYNC_BYTE);
+
+	for (; p + 32 <= end; p += 32) {
+		guint mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), sync));
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+	return ts_sync_find_sse2(p, end);
+}
+#endif
+
+/**
+ * CPU に合わせて同期バイトの探索関数を選ぶ。
+ */
+static void
+ts_sync_init_find(void)
+{
+	if (g_once_init_enter(&st_is_find_initialized)) {
+		st_find = ts_sync_find_scalar;
+#ifdef TS_SIMD_HAVE_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			st_find = ts_sync_find_avx2;
+		} else if (__builtin_cpu_supports("sse2")) {
+			st_find = ts_sync_find_sse2;
+		}
+#endif
+		g_once_init_leave(&st_is_find_initialized, 1);
+	}
+}
+
+/**
+ * @a p から 188 バイトおきに同期バイトが続くか確かめる。
+ *
+ * @return 続けば 1、続かなければ 0、確かめるのにデータが足りなければ -1
+ */
+static gint
+ts_sync_confirm(const guint8 *p, const guint8 *end)
+{
+	guint i;
+
+	for (i = 1; i < TS_SYNC_CONFIRM; ++i) {
+		const guint8 *q = p + i * TS_PACKET_SIZE;
+		if (q >= end)
+			return -1;
+		if (*q != TS_SYNC_BYTE)
+			return 0;
+	}
+	return 1;
+}
+
+
+/* Framing
+   -------------------------------------------------------------------------- */
+
+static void
+ts_sync_emit(TsSync *self, guint8 *packets, guint n_packets, gpointer tag)
+{
+	self->n_packets += n_packets;
+	self->func(packets, n_packets, tag, self->user_data);
+}
+
+/**
+ * 入力を同期の状態に従って処理する。
+ *
+ * 同期を確かめきれなかった末尾は pending に残し、次の入力と合わせて処理する。
+ */
+static void
+ts_sync_process(TsSync *self, guint8 *data, guint len, gpointer tag)
+{
+	guint8 *p = data, *end = data + len;
+
+	/* 前の入力で途切れたパケットを完成させる */
+	if (self->carry_len > 0) {
+		guint n = MIN(TS_PACKET_SIZE - self->carry_len, len);
+
+		memcpy(self->carry + self->carry_len, p, n);
+		self->carry_len += n;
+		p += n;
+		if (self->carry_len < TS_PACKET_SIZE)
+			return;
+		self->carry_len = 0;
+		ts_sync_emit(self, self->carry, 1, NULL);
+	}
+
+	while (p < end) {
+		if (self->is_synced) {
+			guint8 *batch = p;
+
+			while (p + TS_PACKET_SIZE <= end && *p == TS_SYNC_BYTE) {
+				p += TS_PACKET_SIZE;
+			}
+			if (p > batch) {
+				ts_sync_emit(self, batch, (p - batch) / TS_PACKET_SIZE, tag);
+			}
+			if (p == end)
+				break;
+
+			if (*p == TS_SYNC_BYTE) {
+				/* 末尾の途切れたパケットは次の入力を待つ */
+				self->carry_len = end - p;
+				memcpy(self->carry, p, self->carry_len);
+				break;
+			}
+
+			g_debug("[ts_sync_process] lost sync");
+			self->is_synced = FALSE;
+			++self->n_sync_losses;
+		} else {
+			guint8 *q = p;
+			gint r = 0;
+
+			for (;;) {
+				q = (guint8 *)st_find(q, end);
+				if (q == end)
+					break;
+				r = ts_sync_confirm(q, end);
+				if (r != 0)
+					break;
+				++q;
+			}
+
+			self->n_lost_bytes += q - p;
+			p = q;
+			if (q == end)
+				break;
+
+			if (r < 0) {
+				g_byte_array_append(self->pending, q, end - q);
+				break;
+			}
+
+			if (self->n_sync_losses > 0) {
+				++self->n_resyncs;
+			}
+			self->is_synced = TRUE;
+		}
+	}
+}
+
+
+/* Exposed functions
+   -------------------------------------------------------------------------- */
+
+/**
+ * TS の同期器を作る。
+ *
+ * @param func	パケット境界に揃ったパケットの並びを受け取る関数
+ */
+TsSync *
+ts_sync_new(TsSyncPacketsFunc func, gpointer user_data)
+{
+	TsSync *self;
+
+	g_assert(func);
+
+	ts_sync_init_find();
+
+	self = g_new0(TsSync, 1);
+	self->func = func;
+	self->user_data = user_data;
+	self->pending = g_byte_array_new();
+	self->spare = g_byte_array_new();
+
+	return self;
+}
+
+void
+ts_sync_free(TsSync *self)
+{
+	if (!self)
+		return;
+
+	g_byte_array_free(self->pending, TRUE);
+	g_byte_array_free(self->spare, TRUE);
+	g_free(self);
+}
+
+/**
+ * 同期を捨て、途中のパケットを破棄する。
+ */
+void
+ts_sync_reset(TsSync *self)
+{
+	self->n_lost_bytes += self->carry_len + self->pending->len;
+	self->carry_len = 0;
+	g_byte_array_set_size(self->pending, 0);
+	if (self->is_synced) {
+		self->is_synced = FALSE;
+		++self->n_sync_losses;
+	}
+}
+
+/**
+ * バイトストリームを入力する。
+ *
+ * 揃ったパケットは呼び出しの中でコールバックに渡される。
+ * コールバックは @a data の中のパケットを書き換えることがある。
+ *
+ * @param tag	コールバックに渡す、@a data の持ち主を示す値
+ */
+void
+ts_sync_push(TsSync *self, guint8 *data, guint len, gpointer tag)
+{
+	GByteArray *buffer;
+
+	if (self->pending->len == 0) {
+		ts_sync_process(self, data, len, tag);
+		return;
+	}
+
+	/* 同期を確かめている途中なら、残りと合わせたコピーを処理する */
+	buffer = self->pending;
+	g_byte_array_append(buffer, data, len);
+	self->pending = self->spare;
+	ts_sync_process(self, buffer->data, buffer->len, NULL);
+	g_byte_array_set_size(buffer, 0);
+	self->spare = buffer;
+}
+
+void
+ts_sync_get_stats(TsSync *self, TsSyncStats *stats)
+{
+	stats->n_packets = self->n_packets;
+	stats->n_lost_bytes = self->n_lost_bytes;
+	stats->n_resyncs = self->n_resyncs;
+	stats->n_sync_losses = self->n_sync_losses;
+}
@@ -0,0 +1,41 @@
+#ifndef TS_SYNC_H_INCLUDED
+#define TS_SYNC_H_INCLUDED
+
+struct TsSync;
+typedef struct TsSync TsSync;
+
+#define TS_SYNC_PACKET_SIZE 188
+
+/** 同期の統計 */
+typedef struct TsSyncStats {
+	guint64 n_packets;			/* 出力したパケット数 */
+	guint64 n_lost_bytes;		/* 同期が取れずに捨てたバイト数 */
+	guint n_resyncs;			/* 同期を取り直した回数 */
+	guint n_sync_losses;		/* 同期を失った回数 */
+} TsSyncStats;
+
+/**
+ * パケット境界に揃ったパケットの並びを受け取る関数。
+ *
+ * @param packets	@a n_packets 個の連続したパケット (呼び出しの間だけ参照でき、書き換えてもよい)
+ * @param tag	パケットが ts_sync_push() に渡したデータの中にあれば、その時の @a tag 。
+ *				内部のバッファにコピーしたパケットであれば NULL
+ */
+typedef void (*TsSyncPacketsFunc)(guint8 *packets, guint n_packets, gpointer tag, gpointer user_data);
+
+TsSync *
+ts_sync_new(TsSyncPacketsFunc func, gpointer user_data);
+
+void
+ts_sync_free(TsSync *self);
+
+void
+ts_sync_reset(TsSync *self);
+
+void
+ts_sync_push(TsSync *self, guint8 *data, guint len, gpointer tag);
+
+void
+ts_sync_get_stats(TsSync *self, TsSyncStats *stats);
+
+#endif	/* TS_SYNC_H_INCLUDED */
@@ -0,0 +1,160 @@
+#include <string.h>
+#include <glib.h>
+
+#include "tuner_lock.h"
+#include "psi.h"
+
+/*
+ * チャンネル切り替え後の TS から PAT を拾い、
+ * 切り替え前と異なる transport_stream_id が安定して現われたらロックしたとみなす。
+ * リモコンのキーを送り終えた後は、同じ transport_stream_id でも改めて安定すればロックしたとみなす
+ * (同じチャンネルへの切り替え)。
+ */
+
+#define TS_PACKET_SIZE 188
+
+struct TunerLock {
+	PsiSection pat;				/* 組み立て中の PAT セクション */
+
+	gint old_tsid;				/* 切り替え前の transport_stream_id */
+	gint tsid;					/* 安定して現われている transport_stream_id */
+	gint version;
+	guint n_stable;				/* 同じ PAT が続いた数 */
+	guint n_required;			/* ロックとみなすのに必要な数 */
+	gboolean is_keys_sent;		/* キーを送り終えた */
+	gboolean is_locked;
+};
+
+static void
+tuner_lock_proc_pat(const guint8 *section, guint len, gpointer user_data)
+{
+	TunerLock *self = user_data;
+	gint tsid, version;
+
+	if (section[0] != PSI_PAT_TABLE_ID || !(section[5] & 0x01))
+		return;					/* current_next_indicator が 0 のものは使わない */
+
+	tsid = (section[3] << 8) | section[4];
+	version = (section[5] >> 1) & 0x1F;
+
+	if (self->n_stable > 0 && tsid == self->tsid && version == self->version) {
+		++self->n_stable;
+	} else {
+		g_debug("[tuner_lock_proc_pat] transport_stream_id=0x%04x version=%d", tsid, version);
+		self->tsid = tsid;
+		self->version = version;
+		self->n_stable = 1;
+	}
+
+	if (self->n_stable >= self->n_required && (tsid != self->old_tsid || self->is_keys_sent)) {
+		self->is_locked = TRUE;
+	}
+}
+
+static void
+tuner_lock_proc_packet(TunerLock *self, const guint8 *packet)
+{
+	guint pid, n_crc_errors;
+
+	pid = ((packet[1] & 0x1F) << 8) | packet[2];
+	if (pid != PSI_PAT_PID)
+		return;
+
+	n_crc_errors = self->pat.n_crc_errors;
+	psi_section_push(&self->pat, packet, tuner_lock_proc_pat, self);
+	if (self->pat.n_crc_errors != n_crc_errors) {
+		g_debug("[tuner_lock_proc_packet] CRC error");
+		self->n_stable = 0;
+	}
+}
+
+/**
+ * ロック検出器を作る。
+ *
+ * @param[in]	old_tsid	切り替え前の transport_stream_id. 分からなければ TUNER_LOCK_UNKNOWN_TSID
+ * @param[in]	n_stable	同じ PAT がこの数だけ続いたらロックしたとみなす
+ */
+TunerLock *
+tuner_lock_new(gint old_tsid, guint n_stable)
+{
+	TunerLock *self = g_new0(TunerLock, 1);
+
+	self->n_required = MAX(n_stable, 1);
+	tuner_lock_reset(self, old_tsid);
+
+	return self;
+}
+
+void
+tuner_lock_free(TunerLock *self)
+{
+	if (!self)
+		return;
+
+	g_free(self);
+}
+
+/**
+ * チャンネルを切り替えるたびに呼び、検出をやり直す。
+ */
+void
+tuner_lock_reset(TunerLock *self, gint old_tsid)
+{
+	psi_section_reset(&self->pat);
+	self->old_tsid = old_tsid;
+	self->tsid = TUNER_LOCK_UNKNOWN_TSID;
+	self->version = -1;
+	self->n_stable = 0;
+	self->is_keys_sent = FALSE;
+	self->is_locked = FALSE;
+}
+
+/**
+ * チャンネルを切り替えるキーを送り終えたことを知らせる。
+ *
+ * これ以降に安定した PAT は、切り替え前と同じ transport_stream_id でもロックとみなす。
+ * 送り終える前に数えた PAT は数え直す。
+ */
+void
+tuner_lock_set_keys_sent(TunerLock *self)
+{
+	if (self->is_locked)
+		return;
+
+	self->is_keys_sent = TRUE;
+	self->n_stable = 0;
+}
+
+/**
+ * パケット境界に揃った TS を解析する。
+ *
+ * @return ロックしていれば TRUE
+ */
+gboolean
+tuner_lock_push(TunerLock *self, const guint8 *packets, guint n_packets)
+{
+	guint i;
+
+	for (i = 0; i < n_packets && !self->is_locked; ++i) {
+		tuner_lock_proc_packet(self, packets + i * TS_PACKET_SIZE);
+	}
+
+	return self->is_locked;
+}
+
+gboolean
+tuner_lock_is_locked(TunerLock *self)
+{
+	return self->is_locked;
+}
+
+/**
+ * 安定して現われている transport_stream_id を返す。
+ *
+ * まだ安定していなければ TUNER_LOCK_UNKNOWN_TSID を返す。
+ */
+gint
+tuner_lock_get_tsid(TunerLock *self)
+{
+	return self->n_stable >= self->n_required ? self->tsid : TUNER_LOCK_UNKNOWN_TSID;
+}
@@ -0,0 +1,30 @@
+#ifndef TUNER_LOCK_H_INCLUDED
+#define TUNER_LOCK_H_INCLUDED
+
+struct TunerLock;
+typedef struct TunerLock TunerLock;
+
+#define TUNER_LOCK_UNKNOWN_TSID (-1)
+
+TunerLock *
+tuner_lock_new(gint old_tsid, guint n_stable);
+
+void
+tuner_lock_free(TunerLock *self);
+
+void
+tuner_lock_reset(TunerLock *self, gint old_tsid);
+
+void
+tuner_lock_set_keys_sent(TunerLock *self);
+
+gboolean
+tuner_lock_push(TunerLock *self, const guint8 *packets, guint n_packets);
+
+gboolean
+tuner_lock_is_locked(TunerLock *self);
+
+gint
+tuner_lock_get_tsid(TunerLock *self);
+
+#endif	/* TUNER_LOCK_H_INCLUDED */
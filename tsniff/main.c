@@ -10,6 +10,14 @@
 #include "b_cas_card.h"
 #include "pseudo_bcas.h"
 #include "bcas_stream.h"
+#include "tuner_lock.h"
+#include "ts_sync.h"
+#include "pid_filter.h"
+#include "psi.h"
+#include "ts_demux.h"
+#include "pid_stats.h"
+#include "pcr_tracker.h"
+#include "parallel_b25.h"
 
 
 #define INPUT_TYPE_FX2_PREFIX "fx2:"
@@ -25,36 +33,70 @@ static gint st_bcas_input_type;
 //#define OPTION_FLAG_DEBUG G_OPTION_FLAG_HIDDEN
 #define OPTION_FLAG_DEBUG 0
 
-static gint st_fx2_id = 0;		/* CUSBFX2のID */
+static gchar *st_fx2_id = NULL;	/* CUSBFX2のID(カンマ区切りで複数) */
 static gboolean st_fx2_is_force_load = FALSE; /* CUSBFX2のファームウェアを強制的にロードする */
+static gboolean st_fx2_is_verify_firmware = FALSE; /* ロードしたファームウェアを読み戻して確かめる */
 static gint st_fx2_ts_buffer_size = 16384;
 static gint st_fx2_ts_buffer_count = 16;
+static gint st_fx2_ts_ring_size = 256;
+static gboolean st_fx2_ts_auto_tune = FALSE;
+static gint st_fx2_ts_max_buffer_count = 64;
+static gint st_fx2_ts_watchdog = 0;
+static gboolean st_fx2_event_thread = FALSE;
+static gint st_fx2_event_thread_priority = 0;
+static gint st_fx2_event_thread_cpu = -1;
 static GOptionEntry st_fx2_options[] = {
-	{ "fx2-id", 0, 0, G_OPTION_ARG_INT, &st_fx2_id,
-	  "Find CUSBFX2 it has ID N [0]", "N" },
+	{ "fx2-id", 0, 0, G_OPTION_ARG_STRING, &st_fx2_id,
+	  "Find CUSBFX2 it has ID N, or capture from each of N,N,... [0]", "N[,N...]" },
 	{ "fx2-force-load", 0, 0, G_OPTION_ARG_NONE, &st_fx2_is_force_load,
 	  "Force load the firmware [disabled]", NULL },
+	{ "fx2-verify-firmware", 0, 0, G_OPTION_ARG_NONE, &st_fx2_is_verify_firmware,
+	  "Read back and verify the firmware after loading [disabled]", NULL },
 	{ "fx2-ts-buffer-size", 0, 0, G_OPTION_ARG_INT, &st_fx2_ts_buffer_size,
 	  "Set TS transfer buffer size to N bytes [16384]", "N" },
 	{ "fx2-ts-buffer-count", 0, 0, G_OPTION_ARG_INT, &st_fx2_ts_buffer_count,
 	  "Set TS transfer buffer count to N [16]", "N" },
+	{ "fx2-ts-ring-size", 0, 0, G_OPTION_ARG_INT, &st_fx2_ts_ring_size,
+	  "Set TS transfer ring to N buffers shared with B25 decoder [256]", "N" },
+	{ "fx2-ts-auto-tune", 0, 0, G_OPTION_ARG_NONE, &st_fx2_ts_auto_tune,
+	  "Auto-tune TS transfer size and count, and release idle ring buffers [disabled]", NULL },
+	{ "fx2-ts-max-buffer-count", 0, 0, G_OPTION_ARG_INT, &st_fx2_ts_max_buffer_count,
+	  "Let auto-tune raise TS transfer buffer count up to N [64]", "N" },
+	{ "fx2-ts-watchdog", 0, 0, G_OPTION_ARG_INT, &st_fx2_ts_watchdog,
+	  "Recover TS transfer stalled for N msec at least (0:disabled) [0]", "N" },
+	{ "fx2-event-thread", 0, 0, G_OPTION_ARG_NONE, &st_fx2_event_thread,
+	  "Handle USB events on a dedicated thread [disabled]", NULL },
+	{ "fx2-event-thread-priority", 0, 0, G_OPTION_ARG_INT, &st_fx2_event_thread_priority,
+	  "Run USB event thread with SCHED_FIFO priority N (0:normal) [0]", "N" },
+	{ "fx2-event-thread-cpu", 0, 0, G_OPTION_ARG_INT, &st_fx2_event_thread_cpu,
+	  "Pin USB event thread to CPU N (-1:any) [-1]", "N" },
 	{ NULL }
 };
 
 static gint st_ir_base = 0;
-static gint st_ir_source = -1;
+static gchar *st_ir_source = NULL;
 static gchar *st_ir_channel = NULL;
+static gboolean st_ir_lock_detect = FALSE;
+static gint st_ir_lock_timeout = 5;
+static gboolean st_ir_macro = FALSE;
 static GOptionEntry st_ir_options[] = {
 	{ "ir-base", 0, 0, G_OPTION_ARG_INT, &st_ir_base,
 	  "Set IR base channel to N (1..3) [1]", "N" },
-	{ "ir-source", 's', 0, G_OPTION_ARG_INT, &st_ir_source,
-	  "Set tuner source to N (0:Terestrial 1:BS 2:CS)", "N" },
+	{ "ir-source", 's', 0, G_OPTION_ARG_STRING, &st_ir_source,
+	  "Set tuner source to N (0:Terestrial 1:BS 2:CS), or N,N,... for each CUSBFX2", "N[,N...]" },
 	{ "ir-channel", 'c', 0, G_OPTION_ARG_STRING, &st_ir_channel,
-	  "Set tuner channel to C (1..12 or 000...999)", "C" },
+	  "Set tuner channel to C (1..12 or 000...999), or C,C,... for each CUSBFX2", "C[,C...]" },
+	{ "ir-lock-detect", 0, 0, G_OPTION_ARG_NONE, &st_ir_lock_detect,
+	  "Start TS transfer immediately and wait for a stable PAT of the new channel [disabled]", NULL },
+	{ "ir-lock-timeout", 0, 0, G_OPTION_ARG_INT, &st_ir_lock_timeout,
+	  "Give up waiting for the new channel after N seconds [5]", "N" },
+	{ "ir-macro", 0, 0, G_OPTION_ARG_NONE, &st_ir_macro,
+	  "Send IR keys as one waveform played by the device [disabled]", NULL },
 	{ NULL }
 };
 
 static gint st_b25_round = 4;
+static gint st_b25_threads = 0;
 static gboolean st_b25_strip = FALSE;
 static gdouble st_b25_ts_delay = 0.5;
 static gchar *st_b25_ts_delay_string = NULL;
@@ -64,6 +106,8 @@ static gchar *st_b25_init_cbc = NULL;
 static GOptionEntry st_b25_options[] = {
 	{ "b25-round", 0, 0, G_OPTION_ARG_INT, &st_b25_round,
 	  "Set MULTI-2 round factor to N [4]", "N" },
+	{ "b25-threads", 0, 0, G_OPTION_ARG_INT, &st_b25_threads,
+	  "Descramble MULTI-2 with N threads instead of the ARIB STD-B25 library [0]", "N" },
 	{ "b25-strip", 'S', 0, G_OPTION_ARG_NONE, &st_b25_strip,
 	  "Discard NULL packets from output [disabled]", NULL },
 	{ "b25-ts-delay", 0, 0, G_OPTION_ARG_STRING, &st_b25_ts_delay_string,
@@ -82,6 +126,9 @@ static gchar *st_bcas_input = INPUT_TYPE_FX2_PREFIX;
 static gchar *st_ts_output = NULL;
 static gchar *st_bcas_output = NULL;
 static gchar *st_b25_output = NULL;
+static gchar *st_ts_service = NULL;
+static gchar *st_ts_stats = NULL;
+static gboolean st_ts_strip_null = FALSE;
 static gint st_length = -1;
 static gboolean st_is_verbose = FALSE;
 static gboolean st_is_quiet = FALSE;
@@ -94,11 +141,17 @@ static GOptionEntry st_main_options[] = {
 	  "Input B-CAS from SOURCE ("INPUT_TYPE_FX2_PREFIX" or "INPUT_TYPE_PCSC_PREFIX" or FILENAME) ["INPUT_TYPE_FX2_PREFIX"]", "SOURCE" },
 
 	{ "ts-output", 't', 0, G_OPTION_ARG_FILENAME, &st_ts_output,
-	  "Output raw MPEG2-TS to FILENAME", "FILENAME" },
+	  "Output raw MPEG2-TS to FILENAME (%d is replaced with CUSBFX2 ID)", "FILENAME" },
 	{ "bcas-output", 'b', 0, G_OPTION_ARG_FILENAME, &st_bcas_output,
-	  "Output B-CAS to FILENAME", "FILENAME" },
+	  "Output B-CAS to FILENAME (%d is replaced with CUSBFX2 ID)", "FILENAME" },
 	{ "b25-output", 'o', 0, G_OPTION_ARG_FILENAME, &st_b25_output,
-	  "Enable ARIB STD-B25 decoder and output to FILENAME", "FILENAME" },
+	  "Enable ARIB STD-B25 decoder and output to FILENAME (%d is replaced with CUSBFX2 ID)", "FILENAME" },
+	{ "ts-service", 0, 0, G_OPTION_ARG_STRING, &st_ts_service,
+	  "Output only the service SID, or SID,SID,... [all]", "SID[,SID...]" },
+	{ "ts-strip-null", 0, 0, G_OPTION_ARG_NONE, &st_ts_strip_null,
+	  "Discard NULL packets before all outputs and the B25 time-shift queue [disabled]", NULL },
+	{ "ts-stats", 0, 0, G_OPTION_ARG_FILENAME, &st_ts_stats,
+	  "Write per-PID reception counters to FILENAME every second (%d is replaced with CUSBFX2 ID)", "FILENAME" },
 
 	{ "length", 'l', 0, G_OPTION_ARG_INT, &st_length,
 	  "Stop sniffing when N seconds passed, if input was CUSBFX2 [infinite]", "N" },
@@ -118,19 +171,16 @@ static GOptionEntry st_main_options[] = {
 
 static gboolean st_is_intterupted = FALSE;
 static gboolean st_is_use_cusbfx2 = FALSE;
-static ARIB_STD_B25 *st_b25 = NULL;
-static B_CAS_CARD *st_bcas = NULL;
 static GIOChannel *st_ts_input_io = NULL;
 static GIOChannel *st_bcas_input_io = NULL;
-static GIOChannel *st_ts_output_io = NULL;
-static GIOChannel *st_bcas_output_io = NULL;
-static GIOChannel *st_b25_output_io = NULL;
 
 /* TS Time-shift buffer
    -------------------------------------------------------------------------- */
 typedef struct {
 	GTimeVal arrived_time;
 	gsize size;
+	guint8 *data;
+	cusbfx2_buffer *buffer;		/* NULL ならデータはチャンクの直後に続く */
 	/* guint8 data[size]; */
 } B25Chunk;
 
@@ -138,6 +188,109 @@ static GQueue *st_b25_queue = NULL;
 static gsize st_b25_queue_size = 0;
 #define MAX_B25_QUEUE_SIZE (128*1024*1024)
 
+/* サービスごとの出力 */
+#define DEMUX_OUTPUT_TAG "%s"		/* 出力ファイル名のうちサービス ID に置き換える部分 */
+#define DEMUX_OUTPUT_BUFFER_SIZE (256 * 1024)
+
+/* --ts-stats の書き出し間隔 (秒) */
+#define PID_STATS_INTERVAL 1.0
+
+/* イベントスレッド使用時のステータス更新間隔 */
+#define STATUS_INTERVAL (100 * 1000)
+
+/* TS 転送のストールからの復旧 */
+#define STALL_MAX_RECOVERY 5		/* データが届かないまま続けて復旧を試みる最大回数 */
+#define STALL_REOPEN_INTERVAL (1000 * 1000)	/* 開き直せなかった後、再び試みるまでの時間 (usec) */
+#define GAP_MARKER_TAG "TSNIFF-GAP"	/* 欠落の印の NULL パケットのペイロードの先頭 */
+
+/* チャンネル切り替えの完了検出 */
+#define TUNER_LOCK_STABLE_PATS 3	/* 同じ PAT がこの数だけ続いたら完了 */
+#define TUNER_LOCK_PROBE_TIME 1.0	/* 切り替え前の transport_stream_id を調べる最大秒数 */
+
+/* Sniffer
+   -------------------------------------------------------------------------- */
+/**
+ * CUSBFX2 一台分のキャプチャ状態。
+ *
+ * 転送・出力・B25 デコーダとそのスレッドを CUSBFX2 ごとに持ち、
+ * USB のイベント処理だけを全台で共有する。
+ */
+typedef struct Sniffer {
+	gint fx2_id;
+	gint ir_source;
+	const gchar *ir_channel;
+
+	CapSts *capsts;
+	TsSync *ts_sync;			/* 入力の TS をパケット境界に揃える */
+	PsiTables *psi;				/* 入力の TS の PAT・PMT・CAT・NIT */
+	PidStats *pid_stats;		/* 入力の TS の PID ごとの受信品質 */
+	PcrTracker *pcr_tracker;	/* 入力の TS のビットレートと到着時刻のゆらぎ */
+	gchar *pid_stats_path;		/* --ts-stats */
+	gdouble pid_stats_time;		/* 最後に書き出した時刻 */
+	PidFilter *pid_filter;		/* --ts-service, --ts-strip-null */
+	cusbfx2_transfer *transfer_ts;
+	cusbfx2_transfer *transfer_bcas;
+
+	GIOChannel *ts_output_io;
+	GIOChannel *bcas_output_io;
+	GIOChannel *b25_output_io;
+
+	/* 出力ファイル名に DEMUX_OUTPUT_TAG があれば、--ts-service のサービスごとに出力する */
+	TsDemux *ts_demux;
+	GIOChannel **ts_demux_ios;
+	TsSync *b25_sync;			/* B25 デコーダの出力をパケット境界に揃える */
+	TsDemux *b25_demux;
+	GIOChannel **b25_demux_ios;
+
+	ARIB_STD_B25 *b25;
+	B_CAS_CARD *bcas;
+	gboolean is_b25_in_place;	/* --b25-threads の復号器で、キューのデータをその場で復号する */
+	ParallelB25Range *b25_ranges;
+	guint b25_max_ranges;
+	GThread *b25_thread;
+	volatile gboolean is_b25_running;
+	GAsyncQueue *b25_async_queue;
+
+	gdouble ts_disposed_time;
+
+	/* --ir-lock-detect */
+	TunerLock *tuner_lock;
+	GMutex *tuner_lock_mutex;
+	volatile gint is_tuner_locked;	/* FALSE の間は TS を出力しない */
+	GTimer *switch_timer;
+
+	/* TS 転送のストールからの復旧 */
+	guint n_stalls;
+	gint recovery_level;		/* データが届かないまま続けて復旧を試みた回数 */
+	gboolean is_reopen_pending;	/* 開き直せなかったので、ストールの通知を待たずに再び試みる */
+	gint64 reopen_time;			/* 次に開き直しを試みる時刻 (usec) */
+	gboolean is_failed;			/* 復旧をあきらめた */
+	volatile gint is_gap_pending;	/* 次に届いたデータの前に欠落の印を出力する */
+	gint64 gap_start;			/* データが途切れた時刻 (usec) */
+	gdouble gap_bytes_per_sec;	/* 途切れる前の受信レート */
+	cusbfx2_stall_reason gap_reason;
+} Sniffer;
+
+/* イベントスレッドからメインループへ渡すストールの通知 */
+typedef struct {
+	Sniffer *sniffer;
+	cusbfx2_transfer *transfer;
+	cusbfx2_stall_info info;
+	gint64 time;
+} StallEvent;
+
+static GAsyncQueue *st_stall_queue = NULL;
+
+static const gchar *st_stall_reason_names[] = {
+	"silent", "timeout", "halt", "error", "no-device"
+};
+
+static GArray *st_fx2_ids = NULL;	/* 使用する CUSBFX2 の ID */
+static GArray *st_ts_service_ids = NULL;	/* 出力するサービスの ID (空なら全て) */
+static Sniffer *st_sniffers = NULL;
+static guint st_n_sniffers = 0;
+static gboolean st_is_capture_failed = FALSE;	/* 復旧をあきらめた CUSBFX2 がある */
+
 /* Signal handler
    -------------------------------------------------------------------------- */
 static guint st_installed_sighandler = 0;
@@ -176,38 +329,76 @@ restore_sighandler(void)
 
 /* Threads
    -------------------------------------------------------------------------- */
-static GThread *st_b25_thread = NULL;
-static gboolean st_is_b25_running = TRUE;
-static GAsyncQueue *st_b25_async_queue = NULL;
+/**
+ * デコード済み TS を出力する。サービスごとに出力する場合は振り分け器へ流す。
+ */
+static void
+write_b25_output(Sniffer *sniffer, guint8 *data, gsize length)
+{
+	GError *error = NULL;
+	gsize written;
+
+	if (sniffer->b25_demux) {
+		ts_sync_push(sniffer->b25_sync, data, length, NULL);
+		return;
+	}
+
+	g_io_channel_write_chars(sniffer->b25_output_io, (gchar *)data, length, &written, &error);
+	if (error) {
+		g_warning("[write_b25_output] %s", error->message);
+		g_clear_error(&error);
+	}
+}
 
 static void
-proc_b25(gpointer data, gsize length)
+proc_b25(Sniffer *sniffer, gpointer data, gsize length)
 {
+	ARIB_STD_B25 *b25 = sniffer->b25;
 	ARIB_STD_B25_BUFFER buffer;
 	gint r;
 
 	buffer.size = length;
 	buffer.data = data;
-	r = st_b25->put(st_b25, &buffer);
+	r = b25->put(b25, &buffer);
 	if (r < 0) {
 		g_warning("!!! ARIB_STD_B25::put failed (%d)", r);
 	}
 
-	r = st_b25->get(st_b25, &buffer);
+	r = b25->get(b25, &buffer);
 	if (r < 0) {
 		g_warning("!!! ARIB_STD_B25::get failed (%d)", r);
 	} else if (buffer.size > 0) {
-		GError *error = NULL;
-		gsize written;
-		g_io_channel_write_chars(st_b25_output_io, (gchar *)buffer.data, buffer.size, &written, &error);
-		if (error) {
-			g_warning("[proc_b25] %s", error->message);
-			g_clear_error(&error);
-		}
+		write_b25_output(sniffer, buffer.data, buffer.size);
+	}
+}
+
+/**
+ * パケット境界に揃ったデータをその場で復号し、出力する範囲だけを書き出す。
+ */
+static void
+proc_b25_in_place(Sniffer *sniffer, guint8 *data, gsize length)
+{
+	PARALLEL_ARIB_STD_B25 *b25 = (PARALLEL_ARIB_STD_B25 *)sniffer->b25;
+	guint n_packets = length / TS_SYNC_PACKET_SIZE;
+	guint max_ranges = PARALLEL_B25_MAX_RANGES(n_packets);
+	gint n_ranges, i;
+
+	if (max_ranges > sniffer->b25_max_ranges) {
+		sniffer->b25_ranges = g_renew(ParallelB25Range, sniffer->b25_ranges, max_ranges);
+		sniffer->b25_max_ranges = max_ranges;
+	}
+
+	n_ranges = b25->descramble(b25, data, n_packets, sniffer->b25_ranges);
+	if (n_ranges < 0) {
+		g_warning("!!! PARALLEL_ARIB_STD_B25::descramble failed (%d)", n_ranges);
+		return;
+	}
+	for (i = 0; i < n_ranges; ++i) {
+		write_b25_output(sniffer, sniffer->b25_ranges[i].data, sniffer->b25_ranges[i].size);
 	}
 }
 
-static void proc_b25_chunk(B25Chunk *chunk)
+static void proc_b25_chunk(Sniffer *sniffer, B25Chunk *chunk)
 {
 	GTimeVal now;
 	gdouble diff;
@@ -220,21 +411,33 @@ static void proc_b25_chunk(B25Chunk *chunk)
 		g_usleep(st_b25_ts_delay * G_USEC_PER_SEC);
 	}
 
-	proc_b25(chunk + 1, chunk->size);
+	if (sniffer->is_b25_in_place) {
+		proc_b25_in_place(sniffer, chunk->data, chunk->size);
+	} else {
+		proc_b25(sniffer, chunk->data, chunk->size);
+	}
 
-	g_slice_free1(sizeof(B25Chunk) + chunk->size, chunk);
+	if (chunk->buffer) {
+#ifdef HAVE_LIBUSB
+		cusbfx2_buffer_unref(chunk->buffer);
+#endif
+		g_slice_free(B25Chunk, chunk);
+	} else {
+		g_slice_free1(sizeof(B25Chunk) + chunk->size, chunk);
+	}
 }
 
 static gpointer
 b25_thread(gpointer data)
 {
+	Sniffer *sniffer = data;
 	B25Chunk *chunk;
 
-	g_async_queue_ref(st_b25_async_queue);
+	g_async_queue_ref(sniffer->b25_async_queue);
 
-	while (st_is_b25_running) {
-		while ((chunk = g_async_queue_try_pop(st_b25_async_queue))) {
-			proc_b25_chunk(chunk);
+	while (sniffer->is_b25_running) {
+		while ((chunk = g_async_queue_try_pop(sniffer->b25_async_queue))) {
+			proc_b25_chunk(sniffer, chunk);
 		}
 
 		if (!chunk) {
@@ -243,11 +446,11 @@ b25_thread(gpointer data)
 		}
 	}
 
-	while ((chunk = g_async_queue_try_pop(st_b25_async_queue))) {
-		proc_b25_chunk(chunk);
+	while ((chunk = g_async_queue_try_pop(sniffer->b25_async_queue))) {
+		proc_b25_chunk(sniffer, chunk);
 	}
 
-	g_async_queue_unref(st_b25_async_queue);
+	g_async_queue_unref(sniffer->b25_async_queue);
 
 	return NULL;
 }
@@ -255,215 +458,1054 @@ b25_thread(gpointer data)
 
 /* Callbacks
    -------------------------------------------------------------------------- */
+
+/**
+ * TS を出力とB25デコーダのキューへ流す。
+ *
+ * @a buffer が NULL でなければ、キューにはコピーせずにバッファの参照を積む。
+ */
 static gboolean
-transfer_ts_cb(gpointer data, gint length, gpointer user_data)
+push_ts(Sniffer *sniffer, guint8 *data, gint length, cusbfx2_buffer *buffer);
+
+static gint64
+get_current_usec(void)
+{
+	GTimeVal now;
+	g_get_current_time(&now);
+	return (gint64)now.tv_sec * G_USEC_PER_SEC + now.tv_usec;
+}
+
+/**
+ * 転送が途切れていた時間と失われたであろうバイト数を、NULL パケットに書いて出力に挟む。
+ *
+ * ペイロードは GAP_MARKER_TAG で始まる一行のテキストで、残りは 0xFF で埋める。
+ */
+static void
+push_gap_marker(Sniffer *sniffer)
+{
+	guint8 packet[188];
+	gint64 gap;
+	guint64 lost;
+	gchar *text;
+
+	gap = get_current_usec() - sniffer->gap_start;
+	lost = (guint64)(gap * sniffer->gap_bytes_per_sec / G_USEC_PER_SEC);
+	g_message("*** TS resumed (fx2-id=%d) after %.3f seconds, about %"G_GUINT64_FORMAT" bytes lost",
+			  sniffer->fx2_id, (gdouble)gap / G_USEC_PER_SEC, lost);
+
+	text = g_strdup_printf(GAP_MARKER_TAG" usec=%"G_GINT64_FORMAT" bytes=%"G_GUINT64_FORMAT" reason=%s\n",
+						   gap, lost, st_stall_reason_names[sniffer->gap_reason]);
+	memset(packet, 0xFF, sizeof(packet));
+	packet[0] = 0x47;
+	packet[1] = 0x1F;			/* PID 0x1FFF */
+	packet[2] = 0xFF;
+	packet[3] = 0x10;			/* payload only */
+	memcpy(packet + 4, text, MIN(strlen(text), sizeof(packet) - 4));
+	g_free(text);
+
+	push_ts(sniffer, packet, sizeof(packet), NULL);
+}
+
+static gboolean
+push_ts(Sniffer *sniffer, guint8 *data, gint length, cusbfx2_buffer *buffer)
 {
 	GError *error = NULL;
 	gsize written;
 
-	if (st_ts_output_io) {
-		g_io_channel_write_chars(st_ts_output_io, data, length, &written, &error);
+	/* ストールから復旧して最初のデータなら、欠落の印を先に出力する */
+	if (g_atomic_int_get(&sniffer->is_gap_pending)) {
+		g_atomic_int_set(&sniffer->is_gap_pending, FALSE);
+		if (g_atomic_int_get(&sniffer->is_tuner_locked)) {
+			push_gap_marker(sniffer);
+		}
+	}
+
+	/* チャンネルの切り替えが完了するまでは、ロックの検出にだけ使う */
+	if (!g_atomic_int_get(&sniffer->is_tuner_locked)) {
+		g_mutex_lock(sniffer->tuner_lock_mutex);
+		tuner_lock_push(sniffer->tuner_lock, data, length / TS_SYNC_PACKET_SIZE);
+		g_mutex_unlock(sniffer->tuner_lock_mutex);
+		return !st_is_intterupted;
+	}
+
+	if (sniffer->ts_output_io) {
+		g_io_channel_write_chars(sniffer->ts_output_io, data, length, &written, &error);
 		if (error) {
 			g_warning("[transfer_ts_callback] %s", error->message);
 			g_clear_error(&error);
 		}
+	} else if (sniffer->ts_demux) {
+		ts_demux_push(sniffer->ts_demux, data, length / TS_SYNC_PACKET_SIZE);
 	}
 
-	if (st_b25_output_io) {
+	if (sniffer->b25) {
 		GTimeVal now;
 		B25Chunk *chunk;
 			
 		if (st_bcas_input_type == INPUT_TYPE_FX2) {
 			PseudoBCASStatus status;
-			((PSEUDO_B_CAS_CARD *)st_bcas)->get_status(st_bcas, &status);
+			((PSEUDO_B_CAS_CARD *)sniffer->bcas)->get_status(sniffer->bcas, &status);
 			if (status.n_ecm_arrived == 0)
 				return !st_is_intterupted;
 		}
 
 		g_get_current_time(&now);
 			
-		/* キューに積む */
-		chunk = g_slice_alloc(sizeof(B25Chunk) + length);
+		/* キューに積む。リングの空きが少なければ、転送を止めないようにコピーする */
+#ifdef HAVE_LIBUSB
+		if (buffer && !cusbfx2_buffer_is_ring_low(buffer)) {
+			chunk = g_slice_new(B25Chunk);
+			chunk->data = data;
+			chunk->buffer = cusbfx2_buffer_ref(buffer);
+		} else
+#endif
+		{
+			chunk = g_slice_alloc(sizeof(B25Chunk) + length);
+			chunk->data = (guint8 *)(chunk + 1);
+			chunk->buffer = NULL;
+			memcpy(chunk->data, data, length);
+		}
 		chunk->arrived_time = now;
 		chunk->size = length;
-		memcpy(chunk + 1, data, length);
-		g_async_queue_push(st_b25_async_queue, chunk);
+		g_async_queue_push(sniffer->b25_async_queue, chunk);
+	}
+
+	return !st_is_intterupted;
+}
+
+/**
+ * 入力の TS の PSI が更新された。
+ */
+static void
+psi_tables_cb(PsiTables *tables, guint table_id, guint id, gpointer user_data)
+{
+	Sniffer *sniffer = user_data;
+	PsiTablesStatus status;
+
+	if (table_id == PSI_PAT_TABLE_ID || table_id == PSI_PMT_TABLE_ID) {
+		pcr_tracker_update(sniffer->pcr_tracker, tables);
+	}
+
+	switch (table_id) {
+	case PSI_PAT_TABLE_ID:
+		psi_tables_get_status(tables, &status);
+		g_message("*** TS<%d>: PAT transport_stream_id=0x%04x version=%d programs=%u",
+				  sniffer->fx2_id, id, status.pat_version, status.n_programs);
+		break;
+	case PSI_NIT_TABLE_ID:
+		psi_tables_get_status(tables, &status);
+		g_message("*** TS<%d>: NIT network_id=0x%04x version=%d", sniffer->fx2_id, id, status.nit_version);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * サービスごとに振り分けた TS を書き出す。
+ */
+static void
+write_demux_cb(guint index, const guint8 *data, guint len, gpointer user_data)
+{
+	GIOChannel **ios = user_data;
+	GError *error = NULL;
+	gsize written;
+
+	g_io_channel_write_chars(ios[index], (const gchar *)data, len, &written, &error);
+	if (error) {
+		g_warning("[write_demux_cb] %s", error->message);
+		g_clear_error(&error);
+	}
+}
+
+static void
+b25_sync_packets_cb(guint8 *packets, guint n_packets, gpointer tag, gpointer user_data)
+{
+	Sniffer *sniffer = user_data;
+
+	ts_demux_push(sniffer->b25_demux, packets, n_packets);
+}
+
+/**
+ * パケット境界に揃った TS を出力へ流す。
+ *
+ * @a tag は入力の cusbfx2_buffer で、同期器がコピーしたパケットなら NULL になる。
+ */
+static void
+ts_sync_packets_cb(guint8 *packets, guint n_packets, gpointer tag, gpointer user_data)
+{
+	Sniffer *sniffer = user_data;
+
+	pid_stats_push(sniffer->pid_stats, packets, n_packets);
+	psi_tables_push(sniffer->psi, packets, n_packets);
+	pcr_tracker_push(sniffer->pcr_tracker, packets, n_packets, get_current_usec());
+	if (sniffer->pid_filter) {
+		n_packets = pid_filter_apply(sniffer->pid_filter, packets, n_packets);
+		if (n_packets == 0)
+			return;
 	}
+	push_ts(sniffer, packets, n_packets * TS_SYNC_PACKET_SIZE, tag);
+}
 
+static gboolean
+transfer_ts_cb(gpointer data, gint length, gpointer user_data)
+{
+	Sniffer *sniffer = user_data;
+
+	ts_sync_push(sniffer->ts_sync, data, length, NULL);
 	return !st_is_intterupted;
 }
 
+#ifdef HAVE_LIBUSB
+static gboolean
+transfer_ts_buffer_cb(cusbfx2_buffer *buffer, gpointer user_data)
+{
+	Sniffer *sniffer = user_data;
+
+	/* ストールから復旧した直後なら、途切れる前の途中のパケットとつなげない */
+	if (g_atomic_int_get(&sniffer->is_gap_pending)) {
+		ts_sync_reset(sniffer->ts_sync);
+	}
+	ts_sync_push(sniffer->ts_sync, cusbfx2_buffer_get_data(buffer), cusbfx2_buffer_get_length(buffer), buffer);
+	return !st_is_intterupted;
+}
+
+/**
+ * TS 転送のストールをメインループに知らせる。復旧はメインループで行う。
+ */
+static void
+transfer_ts_stall_cb(cusbfx2_transfer *transfer, const cusbfx2_stall_info *info, gpointer user_data)
+{
+	StallEvent *event;
+
+	event = g_new(StallEvent, 1);
+	event->sniffer = user_data;
+	event->transfer = transfer;
+	event->info = *info;
+	event->time = get_current_usec();
+	g_async_queue_push(st_stall_queue, event);
+}
+#endif
+
 static gboolean
 transfer_bcas_cb(gpointer data, gint length, gpointer user_data)
 {
-	if (st_bcas) {
-		((PSEUDO_B_CAS_CARD *)st_bcas)->push(st_bcas, data, length);
+	Sniffer *sniffer = user_data;
+
+	if (sniffer->bcas) {
+		((PSEUDO_B_CAS_CARD *)sniffer->bcas)->push(sniffer->bcas, data, length);
 	}
 
-	if (st_bcas_output_io) {
+	if (sniffer->bcas_output_io) {
 		gsize written;
 		GError *error = NULL;
-		g_io_channel_write_chars(st_bcas_output_io, data, length, &written, &error);
+		g_io_channel_write_chars(sniffer->bcas_output_io, data, length, &written, &error);
 		if (error) {
 			g_warning("[transfer_bcas_callback] %s", error->message);
 			g_clear_error(&error);
 		}
 	}
 
-	return TRUE;
+	return TRUE;
+}
+
+/* -------------------------------------------------------------------------- */
+
+#ifdef HAVE_LIBUSB
+static void
+recover_cusbfx2(StallEvent *event);
+
+static void
+retry_reopen_cusbfx2(Sniffer *sniffer);
+
+/**
+ * USB のイベントを処理し、ストールした転送があれば復旧する。
+ *
+ * イベントスレッドが動いていればイベント処理はそちらに任せ、ストールの通知を一定時間待つだけにする。
+ */
+static void
+poll_cusbfx2(void)
+{
+	StallEvent *event;
+	guint i;
+
+	if (cusbfx2_is_event_thread_running()) {
+		GTimeVal until;
+		g_get_current_time(&until);
+		g_time_val_add(&until, STATUS_INTERVAL);
+		event = g_async_queue_timed_pop(st_stall_queue, &until);
+	} else {
+		cusbfx2_poll();
+		event = g_async_queue_try_pop(st_stall_queue);
+	}
+
+	for (; event; event = g_async_queue_try_pop(st_stall_queue)) {
+		recover_cusbfx2(event);
+		g_free(event);
+	}
+
+	/* 開き直せなかった CUSBFX2 は、転送が無くストールの通知も来ないのでここで試みる */
+	for (i = 0; i < st_n_sniffers; ++i) {
+		Sniffer *sniffer = &st_sniffers[i];
+		if (sniffer->is_reopen_pending && get_current_usec() >= sniffer->reopen_time) {
+			retry_reopen_cusbfx2(sniffer);
+		}
+	}
+}
+
+/**
+ * 全ての CUSBFX2 の復旧をあきらめていれば TRUE を返す。
+ */
+static gboolean
+is_all_cusbfx2_failed(void)
+{
+	guint i;
+
+	for (i = 0; i < st_n_sniffers; ++i) {
+		if (!st_sniffers[i].is_failed)
+			return FALSE;
+	}
+	return st_n_sniffers > 0;
+}
+#endif
+
+static GIOChannel *
+open_io_channel(const gchar *filename, gboolean is_output)
+{
+	GIOChannel *io;
+	GError *error = NULL;
+
+	if (!strcmp(filename, "-")) {
+		io = g_io_channel_unix_new(is_output ? 1 : 0);
+	} else {
+		io = g_io_channel_new_file(filename, is_output ? "w" : "r", &error);
+	}
+
+	if (error) {
+		g_critical("[open_io_channel] %s", error->message);
+		g_clear_error(&error);
+		return NULL;
+	}
+
+	g_io_channel_set_encoding(io, NULL, &error);
+	if (error) {
+		g_critical("[open_io_channel] %s", error->message);
+		g_clear_error(&error);
+		g_io_channel_shutdown(io, FALSE, NULL);
+		return NULL;
+	}
+
+	return io;
+}
+
+static gboolean
+init_b25(Sniffer *sniffer)
+{
+	gboolean is_pseudo_bcas = TRUE;
+	gint r;
+	GError *error = NULL;
+	B_CAS_CARD *bcas;
+	ARIB_STD_B25 *b25;
+
+	/* B-CAS カードクラスの初期化 */
+	if (st_bcas_input_type == INPUT_TYPE_PCSC) {
+#ifdef HAVE_LIBPCSCLITE
+		g_message("*** using real B-CAS card reader");
+		bcas = sniffer->bcas = create_b_cas_card();
+		is_pseudo_bcas = FALSE;
+#else
+		g_critical("!!! not build with libpcsclite");
+		return FALSE;
+#endif
+	} else {
+		bcas = sniffer->bcas = (B_CAS_CARD *)pseudo_bcas_new();
+
+		if (st_bcas_input_type == INPUT_TYPE_FX2) {
+			g_message("*** using pseudo B-CAS card reader with CUSBFX2");
+		} else {
+			g_message("*** using pseudo B-CAS card reader with <%s>", st_bcas_input);
+		}
+	}
+	if (!bcas) {
+		g_critical("!!! couldn't create B-CAS card reader");
+		return FALSE;
+	}
+
+	r = bcas->init(bcas);
+	if (r < 0) {
+		g_critical("!!! couldn't initialize B-CAS card reader (%d)", r);
+		return FALSE;
+	}
+
+	/* 仮想 B-CAS カードを使う場合の追加初期化 */
+	if (is_pseudo_bcas) {
+		if (!((PSEUDO_B_CAS_CARD *)bcas)->set_init_status_from_hex(bcas, st_b25_system_key, st_b25_init_cbc)) {
+			g_critical("!!! B-CAS SYSTEM KEY AND INIT-CBC NOT SUPPLIED");
+			return FALSE;
+		}
+
+		if (st_bcas_input_type == INPUT_TYPE_FX2) {
+			g_message("*** set B-CAS ECM buffer queue length to %d", st_b25_bcas_queue_size);
+			((PSEUDO_B_CAS_CARD *)bcas)->set_queue_len(bcas, st_b25_bcas_queue_size);
+		} else {
+			((PSEUDO_B_CAS_CARD *)bcas)->set_queue_len(bcas, G_MAXUINT);
+		}
+	}
+
+	if (!g_thread_supported()) g_thread_init(NULL);
+
+	if (st_b25_threads > 0) {
+		g_message("*** initializing parallel B25 decoder with %d threads", st_b25_threads);
+		b25 = sniffer->b25 = (ARIB_STD_B25 *)parallel_b25_new(st_b25_threads);
+		sniffer->is_b25_in_place = TRUE;
+	} else {
+		g_message("*** initializing B25 decoder");
+		b25 = sniffer->b25 = create_arib_std_b25();
+	}
+	if (!b25) {
+		g_critical("!!! couldn't create B25 decoder");
+		return FALSE;
+	}
+
+	g_message("*** set MULTI-2 round factor to %d", st_b25_round);
+	r = b25->set_multi2_round(b25, st_b25_round);
+	if (r < 0) {
+		g_critical("!!! couldn't set MULTI-2 round factor to %d (%d)", st_b25_round, r);
+		return FALSE;
+	}
+
+	g_message("*** %s omit NULL packets", st_b25_strip ? "Enable" : "Disable");
+	b25->set_strip(b25, st_b25_strip ? 1 : 0);
+
+	r = b25->set_b_cas_card(b25, bcas);
+	if (r < 0) {
+		g_critical("!!! couldn't set B-CAS card reader to B25 decoder (%d)", r);
+		return FALSE;
+	}
+
+	/* Initialize B25 threads */
+	sniffer->b25_async_queue = g_async_queue_new();
+	sniffer->is_b25_running = TRUE;
+	sniffer->b25_thread = g_thread_create(b25_thread, sniffer, TRUE, &error);
+	if (error) {
+		g_critical("[init_b25] %s", error->message);
+		g_clear_error(&error);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void
+info_b25(ARIB_STD_B25 *b25)
+{
+	ARIB_STD_B25_PROGRAM_INFO info;
+	gint n_programs, i;
+
+	n_programs = b25->get_program_count(b25);
+	if (n_programs < 0) {
+		g_warning("!!! ARIB_STD_B25::get_program_count failed (%d)", n_programs);
+	} else {
+		for (i = 0; i < n_programs; ++i) {
+			gint r;
+			r = b25->get_program_info(b25, &info, i);
+			if (r < 0) {
+				g_warning("!!! ARIB_STD_B25::get_program_info(%d) failed (%d)", i, r);
+			} else {
+				g_message("> CH:%5d unpurchased ECM:%d(%04x)"
+						  " undecrypted TS:%8"G_GINT64_FORMAT"/%8"G_GINT64_FORMAT" (%.3f%%)",
+						  info.program_number,
+						  info.ecm_unpurchased_count,
+						  info.last_ecm_error_code,
+						  info.undecrypted_packet_count,
+						  info.total_packet_count,
+						  (gdouble)info.undecrypted_packet_count / info.total_packet_count * 100);
+			}
+		}
+	}
+}
+
+#ifdef HAVE_LIBUSB
+static void
+info_transfer(cusbfx2_transfer *transfer, const gchar *name)
+{
+	cusbfx2_transfer_stats stats;
+	GString *line;
+	gint i;
+
+	cusbfx2_get_transfer_stats(transfer, &stats);
+
+	g_message("> %s: %"G_GUINT64_FORMAT" bytes in %u transfers (%.2f MB/s)",
+			  name, stats.n_bytes, stats.n_completed, stats.bytes_per_sec / (1024 * 1024));
+	g_message("> %s: short:%u timeout:%u error:%u overflow:%u starved:%u",
+			  name, stats.n_short, stats.n_timeouts, stats.n_errors, stats.n_overflows, stats.n_starved);
+	g_message("> %s: max gap:%.3fms max resubmit latency:%.3fms",
+			  name, stats.max_gap * 1000, stats.max_resubmit_latency * 1000);
+
+	line = g_string_sized_new(128);
+	for (i = 0; i < CUSBFX2_STATS_HISTOGRAM_SIZE; ++i) {
+		g_string_append_printf(line, " <%gms:%u", (gdouble)(CUSBFX2_STATS_HISTOGRAM_BASE << i) / 1000,
+							   stats.interval_histogram[i]);
+	}
+	g_message("> %s: interval%s", name, line->str);
+
+	g_string_truncate(line, 0);
+	for (i = 0; i < CUSBFX2_STATS_HISTOGRAM_SIZE; ++i) {
+		g_string_append_printf(line, " <%gms:%u", (gdouble)(CUSBFX2_STATS_HISTOGRAM_BASE << i) / 1000,
+							   stats.resubmit_histogram[i]);
+	}
+	g_message("> %s: resubmit%s", name, line->str);
+	g_string_free(line, TRUE);
+}
+#endif
+
+/**
+ * 出力ファイル名の "%d" を CUSBFX2 の ID に置き換える。
+ */
+static gchar *
+expand_output_filename(const gchar *filename, gint fx2_id)
+{
+	gchar **parts;
+	gchar *id, *result;
+
+	parts = g_strsplit(filename, "%d", -1);
+	id = g_strdup_printf("%d", fx2_id);
+	result = g_strjoinv(id, parts);
+	g_free(id);
+	g_strfreev(parts);
+
+	return result;
+}
+
+static GIOChannel *
+open_output(const gchar *filename, gint fx2_id, const gchar *name)
+{
+	GIOChannel *io;
+	gchar *path;
+
+	path = expand_output_filename(filename, fx2_id);
+	if (!(io = open_io_channel(path, TRUE))) {
+		g_critical("!!! couldn't open %s output <%s>", name, path);
+	}
+	g_free(path);
+
+	return io;
+}
+
+/**
+ * --ts-service のサービスごとに、DEMUX_OUTPUT_TAG をサービス ID に置き換えた出力を開き、振り分け器を作る。
+ */
+static gboolean
+open_demux_outputs(const gchar *filename, gint fx2_id, const gchar *name, TsDemux **demux, GIOChannel ***ios)
+{
+	guint i;
+
+	*ios = g_new0(GIOChannel *, st_ts_service_ids->len);
+	*demux = ts_demux_new(write_demux_cb, *ios);
+
+	for (i = 0; i < st_ts_service_ids->len; ++i) {
+		guint service_id = g_array_index(st_ts_service_ids, guint, i);
+		gchar **parts, *id, *path;
+
+		parts = g_strsplit(filename, DEMUX_OUTPUT_TAG, -1);
+		id = g_strdup_printf("%u", service_id);
+		path = g_strjoinv(id, parts);
+		g_free(id);
+		g_strfreev(parts);
+
+		(*ios)[i] = open_output(path, fx2_id, name);
+		g_free(path);
+		if (!(*ios)[i]) {
+			return FALSE;
+		}
+		g_io_channel_set_buffer_size((*ios)[i], DEMUX_OUTPUT_BUFFER_SIZE);
+		ts_demux_add_service(*demux, service_id);
+	}
+
+	return TRUE;
+}
+
+static void
+close_demux_outputs(TsDemux *demux, GIOChannel **ios)
+{
+	guint i;
+
+	if (!ios)
+		return;
+
+	ts_demux_free(demux);
+	for (i = 0; i < st_ts_service_ids->len; ++i) {
+		if (ios[i]) g_io_channel_shutdown(ios[i], TRUE, NULL);
+	}
+	g_free(ios);
+}
+
+static gboolean
+open_outputs(Sniffer *sniffer)
+{
+	if (st_ts_output && strstr(st_ts_output, DEMUX_OUTPUT_TAG)) {
+		if (!open_demux_outputs(st_ts_output, sniffer->fx2_id, "TS", &sniffer->ts_demux, &sniffer->ts_demux_ios)) {
+			return FALSE;
+		}
+	} else if (st_ts_output) {
+		if (!(sniffer->ts_output_io = open_output(st_ts_output, sniffer->fx2_id, "TS"))) {
+			return FALSE;
+		}
+	}
+	if (st_bcas_output) {
+		if (!(sniffer->bcas_output_io = open_output(st_bcas_output, sniffer->fx2_id, "B-CAS"))) {
+			return FALSE;
+		}
+	}
+	if (st_b25_output && strstr(st_b25_output, DEMUX_OUTPUT_TAG)) {
+		sniffer->b25_sync = ts_sync_new(b25_sync_packets_cb, sniffer);
+		if (!open_demux_outputs(st_b25_output, sniffer->fx2_id, "B25", &sniffer->b25_demux, &sniffer->b25_demux_ios)) {
+			return FALSE;
+		}
+	} else if (st_b25_output) {
+		if (!(sniffer->b25_output_io = open_output(st_b25_output, sniffer->fx2_id, "B25"))) {
+			return FALSE;
+		}
+		/* その場で復号したデータはチャンクごとの大きな範囲になるので、バッファを通さずに書く */
+		if (st_b25_threads > 0 && !st_b25_strip) {
+			g_io_channel_set_buffered(sniffer->b25_output_io, FALSE);
+		}
+	}
+
+	return TRUE;
+}
+
+#ifdef HAVE_LIBUSB
+/**
+ * 全ての CUSBFX2 をまとめて開く。
+ *
+ * ファームウェアのロードと再検出は全台で並行して行われる。
+ */
+static gboolean
+open_cusbfx2(void)
+{
+	CapSts **devices;
+	gboolean result;
+	guint i;
+
+	devices = g_new0(CapSts *, st_n_sniffers);
+	result = capsts_open_all((gint *)st_fx2_ids->data, st_n_sniffers, st_fx2_is_force_load, devices);
+	for (i = 0; i < st_n_sniffers; ++i) {
+		st_sniffers[i].capsts = devices[i];
+	}
+	g_free(devices);
+
+	return result;
+}
+
+/**
+ * 開いた CUSBFX2 のチャンネルを合わせて転送を準備する。
+ *
+ * @param is_tune	FALSE ならチャンネルを合わせない (開き直した場合)
+ */
+static gboolean
+start_cusbfx2(Sniffer *sniffer, gboolean is_tune)
+{
+	CapSts *capsts = sniffer->capsts;
+	cusbfx2_handle *device = capsts_get_device(capsts);
+
+	capsts_cmd_push(capsts, CMD_PORT_CFG, 0x00, PIO_START);
+	capsts_cmd_push(capsts, CMD_MODE_IDLE);
+	capsts_cmd_push(capsts, CMD_IFCONFIG, 0xE3);
+	capsts_cmd_commit(capsts);
+
+	capsts_set_ir_base(capsts, st_ir_base);
+	capsts_set_ir_macro(capsts, st_ir_macro);
+	if (is_tune && !sniffer->tuner_lock) {
+		capsts_adjust_tuner_channel(capsts, sniffer->ir_source, sniffer->ir_channel, TRUE);
+	}
+
+	if (st_ts_input_type == INPUT_TYPE_FX2) {
+		g_message("*** setup TS transfer (fx2-id=%d)", sniffer->fx2_id);
+		sniffer->transfer_ts = cusbfx2_init_bulk_transfer_ring(device, "TS", FALSE, ENDPOINT_TS_IN,
+															   st_fx2_ts_buffer_size, st_fx2_ts_buffer_count,
+															   st_fx2_ts_ring_size, transfer_ts_buffer_cb, sniffer);
+		if (!sniffer->transfer_ts) {
+			g_critical("!!! couldn't setup TS transfer");
+			return FALSE;
+		}
+		if (st_fx2_ts_auto_tune) {
+			cusbfx2_set_transfer_auto_tune(sniffer->transfer_ts, TRUE, st_fx2_ts_max_buffer_count);
+		}
+		if (st_fx2_ts_watchdog > 0) {
+			cusbfx2_set_transfer_watchdog(sniffer->transfer_ts, st_fx2_ts_watchdog, transfer_ts_stall_cb, sniffer);
+		}
+		capsts_cmd_push(capsts, CMD_EP6IN_START);
+	}
+
+	if (st_bcas_input_type == INPUT_TYPE_FX2) {
+		g_message("*** setup B-CAS transfer (fx2-id=%d)", sniffer->fx2_id);
+		sniffer->transfer_bcas = cusbfx2_init_bulk_transfer(device, "B-CAS", TRUE, ENDPOINT_BCAS_IN,
+															512, 1, transfer_bcas_cb, sniffer);
+		if (!sniffer->transfer_bcas) {
+			g_critical("!!! couldn't setup B-CAS transfer");
+			return FALSE;
+		}
+		capsts_cmd_push(capsts, CMD_EP4IN_START);
+	}
+
+	capsts_cmd_push(capsts, CMD_PORT_WRITE, PIO_START);
+	capsts_cmd_commit(capsts);
+
+	if (sniffer->transfer_ts) cusbfx2_start_transfer(sniffer->transfer_ts);
+	if (sniffer->transfer_bcas) cusbfx2_start_transfer(sniffer->transfer_bcas);
+
+	return TRUE;
+}
+
+/**
+ * CUSBFX2 をアイドル状態に戻し、転送を解放して閉じる。
+ */
+static void
+stop_cusbfx2(Sniffer *sniffer, gboolean is_started)
+{
+	CapSts *capsts = sniffer->capsts;
+
+	if (capsts && is_started) {
+		capsts_wait_tuner_channel(capsts);
+
+		g_message("*** set CUSBFX2 to idle mode (fx2-id=%d)", sniffer->fx2_id);
+		if (sniffer->transfer_ts) capsts_cmd_push(capsts, CMD_EP6IN_STOP);
+		if (sniffer->transfer_bcas) capsts_cmd_push(capsts, CMD_EP4IN_STOP);
+		capsts_cmd_push(capsts, CMD_MODE_IDLE);
+		capsts_cmd_commit(capsts);
+	}
+
+	if (st_is_intterupted) {
+		if (sniffer->transfer_ts) cusbfx2_cancel_transfer(sniffer->transfer_ts);
+		if (sniffer->transfer_bcas) cusbfx2_cancel_transfer(sniffer->transfer_bcas);
+	}
+	if (sniffer->transfer_ts) cusbfx2_free_transfer(sniffer->transfer_ts);
+	if (sniffer->transfer_bcas) cusbfx2_free_transfer(sniffer->transfer_bcas);
+	sniffer->transfer_ts = NULL;
+	sniffer->transfer_bcas = NULL;
+}
+#endif
+
+#ifdef HAVE_LIBUSB
+/**
+ * CUSBFX2 を閉じて開き直し、チャンネルはそのままで転送を再開する。
+ *
+ * 開けなければ、STALL_REOPEN_INTERVAL の後に poll_cusbfx2() から再び試みる。
+ *
+ * @param is_device_gone	TRUE ならデバイスが抜かれているので、アイドルに戻すコマンドを送らない
+ */
+static gboolean
+reopen_cusbfx2(Sniffer *sniffer, gboolean is_device_gone)
+{
+	stop_cusbfx2(sniffer, !is_device_gone);
+	capsts_close(sniffer->capsts);
+
+	sniffer->capsts = capsts_open(sniffer->fx2_id, FALSE);
+	if (!sniffer->capsts) {
+		g_critical("!!! couldn't reopen CUSBFX2 (fx2-id=%d)", sniffer->fx2_id);
+		sniffer->is_reopen_pending = TRUE;
+		sniffer->reopen_time = get_current_usec() + STALL_REOPEN_INTERVAL;
+		return FALSE;
+	}
+	sniffer->is_reopen_pending = FALSE;
+
+	return start_cusbfx2(sniffer, FALSE);
+}
+
+/**
+ * 復旧をあきらめ、この CUSBFX2 からの取得を止める。
+ */
+static void
+give_up_cusbfx2(Sniffer *sniffer)
+{
+	g_critical("!!! TS transfer is not recovered (fx2-id=%d), giving up", sniffer->fx2_id);
+	sniffer->is_failed = TRUE;
+	sniffer->is_reopen_pending = FALSE;
+	st_is_capture_failed = TRUE;
+}
+
+/**
+ * 開き直せなかった CUSBFX2 をもう一度開き直す。
+ */
+static void
+retry_reopen_cusbfx2(Sniffer *sniffer)
+{
+	if (sniffer->recovery_level >= STALL_MAX_RECOVERY) {
+		give_up_cusbfx2(sniffer);
+		return;
+	}
+	++sniffer->recovery_level;
+
+	g_warning("!!! reopening CUSBFX2 (fx2-id=%d, attempt %d)", sniffer->fx2_id, sniffer->recovery_level);
+	reopen_cusbfx2(sniffer, TRUE);
 }
 
-/* -------------------------------------------------------------------------- */
-
-static GIOChannel *
-open_io_channel(const gchar *filename, gboolean is_output)
+/**
+ * ストールした TS 転送を復旧する。
+ *
+ * データが届かないまま続けてストールするたびに、転送の投げ直し (ホルトの解除)、
+ * CUSBFX2 の FIFO のリセット、CUSBFX2 の開き直しの順に手段を強める。
+ * 次に届いたデータの前には、途切れた時間を記した欠落の印を出力する。
+ */
+static void
+recover_cusbfx2(StallEvent *event)
 {
-	GIOChannel *io;
-	GError *error = NULL;
-
-	if (!strcmp(filename, "-")) {
-		io = g_io_channel_unix_new(is_output ? 1 : 0);
-	} else {
-		io = g_io_channel_new_file(filename, is_output ? "w" : "r", &error);
+	Sniffer *sniffer = event->sniffer;
+	gint level;
+
+	/* 通知の後に転送を作り直していれば、もう止まっていない */
+	if (sniffer->is_failed || !sniffer->transfer_ts || event->transfer != sniffer->transfer_ts)
+		return;
+
+	++sniffer->n_stalls;
+
+	/* 前の復旧の後にデータが届いていれば、最初の手段からやり直す */
+	if (!g_atomic_int_get(&sniffer->is_gap_pending)) {
+		sniffer->recovery_level = 0;
+		sniffer->gap_start = event->time - (gint64)(event->info.silent * G_USEC_PER_SEC);
+		sniffer->gap_bytes_per_sec = event->info.bytes_per_sec;
+		sniffer->gap_reason = event->info.reason;
+		g_atomic_int_set(&sniffer->is_gap_pending, TRUE);
 	}
 
-	if (error) {
-		g_critical("[open_io_channel] %s", error->message);
-		g_clear_error(&error);
-		return NULL;
+	if (sniffer->recovery_level >= STALL_MAX_RECOVERY) {
+		give_up_cusbfx2(sniffer);
+		return;
 	}
-
-	g_io_channel_set_encoding(io, NULL, &error);
-	if (error) {
-		g_critical("[open_io_channel] %s", error->message);
-		g_clear_error(&error);
-		g_io_channel_shutdown(io, FALSE, NULL);
-		return NULL;
+	level = sniffer->recovery_level++;
+	if (event->info.reason == CUSBFX2_STALL_NO_DEVICE) {
+		level = 2;
 	}
 
-	return io;
+	g_warning("!!! TS transfer stalled (fx2-id=%d, reason=%s), recovering (level %d)",
+			  sniffer->fx2_id, st_stall_reason_names[event->info.reason], level);
+
+	switch (level) {
+	case 0:
+		if (cusbfx2_restart_transfer(sniffer->transfer_ts))
+			break;
+		/* FALLTHROUGH */
+
+	case 1:
+		/* コマンドキューはチャンネルを切り替えるスレッドと共有なので、IR を送り終えるのを待つ */
+		capsts_wait_tuner_channel(sniffer->capsts);
+		capsts_cmd_push(sniffer->capsts, CMD_EP6IN_STOP);
+		capsts_cmd_commit(sniffer->capsts);
+		if (cusbfx2_restart_transfer(sniffer->transfer_ts)) {
+			capsts_cmd_push(sniffer->capsts, CMD_EP6IN_START);
+			if (capsts_cmd_commit(sniffer->capsts))
+				break;
+		}
+		/* FALLTHROUGH */
+
+	default:
+		reopen_cusbfx2(sniffer, event->info.reason == CUSBFX2_STALL_NO_DEVICE);
+		break;
+	}
 }
+#endif
 
-static gboolean
-init_b25(void)
+#ifdef HAVE_LIBUSB
+/**
+ * キーを送り終えたら、同じチャンネルへの切り替えでもロックを検出できるようにする。
+ * チャンネルを切り替えるスレッドから呼ばれる。
+ */
+static void
+tuner_keys_sent_cb(CapSts *capsts, gboolean is_success, const guint8 *reply, gint reply_length, gpointer user_data)
 {
-	gboolean is_pseudo_bcas = TRUE;
-	gint r;
-	GError *error = NULL;
+	Sniffer *sniffer = user_data;
 
-	/* B-CAS カードクラスの初期化 */
-	if (st_bcas_input_type == INPUT_TYPE_PCSC) {
-#ifdef HAVE_LIBPCSCLITE
-		g_message("*** using real B-CAS card reader");
-		st_bcas = create_b_cas_card();
-		is_pseudo_bcas = FALSE;
-#else
-		g_critical("!!! not build with libpcsclite");
-		return FALSE;
-#endif
-	} else {
-		st_bcas = (B_CAS_CARD *)pseudo_bcas_new();
+	if (!is_success)
+		return;
 
-		if (st_bcas_input_type == INPUT_TYPE_FX2) {
-			g_message("*** using pseudo B-CAS card reader with CUSBFX2");
-		} else {
-			g_message("*** using pseudo B-CAS card reader with <%s>", st_bcas_input);
-		}
-	}
-	if (!st_bcas) {
-		g_critical("!!! couldn't create B-CAS card reader");
-		return FALSE;
-	}
+	g_mutex_lock(sniffer->tuner_lock_mutex);
+	tuner_lock_set_keys_sent(sniffer->tuner_lock);
+	g_mutex_unlock(sniffer->tuner_lock_mutex);
+}
 
-	r = st_bcas->init(st_bcas);
-	if (r < 0) {
-		g_critical("!!! couldn't initialize B-CAS card reader (%d)", r);
-		return FALSE;
-	}
+/**
+ * --ir-lock-detect が指定されていれば、TS を流したままチャンネルを切り替える。
+ *
+ * 切り替え前の transport_stream_id を調べてから、リモコンの送信を CUSBFX2 ごとに
+ * 別スレッドで始めて待たずに返る。
+ * 切り替えの完了はメインループで check_tuner_lock() が判断する。
+ */
+static void
+switch_tuner_channels(void)
+{
+	GTimer *timer;
+	gboolean is_all_known;
+	guint i;
 
-	/* 仮想 B-CAS カードを使う場合の追加初期化 */
-	if (is_pseudo_bcas) {
-		if (!((PSEUDO_B_CAS_CARD *)st_bcas)->set_init_status_from_hex(st_bcas, st_b25_system_key, st_b25_init_cbc)) {
-			g_critical("!!! B-CAS SYSTEM KEY AND INIT-CBC NOT SUPPLIED");
-			return FALSE;
+	/* 切り替え前の transport_stream_id を調べる */
+	timer = g_timer_new();
+	do {
+		poll_cusbfx2();
+
+		is_all_known = TRUE;
+		for (i = 0; i < st_n_sniffers; ++i) {
+			Sniffer *sniffer = &st_sniffers[i];
+			if (!sniffer->tuner_lock) continue;
+
+			g_mutex_lock(sniffer->tuner_lock_mutex);
+			if (tuner_lock_get_tsid(sniffer->tuner_lock) == TUNER_LOCK_UNKNOWN_TSID)
+				is_all_known = FALSE;
+			g_mutex_unlock(sniffer->tuner_lock_mutex);
 		}
+	} while (!is_all_known && !st_is_intterupted && g_timer_elapsed(timer, NULL) < TUNER_LOCK_PROBE_TIME);
+	g_timer_destroy(timer);
 
-		if (st_bcas_input_type == INPUT_TYPE_FX2) {
-			g_message("*** set B-CAS ECM buffer queue length to %d", st_b25_bcas_queue_size);
-			((PSEUDO_B_CAS_CARD *)st_bcas)->set_queue_len(st_bcas, st_b25_bcas_queue_size);
-		} else {
-			((PSEUDO_B_CAS_CARD *)st_bcas)->set_queue_len(st_bcas, G_MAXUINT);
+	for (i = 0; i < st_n_sniffers; ++i) {
+		Sniffer *sniffer = &st_sniffers[i];
+		gint old_tsid;
+
+		if (!sniffer->tuner_lock) continue;
+
+		g_mutex_lock(sniffer->tuner_lock_mutex);
+		old_tsid = tuner_lock_get_tsid(sniffer->tuner_lock);
+		tuner_lock_reset(sniffer->tuner_lock, old_tsid);
+		g_mutex_unlock(sniffer->tuner_lock_mutex);
+
+		g_message("*** switch channel (fx2-id=%d, current TSID=0x%04x)", sniffer->fx2_id, old_tsid & 0xFFFF);
+		sniffer->switch_timer = g_timer_new();
+		if (!capsts_adjust_tuner_channel_async(sniffer->capsts, sniffer->ir_source, sniffer->ir_channel,
+											   tuner_keys_sent_cb, sniffer)) {
+			g_warning("!!! couldn't start switching channel (fx2-id=%d)", sniffer->fx2_id);
 		}
 	}
+}
 
-	g_message("*** initializing B25 decoder");
-	st_b25 = create_arib_std_b25();
-	if (!st_b25) {
-		g_critical("!!! couldn't create B25 decoder");
-		return FALSE;
+/**
+ * 新しいチャンネルの PAT が安定したか、待ちきれなくなったら出力を始める。
+ */
+static void
+check_tuner_lock(Sniffer *sniffer)
+{
+	gboolean is_locked;
+	gint tsid;
+	gdouble elapsed;
+
+	if (g_atomic_int_get(&sniffer->is_tuner_locked) || !sniffer->switch_timer)
+		return;
+
+	g_mutex_lock(sniffer->tuner_lock_mutex);
+	is_locked = tuner_lock_is_locked(sniffer->tuner_lock);
+	tsid = tuner_lock_get_tsid(sniffer->tuner_lock);
+	g_mutex_unlock(sniffer->tuner_lock_mutex);
+
+	elapsed = g_timer_elapsed(sniffer->switch_timer, NULL);
+	if (is_locked) {
+		g_message("*** channel locked (fx2-id=%d, TSID=0x%04x) in %.2f seconds", sniffer->fx2_id, tsid, elapsed);
+	} else if (elapsed >= st_ir_lock_timeout) {
+		g_warning("!!! channel lock timed out (fx2-id=%d) after %d seconds", sniffer->fx2_id, st_ir_lock_timeout);
+	} else {
+		return;
 	}
 
-	g_message("*** set MULTI-2 round factor to %d", st_b25_round);
-	st_b25->set_multi2_round(st_b25, st_b25_round);
+	g_atomic_int_set(&sniffer->is_tuner_locked, TRUE);
+}
+#endif
 
-	g_message("*** %s omit NULL packets", st_b25_strip ? "Enable" : "Disable");
-	st_b25->set_strip(st_b25, st_b25_strip ? 1 : 0);
+static void
+finalize_b25(Sniffer *sniffer)
+{
+	ARIB_STD_B25 *b25 = sniffer->b25;
+	gint r;
+	ARIB_STD_B25_BUFFER buffer;
 
-	st_b25->set_b_cas_card(st_b25, st_bcas);
+	g_message("*** flush B25 decoder (fx2-id=%d)", sniffer->fx2_id);
+	r = b25->flush(b25);
+	if (r < 0) {
+		g_warning("!!! ARIB_STD_B25::flush failed (%d)", r);
+	}
 
-	/* Initialize B25 threads */
-	g_thread_init(NULL);
-	st_b25_thread = g_thread_create(b25_thread, NULL, TRUE, &error);
-	if (error) {
-		g_critical("[init_b25] %s", error->message);
-		g_clear_error(&error);
-		return FALSE;
+	r = b25->get(b25, &buffer);
+	if (r < 0) {
+		g_warning("!!! ARIB_STD_B25::get failed (%d)", r);
+	} else if (buffer.size > 0) {
+		write_b25_output(sniffer, buffer.data, buffer.size);
 	}
-	st_b25_async_queue = g_async_queue_new();
 
-	return TRUE;
+	info_b25(b25);
 }
 
 static void
-info_b25(ARIB_STD_B25 *b25)
+write_pid_stats(Sniffer *sniffer)
 {
-	ARIB_STD_B25_PROGRAM_INFO info;
-	gint n_programs, i;
+	GError *error = NULL;
 
-	n_programs = b25->get_program_count(b25);
-	if (n_programs < 0) {
-		g_warning("!!! ARIB_STD_B25::get_program_count failed (%d)", n_programs);
-	} else {
-		for (i = 0; i < n_programs; ++i) {
-			gint r;
-			r = b25->get_program_info(b25, &info, i);
-			if (r < 0) {
-				g_warning("!!! ARIB_STD_B25::get_program_info(%d) failed (%d)", i, r);
-			} else {
-				g_message("> CH:%5d unpurchased ECM:%d(%04x)"
-						  " undecrypted TS:%8"G_GINT64_FORMAT"/%8"G_GINT64_FORMAT" (%.3f%%)",
-						  info.program_number,
-						  info.ecm_unpurchased_count,
-						  info.last_ecm_error_code,
-						  info.undecrypted_packet_count,
-						  info.total_packet_count,
-						  (gdouble)info.undecrypted_packet_count / info.total_packet_count * 100);
-			}
-		}
+	if (!pid_stats_write(sniffer->pid_stats, sniffer->pid_stats_path, &error)) {
+		g_warning("[write_pid_stats] %s", error->message);
+		g_clear_error(&error);
 	}
 }
 
 static void
 run(void)
 {
-	cusbfx2_handle *device = NULL;
-	cusbfx2_transfer *transfer_ts = NULL;
-	cusbfx2_transfer *transfer_bcas = NULL;
 	GTimer *timer; 
 	gboolean is_cusbfx2_inited = FALSE;
 	gboolean is_cusbfx2_started = FALSE;
 	GString *infoline = NULL;
-	gdouble ts_disposed_time;
+	guint i;
+
+	/* Initialize sniffers */
+	st_n_sniffers = st_fx2_ids->len;
+	st_sniffers = g_new0(Sniffer, st_n_sniffers);
+	for (i = 0; i < st_n_sniffers; ++i) {
+		gchar **sources, **channels;
+		guint n;
+
+		st_sniffers[i].fx2_id = g_array_index(st_fx2_ids, gint, i);
+		st_sniffers[i].ts_sync = ts_sync_new(ts_sync_packets_cb, &st_sniffers[i]);
+		st_sniffers[i].psi = psi_tables_new(psi_tables_cb, &st_sniffers[i]);
+		st_sniffers[i].pid_stats = pid_stats_new();
+		st_sniffers[i].pcr_tracker = pcr_tracker_new();
+		if (st_ts_stats) {
+			st_sniffers[i].pid_stats_path = expand_output_filename(st_ts_stats, st_sniffers[i].fx2_id);
+		}
+		if (st_ts_service_ids->len > 0 || st_ts_strip_null) {
+			guint j;
+
+			st_sniffers[i].pid_filter = pid_filter_new();
+			for (j = 0; j < st_ts_service_ids->len; ++j) {
+				pid_filter_add_service(st_sniffers[i].pid_filter, g_array_index(st_ts_service_ids, guint, j));
+			}
+			if (st_ts_strip_null) {
+				pid_filter_drop_pid(st_sniffers[i].pid_filter, PSI_NULL_PID);
+			}
+		}
+		st_sniffers[i].ts_disposed_time = -1.;
+		st_sniffers[i].is_tuner_locked = TRUE;
+
+		/* リモコン指定が一つだけなら全台に適用する */
+		st_sniffers[i].ir_source = -1;
+		if (st_ir_source) {
+			sources = g_strsplit(st_ir_source, ",", -1);
+			n = g_strv_length(sources);
+			if (n > 0 && sources[MIN(i, n - 1)][0]) {
+				st_sniffers[i].ir_source = CLAMP(g_ascii_strtoll(sources[MIN(i, n - 1)], NULL, 10), -1, 2);
+			}
+			g_strfreev(sources);
+		}
+		if (st_ir_channel) {
+			channels = g_strsplit(st_ir_channel, ",", -1);
+			n = g_strv_length(channels);
+			if (n > 0 && channels[MIN(i, n - 1)][0]) {
+				st_sniffers[i].ir_channel = g_intern_string(channels[MIN(i, n - 1)]);
+			}
+			g_strfreev(channels);
+		}
+
+		/* TS を流したままチャンネルを切り替える */
+		if (st_ir_lock_detect && st_ts_input_type == INPUT_TYPE_FX2 &&
+			(st_sniffers[i].ir_source >= 0 || st_sniffers[i].ir_channel)) {
+			st_sniffers[i].tuner_lock = tuner_lock_new(TUNER_LOCK_UNKNOWN_TSID, TUNER_LOCK_STABLE_PATS);
+			st_sniffers[i].tuner_lock_mutex = g_mutex_new();
+			st_sniffers[i].is_tuner_locked = FALSE;
+		}
+	}
 
 	/* Initialize inputs */
 	if (st_ts_input_type == INPUT_TYPE_FILE) {
@@ -480,30 +1522,16 @@ run(void)
 		}
 	}
 
-	/* Initialize outputs */
-	if (st_ts_output) {
-		if (!(st_ts_output_io = open_io_channel(st_ts_output, TRUE))) {
-			g_critical("!!! couldn't open TS output <%s>", st_ts_output);
+	/* Initialize outputs and B25 */
+	for (i = 0; i < st_n_sniffers; ++i) {
+		if (!open_outputs(&st_sniffers[i])) {
 			goto quit;
 		}
-	}
-	if (st_bcas_output) {
-		if (!(st_bcas_output_io = open_io_channel(st_bcas_output, TRUE))) {
-			g_critical("!!! couldn't open TS output <%s>", st_bcas_output);
-			goto quit;
-		}
-	}
-	if (st_b25_output) {
-		if (!(st_b25_output_io = open_io_channel(st_b25_output, TRUE))) {
-			g_critical("!!! couldn't open B25 output <%s>", st_b25_output);
-			goto quit;
-		}
-	}
 
-	/* Initialize B25 */
-	if (st_b25_output) {
-		if (!init_b25()) {
-			goto quit;
+		if (st_b25_output) {
+			if (!init_b25(&st_sniffers[i])) {
+				goto quit;
+			}
 		}
 	}
 
@@ -512,49 +1540,30 @@ run(void)
 #ifdef HAVE_LIBUSB
 		cusbfx2_init();
 		is_cusbfx2_inited = TRUE;
+		st_stall_queue = g_async_queue_new();
+		cusbfx2_set_verify_firmware(st_fx2_is_verify_firmware);
 
-		device = capsts_open(st_fx2_id, st_fx2_is_force_load);
-		if (!device) {
-			goto quit;
-		}
-
-		capsts_cmd_push(CMD_PORT_CFG, 0x00, PIO_START);
-		capsts_cmd_push(CMD_MODE_IDLE);
-		capsts_cmd_push(CMD_IFCONFIG, 0xE3);
-		capsts_cmd_commit(device);
-
-		capsts_set_ir_base(st_ir_base);
-		capsts_adjust_tuner_channel(device, st_ir_source, st_ir_channel);
-
-		if (st_ts_input_type == INPUT_TYPE_FX2) {
-			g_message("*** setup TS transfer");
-			transfer_ts = cusbfx2_init_bulk_transfer(device, "TS", FALSE, ENDPOINT_TS_IN,
-													 st_fx2_ts_buffer_size, st_fx2_ts_buffer_count,
-													 transfer_ts_cb, NULL);
-			if (!transfer_ts) {
-				g_critical("!!! couldn't setup TS transfer");
+		if (st_fx2_event_thread) {
+			g_message("*** start USB event thread");
+			if (!cusbfx2_start_event_thread(st_fx2_event_thread_priority, st_fx2_event_thread_cpu)) {
 				goto quit;
 			}
-			capsts_cmd_push(CMD_EP6IN_START);
 		}
 
-		if (st_bcas_input_type == INPUT_TYPE_FX2) {
-			g_message("*** setup B-CAS transfer");
-			transfer_bcas = cusbfx2_init_bulk_transfer(device, "B-CAS", TRUE, ENDPOINT_BCAS_IN,
-													   512, 1, transfer_bcas_cb, NULL);
-			if (!transfer_bcas) {
-				g_critical("!!! couldn't setup B-CAS transfer");
-				goto quit;
-			}
-			capsts_cmd_push(CMD_EP4IN_START);
+		if (!open_cusbfx2()) {
+			goto quit;
 		}
 
-		capsts_cmd_push(CMD_PORT_WRITE, PIO_START);
-		capsts_cmd_commit(device);
 		is_cusbfx2_started = TRUE;
+		for (i = 0; i < st_n_sniffers; ++i) {
+			if (!start_cusbfx2(&st_sniffers[i], TRUE)) {
+				goto quit;
+			}
+		}
 
-		if (transfer_ts) cusbfx2_start_transfer(transfer_ts);
-		if (transfer_bcas) cusbfx2_start_transfer(transfer_bcas);
+		if (st_ir_lock_detect) {
+			switch_tuner_channels();
+		}
 #endif
 	}
 
@@ -562,6 +1571,8 @@ run(void)
 
 	/* B-CAS 入力がファイルであれば、事前に読んでおく */
 	if (st_bcas_input_io) {
+		Sniffer *sniffer = &st_sniffers[0];
+
 		for (;;) {
 			GError *error = NULL;
 			gchar buf[512];
@@ -575,24 +1586,23 @@ run(void)
 				g_clear_error(&error);
 			}
 
-			if (st_bcas_output_io) {
+			if (sniffer->bcas_output_io) {
 				gsize written;
-				g_io_channel_write_chars(st_bcas_output_io, buf, readed, &written, &error);
+				g_io_channel_write_chars(sniffer->bcas_output_io, buf, readed, &written, &error);
 				if (error) {
 					g_warning("!!! %s", error->message);
 					g_clear_error(&error);
 				}
 			}
 
-			if (st_bcas)
-				((PSEUDO_B_CAS_CARD *)st_bcas)->push(st_bcas, (guint8 *)buf, readed);
+			if (sniffer->bcas)
+				((PSEUDO_B_CAS_CARD *)sniffer->bcas)->push(sniffer->bcas, (guint8 *)buf, readed);
 		}
 	}
 
 	/* main loop */
 	infoline = g_string_sized_new(128);
 	timer = g_timer_new();
-	ts_disposed_time = -1.;
 	while (!st_is_intterupted) {
 		gdouble elapsed;
 
@@ -604,7 +1614,7 @@ run(void)
 
 			status = g_io_channel_read_chars(st_ts_input_io, buf, 512, &readed, &error);
 			if (status == G_IO_STATUS_NORMAL) {
-				transfer_ts_cb((guint8 *)buf, 512, NULL);
+				transfer_ts_cb((guint8 *)buf, 512, &st_sniffers[0]);
 			} else {
 				if (error) {
 					g_warning("!!! %s", error->message);
@@ -614,32 +1624,95 @@ run(void)
 			}
 		} else if (is_cusbfx2_started) {
 #ifdef HAVE_LIBUSB
-			PseudoBCASStatus bcas_status;
-			if (st_bcas && (st_bcas_input_type == INPUT_TYPE_FX2 || st_bcas_input_type == INPUT_TYPE_FILE)) {
-				((PSEUDO_B_CAS_CARD *)st_bcas)->get_status(st_bcas, &bcas_status);
+			poll_cusbfx2();
+			if (is_all_cusbfx2_failed()) {
+				g_critical("!!! no CUSBFX2 is capturing, stop");
+				break;
 			}
 
-			cusbfx2_poll();
-
 			elapsed = g_timer_elapsed(timer, NULL);
 
-			if (st_b25_queue && ts_disposed_time < .0) {
-				if (bcas_status.n_ecm_arrived > 0) {
-					ts_disposed_time = elapsed;
-					g_message("*** dispose leading TS stream by %.1f seconds", ts_disposed_time);
+			g_string_printf(infoline, ">>> [Now] %.1f", elapsed);
+			for (i = 0; i < st_n_sniffers; ++i) {
+				Sniffer *sniffer = &st_sniffers[i];
+				PseudoBCASStatus bcas_status;
+				TsSyncStats sync_stats;
+				PsiTablesStatus psi_status;
+				PidStatsCounters pid_totals;
+				PcrTrackerStatus pcr_status[PSI_MAX_PROGRAMS];
+				guint n_pcr_status, j;
+
+				if (st_n_sniffers > 1) {
+					g_string_append_printf(infoline, " <%d>", sniffer->fx2_id);
 				}
-			}
 
-			g_string_printf(infoline, ">>> [Now] %.1f", elapsed);
-			if (st_bcas && (st_bcas_input_type == INPUT_TYPE_FX2 || st_bcas_input_type == INPUT_TYPE_FILE)) {
-				g_string_append_printf(infoline, " [ECM] fail:%d", bcas_status.n_ecm_failure);
-			}
-			if (st_b25_queue) {
-				g_string_append_printf(infoline, " latency:%.3f-%.3f",
-									   bcas_status.min_ecm_latecy, bcas_status.max_ecm_latecy);
-				g_string_append_printf(infoline, " [TS] capacity:%.2fM(%3d%%)",
-									   (gdouble)st_b25_queue_size / (1024 * 1024),
-									   (gsize)((gdouble)st_b25_queue_size / MAX_B25_QUEUE_SIZE * 100));
+				if (sniffer->is_failed) {
+					g_string_append(infoline, " [FAILED]");
+					continue;
+				}
+
+				check_tuner_lock(sniffer);
+				if (sniffer->switch_timer && !g_atomic_int_get(&sniffer->is_tuner_locked)) {
+					g_string_append_printf(infoline, " [TUNE] %.1f", g_timer_elapsed(sniffer->switch_timer, NULL));
+				}
+
+				if (!sniffer->bcas || (st_bcas_input_type != INPUT_TYPE_FX2 && st_bcas_input_type != INPUT_TYPE_FILE)) {
+					memset(&bcas_status, 0, sizeof(bcas_status));
+				} else {
+					((PSEUDO_B_CAS_CARD *)sniffer->bcas)->get_status(sniffer->bcas, &bcas_status);
+					g_string_append_printf(infoline, " [ECM] fail:%d", bcas_status.n_ecm_failure);
+				}
+
+				if (st_b25_queue && sniffer->ts_disposed_time < .0) {
+					if (bcas_status.n_ecm_arrived > 0) {
+						sniffer->ts_disposed_time = elapsed;
+						g_message("*** dispose leading TS stream by %.1f seconds", sniffer->ts_disposed_time);
+					}
+				}
+
+				if (sniffer->transfer_ts) {
+					cusbfx2_transfer_stats ts_stats;
+					cusbfx2_get_transfer_stats(sniffer->transfer_ts, &ts_stats);
+					g_string_append_printf(infoline, " [USB] %.2fMB/s gap:%.1fms",
+										   ts_stats.bytes_per_sec / (1024 * 1024), ts_stats.max_gap * 1000);
+					if (sniffer->n_stalls > 0) {
+						g_string_append_printf(infoline, " stall:%u", sniffer->n_stalls);
+					}
+				}
+				ts_sync_get_stats(sniffer->ts_sync, &sync_stats);
+				if (sync_stats.n_sync_losses > 0) {
+					g_string_append_printf(infoline, " [SYNC] resync:%u lost:%"G_GUINT64_FORMAT,
+										   sync_stats.n_resyncs, sync_stats.n_lost_bytes);
+				}
+				psi_tables_get_status(sniffer->psi, &psi_status);
+				if (psi_status.n_crc_errors > 0) {
+					g_string_append_printf(infoline, " [PSI] crc:%u", psi_status.n_crc_errors);
+				}
+				n_pcr_status = pcr_tracker_get_status(sniffer->pcr_tracker, pcr_status, G_N_ELEMENTS(pcr_status));
+				if (n_pcr_status > 0) {
+					gdouble max_jitter = 0, max_delay = 0;
+					for (j = 0; j < n_pcr_status; ++j) {
+						max_jitter = MAX(max_jitter, pcr_status[j].jitter);
+						max_delay = MAX(max_delay, pcr_status[j].delay);
+					}
+					g_string_append_printf(infoline, " [PCR] %.2fMbps jitter:%.1fms delay:%.1fms",
+										   pcr_status[0].ts_bitrate / 1000000, max_jitter * 1000, max_delay * 1000);
+				}
+				pid_stats_get_totals(sniffer->pid_stats, &pid_totals);
+				if (pid_totals.n_cc_errors > 0 || pid_totals.n_tei > 0) {
+					g_string_append_printf(infoline, " [ERR] cc:%u tei:%u", pid_totals.n_cc_errors, pid_totals.n_tei);
+				}
+				if (sniffer->pid_stats_path && elapsed - sniffer->pid_stats_time >= PID_STATS_INTERVAL) {
+					sniffer->pid_stats_time = elapsed;
+					write_pid_stats(sniffer);
+				}
+				if (st_b25_queue) {
+					g_string_append_printf(infoline, " latency:%.3f-%.3f",
+										   bcas_status.min_ecm_latecy, bcas_status.max_ecm_latecy);
+					g_string_append_printf(infoline, " [TS] capacity:%.2fM(%3d%%)",
+										   (gdouble)st_b25_queue_size / (1024 * 1024),
+										   (gsize)((gdouble)st_b25_queue_size / MAX_B25_QUEUE_SIZE * 100));
+				}
 			}
 			if (!st_is_quiet) fprintf(stderr, "%s\r", infoline->str);
 
@@ -659,103 +1732,150 @@ run(void)
 		g_message("### FINISHED SHUTDOWN ###");
 	}
 
+#ifdef HAVE_LIBUSB
+	for (i = 0; i < st_n_sniffers; ++i) {
+		if (st_sniffers[i].transfer_ts) {
+			gchar *name = g_strdup_printf("TS<%d>", st_sniffers[i].fx2_id);
+			info_transfer(st_sniffers[i].transfer_ts, name);
+			g_free(name);
+		}
+	}
+#endif
+	for (i = 0; i < st_n_sniffers; ++i) {
+		TsSyncStats sync_stats;
+		PidStatsCounters pid_totals;
+		PcrTrackerStatus pcr_status[PSI_MAX_PROGRAMS];
+		guint n_pcr_status, j;
+
+		ts_sync_get_stats(st_sniffers[i].ts_sync, &sync_stats);
+		g_message("> TS<%d>: %"G_GUINT64_FORMAT" packets, sync lost:%u resync:%u dropped:%"G_GUINT64_FORMAT" bytes",
+				  st_sniffers[i].fx2_id, sync_stats.n_packets, sync_stats.n_sync_losses,
+				  sync_stats.n_resyncs, sync_stats.n_lost_bytes);
+		if (st_sniffers[i].pid_filter) {
+			guint64 n_passed, n_dropped;
+			pid_filter_get_stats(st_sniffers[i].pid_filter, &n_passed, &n_dropped);
+			g_message("> TS<%d>: PID filter passed:%"G_GUINT64_FORMAT" dropped:%"G_GUINT64_FORMAT" packets",
+					  st_sniffers[i].fx2_id, n_passed, n_dropped);
+		}
+		pid_stats_get_totals(st_sniffers[i].pid_stats, &pid_totals);
+		g_message("> TS<%d>: continuity errors:%u transport errors:%u scrambled:%"G_GUINT64_FORMAT" packets",
+				  st_sniffers[i].fx2_id, pid_totals.n_cc_errors, pid_totals.n_tei, pid_totals.n_scrambled);
+		if (st_sniffers[i].pid_stats_path) {
+			write_pid_stats(&st_sniffers[i]);
+		}
+		n_pcr_status = pcr_tracker_get_status(st_sniffers[i].pcr_tracker, pcr_status, G_N_ELEMENTS(pcr_status));
+		for (j = 0; j < n_pcr_status; ++j) {
+			g_message("> TS<%d>: program 0x%04x %.2fMbps (TS %.2fMbps) PCR jitter:%.1fms delay:%.1fms discontinuity:%u",
+					  st_sniffers[i].fx2_id, pcr_status[j].program_number, pcr_status[j].bitrate / 1000000,
+					  pcr_status[j].ts_bitrate / 1000000, pcr_status[j].jitter * 1000, pcr_status[j].delay * 1000,
+					  pcr_status[j].n_discontinuities);
+		}
+	}
+
 	/* TS転送を止め、対応するであろう鍵を受け取るまで待つ */
-	if (st_b25_queue && st_bcas_input_type == INPUT_TYPE_FX2 && ts_disposed_time > .0) {
+	for (i = 0; i < st_n_sniffers; ++i) {
+		Sniffer *sniffer = &st_sniffers[i];
+
+		if (st_b25_queue && st_bcas_input_type == INPUT_TYPE_FX2 && sniffer->ts_disposed_time > .0) {
 #ifdef HAVE_LIBUSB
-		g_message("*** waiting for last ECM");
-		if (transfer_ts) {
-			capsts_cmd_push(CMD_EP6IN_STOP);
-			capsts_cmd_commit(device);
-			cusbfx2_free_transfer(transfer_ts);
-			transfer_ts = NULL;
-		}
-
-		st_is_intterupted = FALSE;
-		PseudoBCASStatus before_status, status;
-		((PSEUDO_B_CAS_CARD *)st_bcas)->get_status(st_bcas, &before_status);
-		status = before_status;
-		while (!st_is_intterupted && status.n_ecm_arrived < before_status.n_ecm_arrived + 1) {
-			cusbfx2_poll();
-			((PSEUDO_B_CAS_CARD *)st_bcas)->get_status(st_bcas, &status);
-		}
-
-		if (transfer_bcas) {
-			capsts_cmd_push(CMD_EP4IN_STOP);
-			capsts_cmd_commit(device);
-			cusbfx2_free_transfer(transfer_bcas);
-			transfer_bcas = NULL;
-		}
-		g_message("*** waiting for last ECM");
+			g_message("*** waiting for last ECM");
+			capsts_wait_tuner_channel(sniffer->capsts);
+			if (sniffer->transfer_ts) {
+				capsts_cmd_push(sniffer->capsts, CMD_EP6IN_STOP);
+				capsts_cmd_commit(sniffer->capsts);
+				cusbfx2_free_transfer(sniffer->transfer_ts);
+				sniffer->transfer_ts = NULL;
+			}
+
+			st_is_intterupted = FALSE;
+			PseudoBCASStatus before_status, status;
+			((PSEUDO_B_CAS_CARD *)sniffer->bcas)->get_status(sniffer->bcas, &before_status);
+			status = before_status;
+			while (!st_is_intterupted && status.n_ecm_arrived < before_status.n_ecm_arrived + 1) {
+				poll_cusbfx2();
+				((PSEUDO_B_CAS_CARD *)sniffer->bcas)->get_status(sniffer->bcas, &status);
+			}
+
+			if (sniffer->transfer_bcas) {
+				capsts_cmd_push(sniffer->capsts, CMD_EP4IN_STOP);
+				capsts_cmd_commit(sniffer->capsts);
+				cusbfx2_free_transfer(sniffer->transfer_bcas);
+				sniffer->transfer_bcas = NULL;
+			}
+			g_message("*** waiting for last ECM");
 #endif
+		}
 	}
 
  quit:
 	/* finalize */
 	restore_sighandler();
 
+	/* 転送を止めている間に届いたデータもキューに積まれるので、転送とイベントスレッドを先に止める */
 	if (st_is_use_cusbfx2) {
 #ifdef HAVE_LIBUSB
-		if (is_cusbfx2_started) {
-			g_message("*** set CUSBFX2 to idle mode");
-			if (transfer_ts) capsts_cmd_push(CMD_EP6IN_STOP);
-			if (transfer_bcas) capsts_cmd_push(CMD_EP4IN_STOP);
-			capsts_cmd_push(CMD_MODE_IDLE);
-			capsts_cmd_commit(device);
+		for (i = 0; i < st_n_sniffers; ++i) {
+			stop_cusbfx2(&st_sniffers[i], is_cusbfx2_started);
 		}
+		if (is_cusbfx2_inited) cusbfx2_stop_event_thread();
+#endif
+	}
 
-		if (st_is_intterupted) {
-			if (transfer_ts) cusbfx2_cancel_transfer(transfer_ts);
-			if (transfer_bcas) cusbfx2_cancel_transfer(transfer_bcas);
+	/* キューを処理し切って、B25 スレッドが持つ TS 転送バッファの参照を返させる。
+	   最後の参照が返るとリングが破棄され、デバイスの参照も外れる */
+	for (i = 0; i < st_n_sniffers; ++i) {
+		if (st_sniffers[i].b25_thread) {
+			st_sniffers[i].is_b25_running = FALSE;
+			g_thread_join(st_sniffers[i].b25_thread);
+			st_sniffers[i].b25_thread = NULL;
 		}
-		if (transfer_ts) cusbfx2_free_transfer(transfer_ts);
-		if (transfer_bcas) cusbfx2_free_transfer(transfer_bcas);
+	}
 
-		if (device) cusbfx2_close(device);
+	if (st_is_use_cusbfx2) {
+#ifdef HAVE_LIBUSB
+		for (i = 0; i < st_n_sniffers; ++i) {
+			capsts_close(st_sniffers[i].capsts);
+			st_sniffers[i].capsts = NULL;
+		}
 		if (is_cusbfx2_inited) cusbfx2_exit();
 #endif
 	}
 
-	/* flush */
-	if (st_b25) {
-		gint r;
-		ARIB_STD_B25_BUFFER buffer;
-
-		/* wait for b25 thread to finish ... */
-		if (st_b25_thread) {
-			st_is_b25_running = FALSE;
-			g_thread_join(st_b25_thread);
-		}
-
-		g_message("*** flush B25 decoder");
-		r = st_b25->flush(st_b25);
-		if (r < 0) {
-			g_warning("!!! ARIB_STD_B25::flush failed (%d)", r);
-		}
+	for (i = 0; i < st_n_sniffers; ++i) {
+		Sniffer *sniffer = &st_sniffers[i];
 
-		r = st_b25->get(st_b25, &buffer);
-		if (r < 0) {
-			g_warning("!!! ARIB_STD_B25::get failed (%d)", r);
-		} else if (buffer.size > 0) {
-			GError *error = NULL;
-			gsize written;
-			g_io_channel_write_chars(st_b25_output_io, (gchar *)buffer.data, buffer.size, &written, &error);
-			if (error) {
-				g_warning("!!! %s", error->message);
-				g_clear_error(&error);
-			}
+		/* flush */
+		if (sniffer->b25) {
+			finalize_b25(sniffer);
+			sniffer->b25->release(sniffer->b25);
 		}
-
-		info_b25(st_b25);
-
-		if (st_b25) st_b25->release(st_b25);
-		if (st_bcas) st_bcas->release(st_bcas);
+		if (sniffer->bcas) sniffer->bcas->release(sniffer->bcas);
+		if (sniffer->b25_async_queue) g_async_queue_unref(sniffer->b25_async_queue);
+		g_free(sniffer->b25_ranges);
+
+		if (sniffer->tuner_lock) tuner_lock_free(sniffer->tuner_lock);
+		ts_sync_free(sniffer->ts_sync);
+		pid_filter_free(sniffer->pid_filter);
+		psi_tables_free(sniffer->psi);
+		pid_stats_free(sniffer->pid_stats);
+		pcr_tracker_free(sniffer->pcr_tracker);
+		g_free(sniffer->pid_stats_path);
+		if (sniffer->tuner_lock_mutex) g_mutex_free(sniffer->tuner_lock_mutex);
+		if (sniffer->switch_timer) g_timer_destroy(sniffer->switch_timer);
+
+		close_demux_outputs(sniffer->b25_demux, sniffer->b25_demux_ios);
+		close_demux_outputs(sniffer->ts_demux, sniffer->ts_demux_ios);
+		ts_sync_free(sniffer->b25_sync);
+		if (sniffer->b25_output_io) g_io_channel_shutdown(sniffer->b25_output_io, TRUE, NULL);
+		if (sniffer->bcas_output_io) g_io_channel_shutdown(sniffer->bcas_output_io, TRUE, NULL);
+		if (sniffer->ts_output_io) g_io_channel_shutdown(sniffer->ts_output_io, TRUE, NULL);
 	}
-
-	if (st_b25_output_io) g_io_channel_shutdown(st_b25_output_io, TRUE, NULL);
-	if (st_bcas_output_io) g_io_channel_shutdown(st_bcas_output_io, TRUE, NULL);
-	if (st_ts_output_io) g_io_channel_shutdown(st_ts_output_io, TRUE, NULL);
 	if (st_bcas_input_io) g_io_channel_shutdown(st_bcas_input_io, TRUE, NULL);
 	if (st_ts_input_io) g_io_channel_shutdown(st_ts_input_io, TRUE, NULL);
+
+	g_free(st_sniffers);
+	st_sniffers = NULL;
+	st_n_sniffers = 0;
 }
 
 static GString *
@@ -777,22 +1897,23 @@ dump_bcas_init_status()
 	gint r;
 	B_CAS_INIT_STATUS init;
 	GString *hex;
+	B_CAS_CARD *bcas = NULL;
 
 #ifdef HAVE_LIBPCSCLITE
-	st_bcas = create_b_cas_card();
-	if (!st_bcas) {
+	bcas = create_b_cas_card();
+#endif
+	if (!bcas) {
 		g_critical("!!! couldn't create B-CAS card reader");
 		goto quit;
 	}
-#endif
 
-	r = st_bcas->init(st_bcas);
+	r = bcas->init(bcas);
 	if (r < 0) {
 		g_critical("!!! couldn't initialize B-CAS card reader (%d)", r);
 		goto quit;
 	}
 
-	r = st_bcas->get_init_status(st_bcas, &init);
+	r = bcas->get_init_status(bcas, &init);
 	if (r < 0) {
 		g_critical("!!! couldn't get B-CAS init status (%d)", r);
 		goto quit;
@@ -809,7 +1930,7 @@ dump_bcas_init_status()
 	g_string_free(hex, TRUE);
 
  quit:
-	if (st_bcas) st_bcas->release(st_bcas);
+	if (bcas) bcas->release(bcas);
 }
 
 /**
@@ -868,6 +1989,7 @@ load_key_file(void)
 	if (g_key_file_load_from_file(keyfile, path->str, G_KEY_FILE_NONE, &error)) {
 		st_b25_system_key = g_key_file_get_string(keyfile, "b25", "system_key", NULL);
 		st_b25_init_cbc = g_key_file_get_string(keyfile, "b25", "init_cbc", NULL);
+		st_ts_service = g_key_file_get_string(keyfile, "ts", "service", NULL);
 	} else {
 		if (error) g_warning("[load_key_file] %s", error->message);
 		g_clear_error(&error);
@@ -905,7 +2027,49 @@ parse_options(int *argc, char ***argv)
 	}
 
 	st_ir_base = CLAMP(st_ir_base, 1, 3);
-	st_ir_source = CLAMP(st_ir_source, -1, 2);
+
+	st_fx2_ids = g_array_new(FALSE, FALSE, sizeof(gint));
+	if (st_fx2_id) {
+		gchar **ids;
+		gint i;
+
+		ids = g_strsplit(st_fx2_id, ",", -1);
+		for (i = 0; ids[i]; ++i) {
+			gchar *end;
+			gint id = g_ascii_strtoll(ids[i], &end, 10);
+			if (end == ids[i] || *end) {
+				g_critical("!!! invalid CUSBFX2 ID <%s>", ids[i]);
+				g_strfreev(ids);
+				return FALSE;
+			}
+			g_array_append_val(st_fx2_ids, id);
+		}
+		g_strfreev(ids);
+	}
+	if (st_fx2_ids->len == 0) {
+		gint id = 0;
+		g_array_append_val(st_fx2_ids, id);
+	}
+
+	st_ts_service_ids = g_array_new(FALSE, FALSE, sizeof(guint));
+	if (st_ts_service) {
+		gchar **ids;
+		gint i;
+
+		ids = g_strsplit(st_ts_service, ",", -1);
+		for (i = 0; ids[i]; ++i) {
+			gchar *end;
+			guint64 value = g_ascii_strtoull(ids[i], &end, 0);
+			guint id = value;
+			if (end == ids[i] || *end || value > 0xFFFF) {
+				g_critical("!!! invalid service ID <%s>", ids[i]);
+				g_strfreev(ids);
+				return FALSE;
+			}
+			g_array_append_val(st_ts_service_ids, id);
+		}
+		g_strfreev(ids);
+	}
 
 	if (st_b25_ts_delay_string) {
 		st_b25_ts_delay = g_ascii_strtod(st_b25_ts_delay_string, NULL);
@@ -938,6 +2102,36 @@ parse_options(int *argc, char ***argv)
 		return FALSE;
 	}
 
+	/* サービスごとに出力する場合 */
+	if (st_ts_service_ids->len == 0) {
+		const gchar *outputs[] = { st_ts_output, st_b25_output };
+		guint i;
+
+		for (i = 0; i < G_N_ELEMENTS(outputs); ++i) {
+			if (outputs[i] && strstr(outputs[i], DEMUX_OUTPUT_TAG)) {
+				g_critical("!!! output <%s> with "DEMUX_OUTPUT_TAG" requires --ts-service", outputs[i]);
+				return FALSE;
+			}
+		}
+	}
+
+	/* 複数の CUSBFX2 から同時に取得する場合 */
+	if (st_fx2_ids->len > 1) {
+		const gchar *outputs[] = { st_ts_output, st_bcas_output, st_b25_output, st_ts_stats };
+		guint i;
+
+		if (st_ts_input_type != INPUT_TYPE_FX2 || st_bcas_input_type != INPUT_TYPE_FX2) {
+			g_critical("!!! multiple CUSBFX2 require --ts-input="INPUT_TYPE_FX2_PREFIX" and --bcas-input="INPUT_TYPE_FX2_PREFIX);
+			return FALSE;
+		}
+		for (i = 0; i < G_N_ELEMENTS(outputs); ++i) {
+			if (outputs[i] && !strstr(outputs[i], "%d")) {
+				g_critical("!!! output <%s> must contain %%d for multiple CUSBFX2", outputs[i]);
+				return FALSE;
+			}
+		}
+	}
+
 	return TRUE;
 }
 
@@ -1003,5 +2197,5 @@ main(int argc, char **argv)
 		run();
 	}
 
-	return 0;
+	return st_is_capture_failed ? 1 : 0;
 }